@@ -0,0 +1,131 @@
+// Measures what prefetch hints buy a streaming chain of tasks, each of which reads a block of memory that
+// nothing else touches, submitted with and without TASK_ATTRIBUTES::prefetch
+//
+// Usage: PrefetchBench [threads] [blocks] [block KB] [passes] [scatter]
+// With scatter set, each task visits its block's cache lines out of order, which the hardware prefetcher can't
+// follow on its own
+
+#include <windows.h>
+#include <Pool.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+using namespace pool;
+
+struct SBlock
+{
+	std::vector<uint8_t> m_Data;
+	uint64_t m_Sum;
+};
+
+// the number of cache lines to step over between visits, when scattering; odd, so every line gets visited
+static size_t s_Stride = 1;
+
+// Sums the block a cache line at a time, so the task is bound by how fast its memory arrives
+IThreadPool::TASK_RETURN __cdecl SumBlock(void *param0, void *param1, size_t task_number)
+{
+	SBlock *pblock = (SBlock *)param0;
+
+	size_t lines = pblock->m_Data.size() / 64;
+
+	uint64_t sum = 0;
+	for (size_t i = 0, line = 0; i < lines; i++, line = (line + s_Stride) % lines)
+		sum += pblock->m_Data[line * 64];
+
+	pblock->m_Sum = sum;
+
+	return IThreadPool::TR_OK;
+}
+
+// Evicts the blocks from the cache between passes by streaming through something bigger than it
+static void Scrub(std::vector<uint8_t> &scrub)
+{
+	for (size_t i = 0; i < scrub.size(); i += 64)
+		scrub[i]++;
+}
+
+// Runs one pass over the blocks, each a task of its own, returning how long it took in milliseconds
+static double RunPass(IThreadPool *ppool, std::vector<SBlock> &blocks, bool hints)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	ITaskGroup *pgroup = ppool->CreateTaskGroup();
+
+	for (auto &b : blocks)
+	{
+		IThreadPool::PREFETCH_HINT hint;
+		hint.address = b.m_Data.data();
+		hint.length = b.m_Data.size();
+
+		IThreadPool::TASK_ATTRIBUTES attr;
+		attr.group = pgroup;
+		if (hints)
+		{
+			attr.prefetch = &hint;
+			attr.num_prefetch = 1;
+		}
+
+		ppool->RunTaskEx(attr, SumBlock, &b, nullptr);
+	}
+
+	// with no threads, this is where the tasks run
+	if (!ppool->GetNumThreads())
+		ppool->Flush();
+
+	pgroup->Wait(INFINITE);
+	pgroup->Release();
+
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+	size_t threads = (argc > 1) ? (size_t)atoi(argv[1]) : 1;
+	size_t num_blocks = (argc > 2) ? (size_t)atoi(argv[2]) : 4096;
+	size_t block_size = ((argc > 3) ? (size_t)atoi(argv[3]) : 64) << 10;
+	size_t passes = (argc > 4) ? (size_t)atoi(argv[4]) : 9;
+	bool scatter = (argc > 5) && atoi(argv[5]);
+
+	if (scatter)
+		s_Stride = 97;
+
+	std::vector<SBlock> blocks(num_blocks);
+	for (auto &b : blocks)
+		b.m_Data.assign(block_size, 1);
+
+	std::vector<uint8_t> scrub(64 << 20);
+
+	IThreadPool *ppool = IThreadPool::Create(threads);
+	if (!ppool)
+		return 1;
+
+	printf("%zu threads, %zu blocks of %zuKB%s, median of %zu passes\n", threads, num_blocks, block_size >> 10, scatter ? " (scattered)" : "", passes);
+
+	double median[2];
+	for (int hints = 0; hints < 2; hints++)
+	{
+		std::vector<double> ms;
+		for (size_t p = 0; p < passes; p++)
+		{
+			Scrub(scrub);
+			ms.push_back(RunPass(ppool, blocks, (hints != 0)));
+		}
+
+		std::sort(ms.begin(), ms.end());
+		median[hints] = ms[ms.size() / 2];
+
+		printf("%-14s %8.2f ms  %6.1f ns/task\n", hints ? "prefetch" : "no prefetch", median[hints], median[hints] * 1e6 / num_blocks);
+	}
+
+	printf("speedup        %8.2fx\n", median[0] / median[1]);
+
+	ppool->Release();
+
+	return 0;
+}
@@ -0,0 +1,355 @@
+/*
+
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	Pool is free software; you can redistribute it and/or modify it under
+	the terms of the MIT License:
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+
+*/
+
+#pragma once
+
+// A typed object pool for recycling things tasks allocate over and over (scratch buffers, staging blocks, etc.)
+//
+// Each worker thread keeps a small cache of objects that only it touches, so getting and putting objects on a worker
+// takes no locks and tends to hand back whatever that worker used last, which is likely still in its cache.
+// Objects put back on a different worker than the one that got them are returned to that worker through a lock-free
+// list, caches that overflow spill into a bounded depot shared by everyone (anything beyond that is deleted), and
+// whenever a worker runs out of tasks it gives back the objects it didn't need since the last time it was idle.
+//
+// Objects are constructed once and then reused as they are; they are not reset between uses.
+// Every object must be put back before the TObjectPool is destroyed, and the TObjectPool must be destroyed before the
+// thread pool it was created with.
+
+#include <Pool.h>
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+
+namespace pool
+{
+
+template <class T> class TObjectPool
+{
+
+protected:
+
+	// The object lives in raw storage behind the bookkeeping, so the node stays standard layout whatever T is
+	// and the node can be found from the object with offsetof
+	struct SNode
+	{
+		// the worker the object was last given to, or NO_HOME
+		size_t m_Home;
+
+		SNode *m_pNext;
+
+		alignas(T) unsigned char m_Storage[sizeof(T)];
+	};
+
+	static SNode *NewNode()
+	{
+		SNode *n = new SNode;
+		new (n->m_Storage) T;
+		return n;
+	}
+
+	static void DeleteNode(SNode *n)
+	{
+		GetObject(n)->~T();
+		delete n;
+	}
+
+	static T *GetObject(SNode *n)
+	{
+		return std::launder(reinterpret_cast<T *>(n->m_Storage));
+	}
+
+	static SNode *GetNode(T *obj)
+	{
+		return reinterpret_cast<SNode *>(reinterpret_cast<unsigned char *>(obj) - offsetof(SNode, m_Storage));
+	}
+
+	static const size_t NO_HOME = (size_t)-1;
+
+	// One for each worker thread, only touched by that worker... except for m_pReturns
+	struct alignas(64) SCache
+	{
+		std::vector<SNode *> m_Objects;
+
+		// the fewest objects the cache held since the last time the worker was idle; that many weren't needed
+		size_t m_LowWater;
+
+		// objects that other threads put back, pushed with an exchange and taken all at once by the owner
+		std::atomic<SNode *> m_pReturns;
+	};
+
+	IThreadPool *m_pPool;
+	uint32_t m_IdleHook;
+
+	SCache *m_pCache;
+	size_t m_NumCaches;
+	size_t m_CacheSize;
+
+	std::vector<SNode *> m_Depot;
+	std::mutex m_mutexDepot;
+	size_t m_DepotSize;
+
+	std::atomic<size_t> m_NumCreated;
+
+	// Moves objects to the depot, deleting whatever doesn't fit
+	void ToDepot(SNode **nodes, size_t count)
+	{
+		size_t kept = 0;
+
+		{
+			std::lock_guard<std::mutex> l(m_mutexDepot);
+
+			kept = std::min<size_t>(count, m_DepotSize - std::min<size_t>(m_DepotSize, m_Depot.size()));
+			m_Depot.insert(m_Depot.end(), nodes, nodes + kept);
+		}
+
+		for (size_t i = kept; i < count; i++)
+			DeleteNode(nodes[i]);
+
+		m_NumCreated.fetch_sub(count - kept);
+	}
+
+	// Moves what other threads returned to the worker into its cache, as far as it has room, and the rest to the depot
+	void CollectReturns(SCache &c)
+	{
+		if (!c.m_pReturns.load(std::memory_order_relaxed))
+			return;
+
+		SNode *spill[64];
+		size_t num_spill = 0;
+
+		SNode *n = c.m_pReturns.exchange(nullptr, std::memory_order_acquire);
+		while (n)
+		{
+			SNode *next = n->m_pNext;
+
+			if (c.m_Objects.size() < m_CacheSize)
+			{
+				c.m_Objects.push_back(n);
+			}
+			else
+			{
+				spill[num_spill++] = n;
+
+				if (num_spill == (sizeof(spill) / sizeof(spill[0])))
+				{
+					ToDepot(spill, num_spill);
+					num_spill = 0;
+				}
+			}
+
+			n = next;
+		}
+
+		if (num_spill)
+			ToDepot(spill, num_spill);
+	}
+
+	// Spills the older half of an overflowing cache into the depot
+	void Spill(SCache &c)
+	{
+		if (c.m_Objects.size() <= m_CacheSize)
+			return;
+
+		size_t n = c.m_Objects.size() - (m_CacheSize / 2);
+		ToDepot(c.m_Objects.data(), n);
+		c.m_Objects.erase(c.m_Objects.begin(), c.m_Objects.begin() + n);
+
+		c.m_LowWater = std::min<size_t>(c.m_LowWater, c.m_Objects.size());
+	}
+
+	void Trim(size_t worker)
+	{
+		if (worker >= m_NumCaches)
+			return;
+
+		SCache &c = m_pCache[worker];
+
+		CollectReturns(c);
+
+		size_t n = std::min<size_t>(c.m_LowWater, c.m_Objects.size());
+		if (n)
+		{
+			ToDepot(c.m_Objects.data(), n);
+			c.m_Objects.erase(c.m_Objects.begin(), c.m_Objects.begin() + n);
+		}
+
+		c.m_LowWater = c.m_Objects.size();
+	}
+
+	static void __cdecl _OnIdle(size_t worker_index, void *userdata)
+	{
+		((TObjectPool<T> *)userdata)->Trim(worker_index);
+	}
+
+public:
+
+	// cache_size is the number of objects each worker keeps for itself, and depot_size the number kept for everyone
+	TObjectPool(IThreadPool *ppool, size_t cache_size = 8, size_t depot_size = 64)
+	{
+		m_pPool = ppool;
+		m_NumCaches = ppool->GetNumThreads();
+		m_pCache = m_NumCaches ? new SCache[m_NumCaches] : nullptr;
+		m_CacheSize = std::max<size_t>(1, cache_size);
+		m_DepotSize = depot_size;
+		m_NumCreated = 0;
+
+		for (size_t i = 0; i < m_NumCaches; i++)
+		{
+			m_pCache[i].m_Objects.reserve(m_CacheSize * 2);
+			m_pCache[i].m_LowWater = 0;
+			m_pCache[i].m_pReturns = nullptr;
+		}
+
+		m_IdleHook = ppool->AddIdleHook(_OnIdle, this);
+	}
+
+	~TObjectPool()
+	{
+		// once this returns, no worker is trimming anymore
+		m_pPool->RemoveIdleHook(m_IdleHook);
+
+		for (size_t i = 0; i < m_NumCaches; i++)
+		{
+			CollectReturns(m_pCache[i]);
+
+			for (SNode *n : m_pCache[i].m_Objects)
+				DeleteNode(n);
+		}
+
+		delete [] m_pCache;
+
+		for (SNode *n : m_Depot)
+			DeleteNode(n);
+	}
+
+	// Returns an object, recycled if possible
+	T *Get()
+	{
+		size_t worker = m_pPool->GetCurrentWorkerIndex();
+
+		SNode *n = nullptr;
+
+		if (worker < m_NumCaches)
+		{
+			SCache &c = m_pCache[worker];
+
+			if (c.m_Objects.empty())
+				CollectReturns(c);
+
+			if (c.m_Objects.empty())
+			{
+				// refill half the cache from the depot
+				std::lock_guard<std::mutex> l(m_mutexDepot);
+
+				size_t count = std::min<size_t>(m_Depot.size(), std::max<size_t>(1, m_CacheSize / 2));
+				c.m_Objects.insert(c.m_Objects.end(), m_Depot.end() - count, m_Depot.end());
+				m_Depot.resize(m_Depot.size() - count);
+			}
+
+			if (!c.m_Objects.empty())
+			{
+				n = c.m_Objects.back();
+				c.m_Objects.pop_back();
+
+				c.m_LowWater = std::min<size_t>(c.m_LowWater, c.m_Objects.size());
+			}
+		}
+		else
+		{
+			std::lock_guard<std::mutex> l(m_mutexDepot);
+
+			if (!m_Depot.empty())
+			{
+				n = m_Depot.back();
+				m_Depot.pop_back();
+			}
+		}
+
+		if (!n)
+		{
+			n = NewNode();
+			m_NumCreated.fetch_add(1);
+		}
+
+		n->m_Home = (worker < m_NumCaches) ? worker : NO_HOME;
+
+		return GetObject(n);
+	}
+
+	// Puts an object from Get back, so it can be reused
+	void Put(T *obj)
+	{
+		if (!obj)
+			return;
+
+		SNode *n = GetNode(obj);
+
+		size_t worker = m_pPool->GetCurrentWorkerIndex();
+
+		if ((n->m_Home != NO_HOME) && (n->m_Home != worker))
+		{
+			// back to the worker that had it
+			SCache &home = m_pCache[n->m_Home];
+
+			SNode *head = home.m_pReturns.load(std::memory_order_relaxed);
+			do
+			{
+				n->m_pNext = head;
+			}
+			while (!home.m_pReturns.compare_exchange_weak(head, n, std::memory_order_release, std::memory_order_relaxed));
+
+			return;
+		}
+
+		if (worker < m_NumCaches)
+		{
+			SCache &c = m_pCache[worker];
+
+			c.m_Objects.push_back(n);
+			Spill(c);
+
+			return;
+		}
+
+		ToDepot(&n, 1);
+	}
+
+	// Returns the number of objects that currently exist, whether in use or waiting to be reused
+	size_t GetNumObjects()
+	{
+		return m_NumCreated.load();
+	}
+};
+
+};
@@ -0,0 +1,486 @@
+/*
+
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	Pool is free software; you can redistribute it and/or modify it under
+	the terms of the MIT License:
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+
+*/
+
+#pragma once
+
+// Radix partitioning and hash group-by on the pool, for join and aggregation stages that split big tables by key hash.
+//
+//   std::vector<size_t> offsets((1 << 10) + 1);
+//   pool::ParallelPartition(ppool, rows, parted, count, 10, [](const SRow &r) { return r.m_Hash; }, offsets.data());
+//
+// ParallelPartition puts the rows of bucket b at parted[offsets[b]] through parted[offsets[b + 1] - 1], keeping
+// their order. Each pass splits the input into one chunk per participant, counts the chunks' buckets (a histogram
+// pass), scans the counts for where each chunk's share of each bucket goes, then scatters the rows through small,
+// cache line aligned write-combining buffers, one per bucket, so the output is written a line at a time instead of
+// one row at a time to a random place; a bucket's first flush only goes up to the next line boundary, so the rest
+// land on whole lines. More than PARTITION_PASS_BITS bits are done as several passes, least
+// significant bits first, so that each pass's buffers fit in the L1 and its output streams fit in the TLB.
+//
+//   std::vector<std::pair<uint32_t, double>> totals;
+//   pool::ParallelGroupBy(ppool, rows, count, [](const SRow &r) { return r.m_Customer; },
+//       [](const SRow &r) { return r.m_Amount; }, [](double a, double b) { return a + b; }, totals);
+//
+// ParallelGroupBy partitions the rows by the hash of their key until each partition's table fits in the cache,
+// then aggregates the partitions in parallel. The groups come out in no particular order.
+//
+// The rows have to be trivially copyable, and the key functions are called from several threads at once.
+
+#include <Pool.h>
+
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+#include <iterator>
+#include <new>
+#include <string.h>
+#include <stdint.h>
+
+
+namespace pool
+{
+
+// The most bits a single pass will partition by; 2^8 write-combining buffers of a cache line each fill half a 32KB L1
+static const unsigned PARTITION_PASS_BITS = 8;
+
+// The most bits a partition can be made by
+static const unsigned PARTITION_MAX_BITS = 24;
+
+// Each participant gets at least this many rows
+static const size_t PARTITION_MIN_CHUNK = 4096;
+
+// Finds where each bucket starts in rows that are already partitioned, by looking for the places where the bucket
+// changes, a chunk of the rows at a time; used when the buckets were made in several passes, since only the last
+// pass's (coarser) buckets were counted
+template <class T, class FKey> struct TBucketStartJob
+{
+	const T *m_pRows;
+	size_t m_Count;
+	size_t m_ChunkSize;
+	size_t m_Mask;
+	const FKey *m_pKey;
+	size_t *m_pOffsets;
+
+	size_t Bucket(const T &v) const
+	{
+		return (size_t)(uint64_t)(*m_pKey)(v) & m_Mask;
+	}
+
+	void FindStarts(size_t chunk)
+	{
+		size_t begin = chunk * m_ChunkSize, end = std::min<size_t>(m_Count, begin + m_ChunkSize);
+		if (begin >= end)
+			return;
+
+		// buckets past the last row's are empty, so they start (and end) at count; the last chunk fills those in
+		size_t prev = begin ? Bucket(m_pRows[begin - 1]) : (size_t)-1;
+		for (size_t i = begin; i < end; i++)
+		{
+			size_t b = Bucket(m_pRows[i]);
+
+			// every bucket from the one after the previous row's up to this row's starts here; the empty ones too
+			for (size_t e = prev + 1; e <= b; e++)
+				m_pOffsets[e] = i;
+
+			prev = b;
+		}
+
+		if (end == m_Count)
+		{
+			for (size_t e = prev + 1; e <= m_Mask + 1; e++)
+				m_pOffsets[e] = m_Count;
+		}
+	}
+
+	static void __cdecl RunFindStarts(void *param0, void *param1, size_t begin, size_t end)
+	{
+		for (size_t c = begin; c < end; c++)
+			((TBucketStartJob *)param0)->FindStarts(c);
+	}
+};
+
+// One pass of a radix partition: sorts the rows in [0, m_Count) of m_pIn into m_pOut by ((key >> m_Shift) & m_Mask)
+template <class T, class FKey> struct TPartitionPass
+{
+	const T *m_pIn;
+	T *m_pOut;
+	size_t m_Count;
+	size_t m_ChunkSize;
+	size_t m_NumChunks;
+	unsigned m_Shift;
+	size_t m_Mask;
+	const FKey *m_pKey;
+
+	// a row of m_Mask + 1 counts for each chunk; after the scan, where the chunk's share of each bucket starts
+	std::vector<size_t> m_Hist;
+
+	// rows per write-combining buffer, and the bytes between buffers, so that each one starts a cache line
+	static const size_t WC_ROWS = (sizeof(T) < 64) ? (64 / sizeof(T)) : 1;
+	static const size_t WC_STRIDE = ((WC_ROWS * sizeof(T)) + 63) & ~(size_t)63;
+
+	// a bucket's output cursor, and how full its buffer is and has to get before it's flushed, while a chunk is
+	// scattered; two to a cache line, in a 64 byte aligned block of the chunk's own, so none of them straddles a
+	// line and no two chunks' cursors ever share one
+	struct alignas(32) SCursor
+	{
+		size_t m_Out;
+		size_t m_Fill;
+		size_t m_FlushAt;
+	};
+
+	size_t Bucket(const T &v) const
+	{
+		return (size_t)((uint64_t)(*m_pKey)(v) >> m_Shift) & m_Mask;
+	}
+
+	void CountChunk(size_t chunk)
+	{
+		size_t begin = chunk * m_ChunkSize, end = std::min<size_t>(m_Count, begin + m_ChunkSize);
+		size_t buckets = m_Mask + 1;
+
+		// four histograms, so that runs of the same bucket don't stall on each other's increments; the digits are
+		// worked out a block at a time, ahead of the increments, so the key loads don't wait on them
+		std::vector<size_t> hist(buckets * 4, 0);
+		size_t *h0 = hist.data(), *h1 = h0 + buckets, *h2 = h1 + buckets, *h3 = h2 + buckets;
+
+		static const size_t BLOCK = 16;
+		size_t digit[BLOCK];
+
+		size_t i = begin;
+		for (; i + BLOCK <= end; i += BLOCK)
+		{
+			for (size_t j = 0; j < BLOCK; j++)
+				digit[j] = Bucket(m_pIn[i + j]);
+
+			for (size_t j = 0; j < BLOCK; j += 4)
+			{
+				h0[digit[j]]++;
+				h1[digit[j + 1]]++;
+				h2[digit[j + 2]]++;
+				h3[digit[j + 3]]++;
+			}
+		}
+
+		for (; i < end; i++)
+			h0[Bucket(m_pIn[i])]++;
+
+		size_t *row = &m_Hist[chunk * buckets];
+		for (size_t b = 0; b < buckets; b++)
+			row[b] = h0[b] + h1[b] + h2[b] + h3[b];
+	}
+
+	// Turns the counts into output offsets: bucket by bucket, and within a bucket chunk by chunk, so the order is kept
+	void Scan()
+	{
+		size_t buckets = m_Mask + 1;
+		size_t offset = 0;
+
+		for (size_t b = 0; b < buckets; b++)
+		{
+			for (size_t c = 0; c < m_NumChunks; c++)
+			{
+				size_t n = m_Hist[c * buckets + b];
+				m_Hist[c * buckets + b] = offset;
+				offset += n;
+			}
+		}
+	}
+
+	// Returns how many rows starting at out fill up to the next cache line boundary, or WC_ROWS if out is on one
+	// (or rows never line up with one)
+	static size_t RowsToLine(const T *out)
+	{
+		size_t misalign = (size_t)((uintptr_t)out & 63);
+		if (!misalign || ((64 - misalign) % sizeof(T)) || (sizeof(T) >= 64))
+			return WC_ROWS;
+
+		return (64 - misalign) / sizeof(T);
+	}
+
+	void ScatterChunk(size_t chunk)
+	{
+		size_t begin = chunk * m_ChunkSize, end = std::min<size_t>(m_Count, begin + m_ChunkSize);
+		size_t buckets = m_Mask + 1;
+
+		// the buffers and cursors are the chunk's own, on lines of their own; the scanned offsets in m_Hist are left
+		// alone, for the caller
+		std::align_val_t align = (std::align_val_t)64;
+		unsigned char *buf = (unsigned char *)::operator new(buckets * WC_STRIDE, align);
+		SCursor *cursor = (SCursor *)::operator new(buckets * sizeof(SCursor), align);
+
+		const size_t *start = &m_Hist[chunk * buckets];
+		for (size_t b = 0; b < buckets; b++)
+		{
+			cursor[b].m_Out = start[b];
+			cursor[b].m_Fill = 0;
+			cursor[b].m_FlushAt = RowsToLine(&m_pOut[start[b]]);
+		}
+
+		for (size_t i = begin; i < end; i++)
+		{
+			size_t b = Bucket(m_pIn[i]);
+			SCursor &c = cursor[b];
+			unsigned char *slot = buf + (b * WC_STRIDE);
+
+			memcpy(slot + (c.m_Fill * sizeof(T)), &m_pIn[i], sizeof(T));
+
+			// a full line goes out in one go
+			if (++c.m_Fill == c.m_FlushAt)
+			{
+				memcpy(&m_pOut[c.m_Out], slot, sizeof(T) * c.m_Fill);
+				c.m_Out += c.m_Fill;
+				c.m_Fill = 0;
+				c.m_FlushAt = WC_ROWS;
+			}
+		}
+
+		for (size_t b = 0; b < buckets; b++)
+		{
+			if (cursor[b].m_Fill)
+				memcpy(&m_pOut[cursor[b].m_Out], buf + (b * WC_STRIDE), sizeof(T) * cursor[b].m_Fill);
+		}
+
+		::operator delete(cursor, align);
+		::operator delete(buf, align);
+	}
+
+	// Where each bucket starts in the output, once the counts have been scanned: chunk 0's share comes first
+	const size_t *GetBucketStarts() const
+	{
+		return m_Hist.data();
+	}
+
+	static void __cdecl RunCount(void *param0, void *param1, size_t begin, size_t end)
+	{
+		for (size_t c = begin; c < end; c++)
+			((TPartitionPass *)param0)->CountChunk(c);
+	}
+
+	static void __cdecl RunScatter(void *param0, void *param1, size_t begin, size_t end)
+	{
+		for (size_t c = begin; c < end; c++)
+			((TPartitionPass *)param0)->ScatterChunk(c);
+	}
+};
+
+// Partitions count rows of data into out (which must not overlap data) by the low bits of key(row), converted to a
+// uint64_t, keeping the rows of each bucket in their original order. If offsets isn't null, it must have room for
+// 2^bits + 1 entries and is filled with where each bucket starts in out, plus the total at the end.
+// Returns false if bits is more than PARTITION_MAX_BITS
+template <class T, class FKey> bool ParallelPartition(IThreadPool *pool, const T *data, T *out, size_t count, unsigned bits, FKey key, size_t *offsets = nullptr)
+{
+	static_assert(std::is_trivially_copyable<T>::value, "partitioned rows have to be trivially copyable");
+
+	if (bits > PARTITION_MAX_BITS)
+		return false;
+
+	size_t passes = std::max<size_t>(1, (bits + PARTITION_PASS_BITS - 1) / PARTITION_PASS_BITS);
+
+	// the passes ping-pong between out and a scratch buffer, starting from whichever makes the last one land in out
+	std::allocator<T> alloc;
+	T *scratch = ((passes > 1) && count) ? alloc.allocate(count) : nullptr;
+
+	const T *src = data;
+	T *dst = (passes & 1) ? out : scratch;
+
+	size_t participants = pool->GetNumThreads() + 1;
+	size_t chunks = std::max<size_t>(1, std::min<size_t>(participants, count / PARTITION_MIN_CHUNK));
+
+	unsigned shift = 0;
+	for (size_t p = 0; p < passes; p++)
+	{
+
+		// spread the bits evenly over the passes
+		unsigned pass_bits = (unsigned)((bits - shift) / (passes - p));
+
+		TPartitionPass<T, FKey> pass;
+		pass.m_pIn = src;
+		pass.m_pOut = dst;
+		pass.m_Count = count;
+		pass.m_NumChunks = chunks;
+		pass.m_ChunkSize = (count + chunks - 1) / chunks;
+		pass.m_Shift = shift;
+		pass.m_Mask = ((size_t)1 << pass_bits) - 1;
+		pass.m_pKey = &key;
+		pass.m_Hist.resize(chunks << pass_bits);
+
+		if (count)
+		{
+			pool->ParallelFor(TPartitionPass<T, FKey>::RunCount, &pass, nullptr, chunks, 1);
+			pass.Scan();
+			pool->ParallelFor(TPartitionPass<T, FKey>::RunScatter, &pass, nullptr, chunks, 1);
+		}
+
+		// with a single pass, the scan already worked out where every bucket starts
+		if (offsets && (passes == 1))
+		{
+			size_t buckets = pass.m_Mask + 1;
+
+			if (count)
+				memcpy(offsets, pass.GetBucketStarts(), buckets * sizeof(size_t));
+			else
+				std::fill(offsets, offsets + buckets, (size_t)0);
+
+			offsets[buckets] = count;
+		}
+
+		shift += pass_bits;
+
+		src = dst;
+		dst = (dst == out) ? scratch : out;
+	}
+
+	if (scratch)
+		alloc.deallocate(scratch, count);
+
+	// with several passes, only the last pass's buckets were counted, so the full ones are found in the output
+	if (offsets && (passes > 1))
+	{
+		TBucketStartJob<T, FKey> job;
+		job.m_pRows = out;
+		job.m_Count = count;
+		job.m_ChunkSize = (count + chunks - 1) / chunks;
+		job.m_Mask = ((size_t)1 << bits) - 1;
+		job.m_pKey = &key;
+		job.m_pOffsets = offsets;
+
+		if (count)
+			pool->ParallelFor(TBucketStartJob<T, FKey>::RunFindStarts, &job, nullptr, chunks, 1);
+		else
+			std::fill(offsets, offsets + job.m_Mask + 2, (size_t)0);
+	}
+
+	return true;
+}
+
+// Spreads the bits of a hash around, so that keys that only differ in their high bits (or hashes that are the keys
+// themselves, like std::hash usually is for integers) still land in different partitions
+inline uint64_t MixPartitionHash(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+// Aggregates the partitions made by ParallelGroupBy, one table per partition
+template <class T, class K, class V, class FKey, class FValue, class Op> struct TGroupByJob
+{
+	const T *m_pRows;
+	const size_t *m_pOffsets;
+	const FKey *m_pKey;
+	const FValue *m_pValue;
+	const Op *m_pOp;
+	std::vector<std::vector<std::pair<K, V>>> m_Groups;
+
+	void AggregatePartition(size_t p)
+	{
+		size_t begin = m_pOffsets[p], end = m_pOffsets[p + 1];
+		if (begin == end)
+			return;
+
+		std::unordered_map<K, V> table;
+		table.reserve(end - begin);
+
+		for (size_t i = begin; i < end; i++)
+		{
+			const T &row = m_pRows[i];
+
+			auto it = table.find((*m_pKey)(row));
+			if (it == table.end())
+				table.emplace((*m_pKey)(row), (*m_pValue)(row));
+			else
+				it->second = (*m_pOp)(it->second, (*m_pValue)(row));
+		}
+
+		std::vector<std::pair<K, V>> &groups = m_Groups[p];
+		groups.reserve(table.size());
+		for (auto &it : table)
+			groups.emplace_back(it.first, std::move(it.second));
+	}
+
+	static void __cdecl RunAggregate(void *param0, void *param1, size_t begin, size_t end)
+	{
+		for (size_t p = begin; p < end; p++)
+			((TGroupByJob *)param0)->AggregatePartition(p);
+	}
+};
+
+// Replaces the contents of groups with one entry for each distinct key(row), paired with the values of its rows
+// folded together with op: op(op(value(first), value(second)), value(third))... in row order. K has to work with
+// std::hash and ==, and op needs to be associative
+template <class T, class K, class V, class FKey, class FValue, class Op>
+void ParallelGroupBy(IThreadPool *pool, const T *data, size_t count, FKey key, FValue value, Op op, std::vector<std::pair<K, V>> &groups)
+{
+	// roughly how many rows each partition should have, so that its table stays in the cache
+	static const size_t GROUP_ROWS = 16384;
+
+	groups.clear();
+
+	if (!count)
+		return;
+
+	unsigned bits = 0;
+	while (((count >> bits) > GROUP_ROWS) && (bits < 16))
+		bits++;
+
+	std::vector<size_t> offsets(((size_t)1 << bits) + 1);
+
+	std::allocator<T> alloc;
+	T *parted = alloc.allocate(count);
+
+	ParallelPartition(pool, data, parted, count, bits, [&key](const T &row) { return MixPartitionHash((uint64_t)std::hash<K>()(key(row))); }, offsets.data());
+
+	TGroupByJob<T, K, V, FKey, FValue, Op> job;
+	job.m_pRows = parted;
+	job.m_pOffsets = offsets.data();
+	job.m_pKey = &key;
+	job.m_pValue = &value;
+	job.m_pOp = &op;
+	job.m_Groups.resize((size_t)1 << bits);
+
+	pool->ParallelFor(TGroupByJob<T, K, V, FKey, FValue, Op>::RunAggregate, &job, nullptr, job.m_Groups.size(), 1);
+
+	alloc.deallocate(parted, count);
+
+	size_t total = 0;
+	for (const auto &g : job.m_Groups)
+		total += g.size();
+
+	groups.reserve(total);
+	for (auto &g : job.m_Groups)
+		std::move(g.begin(), g.end(), std::back_inserter(groups));
+}
+
+};
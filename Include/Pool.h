@@ -52,6 +52,102 @@
 namespace pool
 {
 
+// Tracks the completion of a set of tasks
+class ITaskGroup
+{
+public:
+
+	// Waits for every task in the group to complete, until milliseconds expires... or INFINITE to wait forever
+	// Returns true if the group completed. Worker threads (and threads waiting on a pool with 0 threads) run
+	// queued tasks while they wait, so it's safe to wait from inside a task
+	// While waiting, the group's tasks are boosted to the waiter's priority: that of the task it's running, or
+	// TP_NORMAL for threads outside the pool
+	virtual bool Wait(uint32_t milliseconds) = NULL;
+
+	// Returns true if none of the group's tasks are queued or running
+	virtual bool IsComplete() = NULL;
+
+	// Returns the number of the group's tasks that are queued or running
+	virtual size_t GetPendingCount() = NULL;
+
+	virtual void AddRef() = NULL;
+
+	// Releases the reference; groups must be released before the pool that created them
+	virtual void Release() = NULL;
+
+	typedef struct sMakespanInfo
+	{
+		// seconds from when the group's first task started to when its last one finished
+		double makespan;
+
+		// the shortest makespan any schedule could have achieved with the measured task times:
+		//    max(total_work / threads, longest_task)
+		double lower_bound;
+
+		// the seconds spent running the group's tasks, in total and for the longest one
+		double total_work;
+		double longest_task;
+
+		size_t threads;
+	} MAKESPAN_INFO;
+
+	// Reports how well the group's tasks were scheduled, so far
+	virtual void GetMakespan(MAKESPAN_INFO &info) = NULL;
+};
+
+
+// Collects the completions of tasks submitted with TASK_ATTRIBUTES::completion_port, so that one consumer thread can
+// take them in batches instead of being woken for each one
+class ICompletionPort
+{
+public:
+
+	// Identifies a completed task by the parameters it was run with
+	typedef struct sCompletion
+	{
+		void *param0;
+		void *param1;
+		size_t task_number;
+	} COMPLETION;
+
+	// Takes up to max_count completions, waiting until milliseconds expires (0 to not wait, or INFINITE) if there
+	// are none; returns the number taken. One wakeup delivers everything posted since the consumer went to sleep
+	virtual size_t Dequeue(COMPLETION *completions, size_t max_count, uint32_t milliseconds) = NULL;
+
+	// Posts a completion from any thread, the same way finished tasks do
+	virtual void Post(void *param0, void *param1, size_t task_number) = NULL;
+
+	// When a sleeping consumer is woken with fewer than batch completions waiting, it sleeps again for up to
+	// max_delay_us, until the rest arrive; fewer, bigger batches at the cost of some latency. The default of
+	// 1, 0 wakes the consumer for the first completion
+	virtual void SetCoalescing(size_t batch, uint32_t max_delay_us) = NULL;
+
+	// Returns the number of completions waiting to be dequeued
+	virtual size_t GetPendingCount() = NULL;
+
+	// Returns the number of times a posting thread had to wake the consumer
+	virtual uint64_t GetWakeCount() = NULL;
+
+	virtual void AddRef() = NULL;
+
+	// Releases the reference; tasks keep the port alive until they've posted to it
+	virtual void Release() = NULL;
+};
+
+
+class ITaskScope;
+
+
+// Given to ParallelDo bodies so they can add work as they discover it
+class IWorkList
+{
+public:
+
+	// Adds an item to the worklist; it goes into the calling participant's own bag, which idle participants steal from
+	virtual void Push(void *item) = NULL;
+};
+
+
 class IThreadPool
 {
 public:
@@ -62,6 +158,7 @@ public:
 
 		TR_RERUN,		// the task should be re-run immediately
 		TR_REQUEUE,		// the task should be re-queued
+		TR_YIELD,		// the task should be re-queued ahead of its peers, but behind more urgent work (see ShouldYield)
 	} TASK_RETURN;
 
 	// param0 and param1 are user-supplied values
@@ -87,8 +184,524 @@ public:
 	virtual void PurgeAllPendingTasks() = NULL;
 
 	// Executes all tasks immediately on the calling thread, ideal for task queues as opposed to thread pools (use this mode with 0 threads)
+	// Several threads may call Flush at the same time to drain the queue together; each returns once everything it
+	// helped with is done. Tasks returning TR_REQUEUE are run again by the next Flush
 	virtual void Flush() = NULL;
 
+	// Methods are only ever added below this point, in the order they were introduced, so that the layout of the
+	// interface stays compatible with programs built against an older version of this header
+
+	// param0 and param1 are user-supplied values
+	// begin and end describe the half-open range of indices [begin, end) that should be processed by this call
+	typedef void (__cdecl *RANGE_CALLBACK)(void *param0, void *param1, size_t begin, size_t end);
+
+	// Processes the range [0, count) by splitting it into chunks of grain_size indices (0 picks a default)
+	// The calling thread helps process chunks and this returns once the whole range is done, so it is
+	// safe to call from inside a task or on a pool with 0 threads
+	virtual void ParallelFor(RANGE_CALLBACK func, void *param0, void *param1, size_t count, size_t grain_size = 0) = NULL;
+
+	// The same as ParallelFor, but the grain size is chosen by an autotuner that measures, per callsite, the time
+	// spent on each index and the scheduling overhead of each chunk, then converges on the smallest grain
+	// that keeps the overhead at the target ratio. callsite is any value that uniquely identifies the loop
+	virtual void ParallelForTuned(uint64_t callsite, RANGE_CALLBACK func, void *param0, void *param1, size_t count) = NULL;
+
+	// Sets the ratio of per-chunk scheduling overhead to per-chunk work that the autotuner aims for (default 0.05)
+	virtual void SetGrainTuning(float target_overhead_ratio) = NULL;
+
+	// Returns the grain size the autotuner currently has for callsite, or 0 if it has never been measured
+	virtual size_t GetTunedGrainSize(uint64_t callsite) = NULL;
+
+	// Saves or loads the autotuner's measurements, so that a later run can start with tuned grain sizes; loading
+	// skips entries that aren't valid measurements, and fails if there were none
+	virtual bool SaveGrainTable(const char *filename) = NULL;
+	virtual bool LoadGrainTable(const char *filename) = NULL;
+
+	// Bulk memory operations that split the buffer into page-aligned chunks and process them on the pool.
+	// The chunks are dealt out so each worker handles one contiguous piece, grouped by NUMA node, which
+	// also means memory first touched by ParallelMemset is spread across the nodes of the workers.
+	// Small buffers are simply handled on the calling thread
+
+	// Copies size bytes from src to dst, which must not overlap. nontemporal uses streaming stores that
+	// bypass the cache, which is faster for very large copies whose destination won't be read again soon
+	virtual void ParallelMemcpy(void *dst, const void *src, size_t size, bool nontemporal = false) = NULL;
+
+	// Fills size bytes of dst with value
+	virtual void ParallelMemset(void *dst, int value, size_t size) = NULL;
+
+	// Compares two buffers; the return value has the same meaning as memcmp's
+	virtual int ParallelMemcmp(const void *buf1, const void *buf2, size_t size) = NULL;
+
+	// Computes the CRC-32C (Castagnoli) of the data, continuing from crc, by checksumming the chunks
+	// independently and combining the results
+	virtual uint32_t ParallelCRC32C(const void *data, size_t size, uint32_t crc = 0) = NULL;
+
+	typedef enum
+	{
+		LS_UTILIZATION = 0,		// the smoothed fraction of worker threads that are busy, from 0 to 1
+		LS_ARRIVALRATE,			// the smoothed number of tasks submitted per second
+		LS_COMPLETIONRATE,		// the smoothed number of tasks completed per second
+		LS_QUEUEWAIT,			// the estimated seconds a newly submitted task would wait before starting
+		LS_QUEUELENGTH,			// the number of tasks waiting to run
+
+		LS_NUMSIGNALS
+	} LOAD_SIGNAL;
+
+	typedef struct sLoadInfo
+	{
+		double utilization;
+		double arrival_rate;
+		double completion_rate;
+
+		// queue_length / completion_rate (Little's law); HUGE_VAL if tasks are waiting but none are completing
+		double queue_wait;
+
+		size_t queue_length;
+		size_t busy_threads;
+	} LOAD_INFO;
+
+	// Fills in the current load signals; this only reads atomics, so it is cheap enough to call before every submission
+	virtual void GetLoadInfo(LOAD_INFO &info) = NULL;
+
+	// Sets the time constant of the exponential smoothing used for the load signals (default 100ms)
+	virtual void SetLoadSmoothing(uint32_t milliseconds) = NULL;
+
+	// above is true if the signal crossed the threshold going up, false if going down
+	typedef void (__cdecl *LOAD_CALLBACK)(LOAD_SIGNAL signal, double value, bool above, void *userdata);
+
+	// Calls func whenever the given signal crosses threshold, in either direction. Signals are re-evaluated at most
+	// every 100us, on whichever thread happens to be submitting or finishing a task, so keep callbacks short. No lock is
+	// held while they run, so they may subscribe, unsubscribe or submit tasks
+	// Returns an id to give to UnsubscribeLoad, or 0 on failure
+	virtual uint32_t SubscribeLoad(LOAD_SIGNAL signal, double threshold, LOAD_CALLBACK func, void *userdata = nullptr) = NULL;
+
+	virtual bool UnsubscribeLoad(uint32_t id) = NULL;
+
+	typedef enum
+	{
+		TP_LOW = 0,		// background work, run when nothing else is waiting
+		TP_NORMAL,		// the default
+		TP_HIGH,		// run ahead of everything else, regardless of epoch
+
+		TP_NUMPRIORITIES
+	} TASK_PRIORITY;
+
+	// Returns the estimated cost of running the task with the given task_number; only the relative values matter,
+	// so any unit will do (bytes to process, for example)
+	typedef double (__cdecl *COST_CALLBACK)(void *param0, void *param1, size_t task_number);
+
+	// A range of memory that a task is going to stream through; see TASK_ATTRIBUTES::prefetch
+	typedef struct sPrefetchHint
+	{
+		const void *address;
+		size_t length;
+	} PREFETCH_HINT;
+
+	// The most prefetch hints a RunTaskEx call may carry
+	static constexpr size_t MAX_PREFETCH_HINTS = 4;
+
+	// Optional attributes for tasks submitted with RunTaskEx; the defaults behave just like RunTask
+	typedef struct sTaskAttributes
+	{
+		sTaskAttributes()
+		{
+			epoch = 0;
+			group = nullptr;
+			priority = TP_NORMAL;
+			cost = nullptr;
+			reads = nullptr;
+			num_reads = 0;
+			writes = nullptr;
+			num_writes = 0;
+			prefetch = nullptr;
+			num_prefetch = 0;
+			completion_port = nullptr;
+			scope = nullptr;
+			pressure_sensitive = false;
+		}
+
+		// Tags the tasks with an epoch (a frame number, for example), or 0 for none. Tagged tasks are run oldest
+		// epoch first, ahead of untagged tasks. See SetPipelineDepth and GetEpochGroup
+		uint64_t epoch;
+
+		// If set, the tasks are added to this group (from CreateTaskGroup) so they can be waited on together
+		ITaskGroup *group;
+
+		// The data the tasks read and write, as arrays of keys that identify it (usually its address, but any
+		// pointer-sized value will do). Tasks that share data are ordered the way they were submitted: they wait
+		// for earlier writers of anything they read, and for earlier readers and writers of anything they write,
+		// while tasks that touch unrelated data still run concurrently. The numtimes tasks of one call are
+		// treated as a unit. The arrays are only used during the RunTaskEx call
+		const void *const *reads;
+		size_t num_reads;
+
+		const void *const *writes;
+		size_t num_writes;
+
+		// Tasks at a higher priority are run first. To avoid priority inversion, tasks inherit a higher priority
+		// from anyone waiting on their group (see ITaskGroup::Wait) and from tasks that depend on them through
+		// their read / write sets, for as long as that lasts
+		TASK_PRIORITY priority;
+
+		// If set, it's called for each of the numtimes tasks before they're queued, and the tasks are queued longest
+		// first (LPT), so that a big task doesn't end up starting last and finishing long after everything else.
+		// Put the tasks in a group to see how close the schedule came to optimal (see ITaskGroup::GetMakespan)
+		COST_CALLBACK cost;
+
+		// Memory the tasks will read, if it's known when they're submitted. While a thread runs a task, it prefetches
+		// the hinted memory of the task queued right behind it, so the data is on its way into the cache by the time
+		// that task starts. Only the first MAX_PREFETCH_HINTS hints and the first 64KB of each are used, and all
+		// numtimes tasks share them. The array is only used during the RunTaskEx call
+		const PREFETCH_HINT *prefetch;
+		size_t num_prefetch;
+
+		// If set, each of the tasks posts its parameters to this port (from CreateCompletionPort) when it completes,
+		// whether it ran or not (see SetQueueManagement and PurgeAllPendingTasks). It's posted before the task counts as
+		// done to its group, epoch or scope, so once one of those completes, all of its tasks' completions are on the port
+		ICompletionPort *completion_port;
+
+		// If set, the tasks belong to this scope (from CreateScope). Otherwise, tasks submitted by a task that belongs
+		// to a scope belong to that scope too
+		ITaskScope *scope;
+
+		// Marks the tasks as ones that make things worse when the host is short of memory (or whatever resources
+		// SetPressureControl watches), such as tasks that allocate a lot; they're held back while it is
+		bool pressure_sensitive;
+	} TASK_ATTRIBUTES;
+
+	// Runs a task the same way RunTask does, with the given attributes
+	virtual bool RunTaskEx(const TASK_ATTRIBUTES &attributes, TASK_CALLBACK func, void *param0 = nullptr, void *param1 = nullptr, size_t numtimes = 1, bool block = false) = NULL;
+
+	// Creates an empty task group; call Release when done with it
+	virtual ITaskGroup *CreateTaskGroup() = NULL;
+
+	// Limits how far ahead submissions may run: submitting to an epoch that is depth or more ahead of the oldest
+	// epoch that still has tasks blocks until that epoch completes. 0 (the default) means no limit
+	// For example, a depth of 2 lets frame N+1's simulation overlap frame N's rendering, but no further
+	virtual void SetPipelineDepth(size_t depth) = NULL;
+
+	// Returns a group that tracks every task submitted to the epoch; call Release when done with it
+	virtual ITaskGroup *GetEpochGroup(uint64_t epoch) = NULL;
+
+	// param0 and param1 are user-supplied values, item is the item to process, and worklist may be used to push
+	// new items (for example, the unvisited neighbors of a node); it's only valid for the duration of the call
+	typedef void (__cdecl *ITEM_CALLBACK)(void *param0, void *param1, void *item, IWorkList *worklist);
+
+	// Processes the given items, plus any items the bodies push, until there are none left. Like ParallelFor,
+	// the calling thread helps out and this returns when the worklist is empty and every body has returned
+	virtual void ParallelDo(ITEM_CALLBACK func, void *param0, void *param1, void *const *items, size_t count) = NULL;
+
+	// Returns the number of times a boost promoted waiting tasks to a higher priority, ie. resolved a priority inversion
+	virtual uint64_t GetInversionCount() = NULL;
+
+	// param0, param1 and task_number are arrays (a structure of arrays) holding the parameters of count tasks
+	typedef void (__cdecl *BATCH_CALLBACK)(void *const *param0, void *const *param1, const size_t *task_number, size_t count);
+
+	// Registers a handler for tasks that run func. When a thread takes one of them off the queue, it also takes the
+	// tasks running func that are right behind it (up to max_batch in all) and runs them with one call to handler,
+	// so the work can be vectorized across tasks and the dispatch cost is paid once. Batched tasks are complete when
+	// the handler returns; they can't be re-run or re-queued. A null handler unregisters func
+	virtual void RegisterBatchHandler(TASK_CALLBACK func, BATCH_CALLBACK handler, size_t max_batch = 64) = NULL;
+
+	// Returns the index of the calling worker thread, from 0 to GetNumThreads() - 1... or GetNumThreads() if the
+	// caller isn't one of this pool's workers. Useful for indexing per-worker data (see ObjectPool.h)
+	virtual size_t GetCurrentWorkerIndex() = NULL;
+
+	// worker_index is the index of the worker that ran out of tasks
+	typedef void (__cdecl *IDLE_CALLBACK)(size_t worker_index, void *userdata);
+
+	// Calls func on each worker thread whenever it runs out of tasks, before it goes to sleep; a good time to trim
+	// per-worker caches. Hooks run one at a time, so keep them short
+	// Returns an id to give to RemoveIdleHook, or 0 on failure
+	virtual uint32_t AddIdleHook(IDLE_CALLBACK func, void *userdata = nullptr) = NULL;
+
+	// Once this returns, the hook is not running and won't be called again
+	virtual bool RemoveIdleHook(uint32_t id) = NULL;
+
+	typedef struct sLatencyStats
+	{
+		// the number of tasks measured
+		uint64_t count;
+
+		// seconds from when tasks were queued until a thread started running them; the percentiles are within 25%
+		double mean;
+		double p50;
+		double p90;
+		double p99;
+		double p999;
+		double max;
+	} LATENCY_STATS;
+
+	// Starts (over) or stops measuring how long tasks wait before they start running
+	virtual void SetLatencyTracking(bool enable) = NULL;
+
+	virtual void GetLatencyStats(LATENCY_STATS &stats) = NULL;
+
+	// For testing how a workload holds up when the scheduler misbehaves: random delays injected where the pool
+	// queues, wakes, dequeues and runs tasks, tasks that take much longer than they should and workers that stall
+	typedef struct sFaultInjection
+	{
+		sFaultInjection()
+		{
+			enqueue_chance = wake_chance = dequeue_chance = run_chance = 0.0f;
+			enqueue_delay_us = wake_delay_us = dequeue_delay_us = run_delay_us = 0;
+			slow_chance = 0.0f;
+			slow_factor = 1.0f;
+			stall_chance = 0.0f;
+			stall_ms = 0;
+			seed = 0;
+		}
+
+		// For each point, the chance (from 0 to 1) of a delay there, and the longest delay in microseconds
+		float enqueue_chance;		// on the submitting thread, before tasks are queued
+		uint32_t enqueue_delay_us;
+		float wake_chance;			// when a worker is woken up
+		uint32_t wake_delay_us;
+		float dequeue_chance;		// before a thread takes a task off the queue
+		uint32_t dequeue_delay_us;
+		float run_chance;			// after a thread takes a task, before running it
+		uint32_t run_delay_us;
+
+		// The chance that a task is made to take slow_factor times as long as it did (100 for a 100x slowdown)
+		float slow_chance;
+		float slow_factor;
+
+		// The chance that a thread stalls for stall_ms while holding a task it just took, as if it had been preempted
+		float stall_chance;
+		uint32_t stall_ms;
+
+		// Where the pool's random sequence starts; it restarts each time a config is set
+		uint32_t seed;
+	} FAULT_INJECTION;
+
+	// Turns fault injection on with the given config, or off if config is null. Not for production use!
+	virtual void SetFaultInjection(const FAULT_INJECTION *config) = NULL;
+
+	// Long running tasks can poll this at safe points to see if they should make room: it returns true if tasks of a
+	// higher priority than the caller's are waiting and every worker is busy. It only reads a few atomics
+	// To yield, save whatever is needed to pick up where the task left off (in the task's params) and return TR_YIELD
+	virtual bool ShouldYield() = NULL;
+
+	typedef enum
+	{
+		QS_GLOBAL = 0,		// one queue shared by all the workers (the default)
+		QS_DISTRIBUTED,		// a queue per worker, with idle workers stealing from busy ones
+		QS_ADAPTIVE,		// switches between the two at runtime, based on lock contention and steal rates
+
+		QS_NUMSTRATEGIES
+	} QUEUE_STRATEGY;
+
+	// Selects how tasks are dispatched to the workers. A shared queue suits a few big tasks; per-worker queues
+	// suit floods of small ones, since nobody has to fight over a single lock. Only untagged tasks at normal priority
+	// go to the per-worker queues (to the submitting worker's own, or spread across all of them when submitted from
+	// outside the pool), so priorities, epochs and data dependencies are honored either way. The difference is
+	// ordering: normal tasks start in submission order from a shared queue, but only in the order they were
+	// queued on each worker from per-worker queues. No task is lost when switching; going back to the shared queue
+	// moves whatever is waiting in the per-worker queues to its end
+	virtual void SetQueueStrategy(QUEUE_STRATEGY strategy) = NULL;
+
+	typedef struct sQueueStats
+	{
+		// the strategy that was set and whether tasks are currently going to per-worker queues
+		QUEUE_STRATEGY strategy;
+		bool distributed;
+
+		// the number of times dispatch switched between shared and per-worker queues
+		uint64_t switches;
+
+		// over the last measurement window, the fraction of times the shared queue's lock was found taken and
+		// the fraction of tasks taken from per-worker queues that were stolen from another worker
+		float contention;
+		float steal_rate;
+	} QUEUE_STATS;
+
+	virtual void GetQueueStats(QUEUE_STATS &stats) = NULL;
+
+	typedef struct sSchedulingStats
+	{
+		// totals since the pool was created: the number of times the OS preempted the workers, the seconds they
+		// spent running and the seconds they spent runnable but waiting for a CPU
+		uint64_t involuntary_switches;
+		double run_time;
+		double run_delay;
+
+		// for all the workers over the last evaluation window (100ms): the fraction of the time they wanted to run that
+		// they spent waiting for a CPU, and involuntary context switches per second
+		float delay_ratio;
+		double switch_rate;
+
+		// the number of workers currently taking tasks (see SetOversubscriptionControl)
+		size_t active_workers;
+	} SCHEDULING_STATS;
+
+	// Fills in how the OS has been scheduling one worker, or all of them together if worker_index is GetNumThreads()
+	// (the window measurements are always for all of them). Returns false if the platform can't tell how long the
+	// workers wait for a CPU, which currently means anything other than Linux; on Windows, run_time is still filled
+	// in, from the workers' cycle counters, and the rest is zero
+	virtual bool GetSchedulingStats(SCHEDULING_STATS &stats, size_t worker_index) = NULL;
+
+	// When enabled, workers are parked while the host is oversubscribed (while they spend more than 10% of the time
+	// they want to run waiting for a CPU, because other processes are using it) and brought back, one at a time,
+	// once that stops. Parked workers finish what they're running but take nothing new. Off by default
+	virtual void SetOversubscriptionControl(bool enable) = NULL;
+
+	typedef enum
+	{
+		QO_FIFO = 0,		// oldest task first (the default)
+		QO_LIFO,			// newest task first
+		QO_ADAPTIVE,		// oldest first, until the queue has been backed up for a while; then newest first until it isn't
+
+		QO_NUMORDERS
+	} QUEUE_ORDER;
+
+	typedef struct sQueuePolicy
+	{
+		sQueuePolicy()
+		{
+			order = QO_FIFO;
+			threshold = 100;
+			delay_ms = 50;
+		}
+
+		QUEUE_ORDER order;
+
+		// For QO_ADAPTIVE, the queue switches to LIFO once it has held more than threshold tasks for delay_ms, and
+		// back to FIFO as soon as it's down to threshold or fewer
+		size_t threshold;
+		uint32_t delay_ms;
+	} QUEUE_POLICY;
+
+	// Sets the order the given priority's queue hands out tasks in. In a backlog, FIFO makes every task late,
+	// including the ones that were just submitted; with QO_ADAPTIVE, new tasks still get served quickly while the
+	// backlog ages out (consider purging or shedding it). Tasks that yield still run next. Epochs and the per-worker
+	// queues of QS_DISTRIBUTED are always FIFO, and pools without threads ignore this
+	virtual void SetQueuePolicy(TASK_PRIORITY priority, const QUEUE_POLICY &policy) = NULL;
+
+	typedef struct sQueuePolicyStats
+	{
+		// whether the queue is handing out its newest tasks first right now
+		bool lifo;
+
+		// the number of times the queue switched between FIFO and LIFO, and the number of tasks taken while in LIFO
+		uint64_t switches;
+		uint64_t lifo_tasks;
+	} QUEUE_POLICY_STATS;
+
+	virtual void GetQueuePolicyStats(TASK_PRIORITY priority, QUEUE_POLICY_STATS &stats) = NULL;
+
+	// Called for each task that queue management drops, on the thread that dropped it, with the task's callback and
+	// parameters and how many seconds it waited. Keep it cheap (send a "busy" reply, count it): it runs instead of
+	// the task, right before the next one
+	typedef void (__cdecl *DROP_CALLBACK)(TASK_CALLBACK func, void *param0, void *param1, size_t task_number, double waited, void *userdata);
+
+	typedef struct sQueueManagement
+	{
+		sQueueManagement()
+		{
+			target_us = 5000;
+			interval_us = 100000;
+			drop = nullptr;
+			userdata = nullptr;
+		}
+
+		// Tasks start being dropped once every task taken off a queue for interval_us had waited longer than target_us;
+		// the time between drops starts at interval_us and shrinks from there, so a shorter interval sheds faster
+		uint32_t target_us;
+		uint32_t interval_us;
+
+		DROP_CALLBACK drop;
+		void *userdata;
+	} QUEUE_MANAGEMENT;
+
+	// CoDel-style active queue management, for when a sustained overload would otherwise leave a standing backlog
+	// that makes everything late. Once tasks have been waiting longer than the target for a whole interval, tasks
+	// are dropped as they come off the queue (completed without running, so whoever waits on them is released),
+	// more and more often, until the waits are back under the target. High priority tasks are never dropped; on pools
+	// without threads, tasks are dropped as Flush takes them. Turns it on with the given config, or off if config is null
+	virtual void SetQueueManagement(const QUEUE_MANAGEMENT *config) = NULL;
+
+	// Returns the number of tasks queue management has dropped
+	virtual uint64_t GetDropCount() = NULL;
+
+	// Runs a task on the given worker thread (see GetCurrentWorkerIndex) ahead of anything else that worker would take,
+	// even while it's parked; the task_number is the worker's index. Returns a group to wait on for the task, which
+	// must be released, or nullptr if there's no such worker (pools with 0 threads have none)
+	virtual ITaskGroup *RunOnWorker(size_t worker_index, TASK_CALLBACK func, void *param0 = nullptr, void *param1 = nullptr) = NULL;
+
+	// Runs a task once on every worker thread, the same way RunOnWorker does: good for flushing per-thread caches or
+	// resetting thread-local arenas. Returns a group to wait on for all of them, which must be released, or nullptr
+	// if the pool has no threads
+	virtual ITaskGroup *Broadcast(TASK_CALLBACK func, void *param0 = nullptr, void *param1 = nullptr) = NULL;
+
+	// Creates a completion port whose ring holds capacity completions (rounded up to a power of 2) before they
+	// spill into a slower, locked list; call Release when done with it
+	virtual ICompletionPort *CreateCompletionPort(size_t capacity = 4096) = NULL;
+
+	// Creates a scope nested in parent or, if parent is nullptr, in the scope of the task the calling thread is
+	// running (if any); call ITaskScope::Leave when done with it
+	virtual ITaskScope *CreateScope(ITaskScope *parent = nullptr) = NULL;
+
+	// Returns the scope of the task the calling thread is running, or nullptr if it has none; no reference is added
+	virtual ITaskScope *GetCurrentScope() = NULL;
+
+	typedef enum
+	{
+		PR_MEMORY = 0,
+		PR_CPU,
+		PR_IO,
+
+		PR_NUMRESOURCES
+	} PRESSURE_RESOURCE;
+
+	// Settings for SetPressureControl
+	typedef struct sPressureControl
+	{
+		sPressureControl()
+		{
+			stall_us[PR_MEMORY] = 100000;
+			stall_us[PR_CPU] = 0;
+			stall_us[PR_IO] = 0;
+			window_us = 2000000;
+			release_percent = 1.0f;
+			max_sensitive = 1;
+		}
+
+		// How long, in microseconds out of every window_us, tasks on the host may be stalled waiting for each
+		// resource before it counts as under pressure; 0 ignores the resource. Only memory is watched by default
+		uint32_t stall_us[PR_NUMRESOURCES];
+
+		// Processes without CAP_SYS_RESOURCE can only use windows that are a multiple of 2 seconds
+		uint32_t window_us;
+
+		// The pressure is over once every watched resource's 10 second stall average is below this percentage
+		float release_percent;
+
+		// While under pressure, at most this many pressure-sensitive tasks run at once (0 holds them all back)
+		size_t max_sensitive;
+	} PRESSURE_CONTROL;
+
+	// Watches the kernel's pressure stall information (Linux 4.20 and later) and, while the host is under pressure,
+	// throttles tasks submitted with TASK_ATTRIBUTES::pressure_sensitive: those over the limit wait, still queued,
+	// until a running one finishes or the pressure is over. Tasks run by Flush aren't held back. nullptr turns it off,
+	// which is the default. Returns false if the pressure information isn't available
+	virtual bool SetPressureControl(const PRESSURE_CONTROL *control) = NULL;
+
+	typedef struct sPressureStats
+	{
+		bool under_pressure;
+
+		// each resource's 10 second stall average, as a percentage, if it's watched
+		float avg10[PR_NUMRESOURCES];
+
+		// how many times the host has come under pressure
+		uint64_t episodes;
+
+		// the pressure-sensitive tasks being held back right now, and how many times one has been
+		size_t deferred;
+		uint64_t throttled;
+	} PRESSURE_STATS;
+
+	virtual void GetPressureStats(PRESSURE_STATS &stats) = NULL;
+
 	// Creates a pool with the number of threads based on the cores in the machine, given by:
 	//    threads_per_core * max(1, (core_count + core_count_adjustment))
 	POOL_API static IThreadPool *Create(size_t threads_per_core, int core_count_adjustment);
@@ -99,6 +712,48 @@ public:
 	//    thread, using data provided by async resource workers.
 	POOL_API static IThreadPool *Create(size_t thread_count);
 
+	// worker_index is the index of the worker the hook is running on
+	typedef void (__cdecl *THREAD_CALLBACK)(size_t worker_index, void *userdata);
+
+	// Creates a pool with the designated number of threads, each of which calls on_start (if given) before it
+	// runs any tasks and on_exit (if given) right before it exits; a good place to set up and tear down per-thread
+	// resources, once, off the hot path
+	POOL_API static IThreadPool *Create(size_t thread_count, THREAD_CALLBACK on_start, THREAD_CALLBACK on_exit, void *userdata = nullptr);
+
+};
+
+
+// Holds the tasks of one job (a request, for example) so none of them outlive it: leaving the scope waits for all of
+// them, and cancelling it cancels all of them. Tasks submitted by the scope's tasks belong to it too, and scopes
+// created from inside its tasks are nested in it, so a whole tree of work is covered
+class ITaskScope
+{
+public:
+
+	// Runs a task in the scope, the same way RunTask does; returns false if the scope has been cancelled
+	virtual bool Spawn(IThreadPool::TASK_CALLBACK func, void *param0 = nullptr, void *param1 = nullptr, size_t numtimes = 1) = NULL;
+
+	// Cancels the scope and every scope nested in it. Their tasks that haven't started complete without running,
+	// tasks that return TR_RERUN, TR_REQUEUE or TR_YIELD aren't run again, and nothing new can be spawned. Running
+	// tasks can check IsCancelled to stop early
+	virtual void Cancel() = NULL;
+
+	// Returns true if the scope, or any scope it's nested in, has been cancelled
+	virtual bool IsCancelled() = NULL;
+
+	// Waits for every task in the scope and the scopes nested in it, the same way ITaskGroup::Wait does
+	virtual bool Wait(uint32_t milliseconds) = NULL;
+
+	// Returns the number of tasks in the scope and the scopes nested in it that are queued or running
+	virtual size_t GetPendingCount() = NULL;
+
+	// Waits for every task in the scope and the scopes nested in it, running them while it waits, then releases
+	// the scope; this is how its creator lets go of it
+	virtual void Leave() = NULL;
+
+	virtual void AddRef() = NULL;
+
+	virtual void Release() = NULL;
 };
 
 
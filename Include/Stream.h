@@ -0,0 +1,409 @@
+/*
+
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	Pool is free software; you can redistribute it and/or modify it under
+	the terms of the MIT License:
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+
+*/
+
+#pragma once
+
+// Lazy parallel streams: a chain of operators over a range of indices or an array that runs as a single pass on
+// the pool when a terminal operation is called.
+//
+//   double mass = pool::Stream(ppool, particles, count)
+//       .Map([](const SParticle &p) { return p.m_Mass; })
+//       .Filter([](float m) { return m > 0.0f; })
+//       .Reduce(0.0, [](double a, double b) { return a + b; });
+//
+// Nothing runs until Reduce, ForEach, Count or Collect is called. Then the range is split into chunks with
+// ParallelFor, and each element of a chunk goes through every Map and Filter back to back, straight into the
+// terminal operation, so no intermediate array is ever written. Reduce combines the chunks' results in order,
+// so op needs to be associative but not commutative. Collect makes two passes: the first counts each chunk's
+// survivors, a scan over the counts gives each chunk its offset in the output, and the second runs the chunks
+// through the stages again, writing the survivors straight into place; so its operators run twice per element
+// and have to give the same answers both times.
+//
+// The operators are copied into the stream, and the data and any state they reference must outlive the terminal
+// operation. Operators are called from several threads at once.
+
+#include <Pool.h>
+
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include <algorithm>
+
+
+namespace pool
+{
+
+// Emits the indices [begin, end)
+struct SIndexSource
+{
+	template <class TSink> void operator()(size_t begin, size_t end, TSink &sink) const
+	{
+		for (size_t i = begin; i < end; i++)
+			sink(i);
+	}
+};
+
+// Emits the elements [begin, end) of an array
+template <class T> struct TArraySource
+{
+	const T *m_pData;
+
+	template <class TSink> void operator()(size_t begin, size_t end, TSink &sink) const
+	{
+		for (size_t i = begin; i < end; i++)
+			sink(m_pData[i]);
+	}
+};
+
+// Passes what the previous stage emits through func
+template <class TPrev, class F> struct TMapStage
+{
+	TPrev m_Prev;
+	F m_Func;
+
+	template <class TSink> struct TAdapter
+	{
+		TSink &m_Sink;
+		const F &m_Func;
+
+		template <class V> void operator()(V &&v)
+		{
+			m_Sink(m_Func(std::forward<V>(v)));
+		}
+	};
+
+	template <class TSink> void operator()(size_t begin, size_t end, TSink &sink) const
+	{
+		TAdapter<TSink> a = {sink, m_Func};
+		m_Prev(begin, end, a);
+	}
+};
+
+// Passes on what the previous stage emits if pred returns true for it
+template <class TPrev, class P> struct TFilterStage
+{
+	TPrev m_Prev;
+	P m_Pred;
+
+	template <class TSink> struct TAdapter
+	{
+		TSink &m_Sink;
+		const P &m_Pred;
+
+		template <class V> void operator()(V &&v)
+		{
+			if (m_Pred(v))
+				m_Sink(std::forward<V>(v));
+		}
+	};
+
+	template <class TSink> void operator()(size_t begin, size_t end, TSink &sink) const
+	{
+		TAdapter<TSink> a = {sink, m_Pred};
+		m_Prev(begin, end, a);
+	}
+};
+
+// T is the type of the elements, TStages emits them for a range of the source
+template <class T, class TStages> class TStream
+{
+
+protected:
+
+	IThreadPool *m_pPool;
+	size_t m_Count;
+	size_t m_Grain;
+	TStages m_Stages;
+
+	template <class U, class S> friend class TStream;
+
+	// Runs job.RunChunk(chunk, begin, end) on every chunk of the source
+	template <class TJob> static void __cdecl RunChunks(void *param0, void *param1, size_t begin, size_t end)
+	{
+		TJob *job = (TJob *)param0;
+
+		// a range can span several chunks, but always starts on a chunk boundary
+		for (size_t b = begin; b < end; b += job->m_Grain)
+			job->RunChunk(b / job->m_Grain, b, std::min<size_t>(end, b + job->m_Grain));
+	}
+
+	size_t GetGrain() const
+	{
+		if (m_Grain)
+			return m_Grain;
+
+		// the same default ParallelFor uses: several chunks for each participant, so the tail stays balanced
+		return std::max<size_t>(1, m_Count / ((m_pPool->GetNumThreads() + 1) * 8));
+	}
+
+	size_t GetNumChunks(size_t grain) const
+	{
+		return (m_Count + grain - 1) / grain;
+	}
+
+	template <class R, class Op> struct SReduceJob
+	{
+		const TStages *m_pStages;
+		size_t m_Grain;
+		R m_Identity;
+		const Op *m_pOp;
+		std::vector<R> m_Partial;
+
+		struct SSink
+		{
+			R &m_Acc;
+			const Op &m_Op;
+
+			template <class V> void operator()(V &&v)
+			{
+				m_Acc = m_Op(m_Acc, std::forward<V>(v));
+			}
+		};
+
+		void RunChunk(size_t chunk, size_t begin, size_t end)
+		{
+			R acc = m_Identity;
+			SSink sink = {acc, *m_pOp};
+			(*m_pStages)(begin, end, sink);
+			m_Partial[chunk] = acc;
+		}
+	};
+
+	template <class F> struct SForEachJob
+	{
+		const TStages *m_pStages;
+		size_t m_Grain;
+		const F *m_pFunc;
+
+		struct SSink
+		{
+			const F &m_Func;
+
+			template <class V> void operator()(V &&v)
+			{
+				m_Func(std::forward<V>(v));
+			}
+		};
+
+		void RunChunk(size_t chunk, size_t begin, size_t end)
+		{
+			SSink sink = {*m_pFunc};
+			(*m_pStages)(begin, end, sink);
+		}
+	};
+
+	// Counts each chunk's survivors
+	struct SCountJob
+	{
+		const TStages *m_pStages;
+		size_t m_Grain;
+		std::vector<size_t> m_Count;
+
+		struct SSink
+		{
+			size_t &m_Count;
+
+			template <class V> void operator()(V &&v)
+			{
+				m_Count++;
+			}
+		};
+
+		void RunChunk(size_t chunk, size_t begin, size_t end)
+		{
+			size_t n = 0;
+			SSink sink = {n};
+			(*m_pStages)(begin, end, sink);
+			m_Count[chunk] = n;
+		}
+	};
+
+	// Writes each chunk's survivors to the output, starting at the chunk's offset
+	template <class U> struct SWriteJob
+	{
+		const TStages *m_pStages;
+		size_t m_Grain;
+		const size_t *m_pOffset;
+		U *m_pOut;
+
+		struct SSink
+		{
+			U *m_pOut;
+
+			template <class V> void operator()(V &&v)
+			{
+				*(m_pOut++) = std::forward<V>(v);
+			}
+		};
+
+		void RunChunk(size_t chunk, size_t begin, size_t end)
+		{
+			SSink sink = {m_pOut + m_pOffset[chunk]};
+			(*m_pStages)(begin, end, sink);
+		}
+	};
+
+public:
+
+	typedef T value_type;
+
+	TStream(IThreadPool *pool, size_t count, const TStages &stages) : m_pPool(pool), m_Count(count), m_Grain(0), m_Stages(stages)
+	{
+	}
+
+	// Sets the number of source elements per chunk; 0 (the default) picks one the way ParallelFor does
+	TStream Grain(size_t grain_size) const
+	{
+		TStream s(*this);
+		s.m_Grain = grain_size;
+		return s;
+	}
+
+	// Transforms each element with func
+	template <class F> TStream<typename std::decay<decltype(std::declval<F>()(std::declval<T>()))>::type, TMapStage<TStages, F>> Map(F func) const
+	{
+		typedef typename std::decay<decltype(std::declval<F>()(std::declval<T>()))>::type U;
+
+		TMapStage<TStages, F> stages = {m_Stages, func};
+		TStream<U, TMapStage<TStages, F>> s(m_pPool, m_Count, stages);
+		s.m_Grain = m_Grain;
+		return s;
+	}
+
+	// Keeps only the elements that pred returns true for
+	template <class P> TStream<T, TFilterStage<TStages, P>> Filter(P pred) const
+	{
+		TFilterStage<TStages, P> stages = {m_Stages, pred};
+		TStream<T, TFilterStage<TStages, P>> s(m_pPool, m_Count, stages);
+		s.m_Grain = m_Grain;
+		return s;
+	}
+
+	// Folds the elements together with op, starting each chunk from identity; op(R, T) and op(R, R) must both work
+	template <class R, class Op> R Reduce(R identity, Op op) const
+	{
+		if (!m_Count)
+			return identity;
+
+		SReduceJob<R, Op> job;
+		job.m_pStages = &m_Stages;
+		job.m_Grain = GetGrain();
+		job.m_Identity = identity;
+		job.m_pOp = &op;
+		job.m_Partial.resize(GetNumChunks(job.m_Grain), identity);
+
+		m_pPool->ParallelFor(RunChunks<SReduceJob<R, Op>>, &job, nullptr, m_Count, job.m_Grain);
+
+		R ret = identity;
+		for (const auto &p : job.m_Partial)
+			ret = op(ret, p);
+
+		return ret;
+	}
+
+	// Calls func on every element, in no particular order
+	template <class F> void ForEach(F func) const
+	{
+		if (!m_Count)
+			return;
+
+		SForEachJob<F> job;
+		job.m_pStages = &m_Stages;
+		job.m_Grain = GetGrain();
+		job.m_pFunc = &func;
+
+		m_pPool->ParallelFor(RunChunks<SForEachJob<F>>, &job, nullptr, m_Count, job.m_Grain);
+	}
+
+	// Returns the number of elements that make it through the filters
+	size_t Count() const
+	{
+		return Map([](const T &) { return (size_t)1; }).Reduce((size_t)0, [](size_t a, size_t b) { return a + b; });
+	}
+
+	// Replaces the contents of out with the elements, in source order, and returns how many there were
+	// T has to be default constructible and assignable; the stages run twice per element (see above)
+	size_t Collect(std::vector<T> &out) const
+	{
+		// the chunks write to their parts of the output from different threads, which vector<bool> can't take
+		static_assert(!std::is_same<T, bool>::value, "Collect can't write a std::vector<bool> in parallel; Map to char first");
+
+		out.clear();
+
+		if (!m_Count)
+			return 0;
+
+		SCountJob count;
+		count.m_pStages = &m_Stages;
+		count.m_Grain = GetGrain();
+		count.m_Count.resize(GetNumChunks(count.m_Grain));
+
+		m_pPool->ParallelFor(RunChunks<SCountJob>, &count, nullptr, m_Count, count.m_Grain);
+
+		// an exclusive scan over the chunk counts gives each chunk its place in the output
+		std::vector<size_t> offset(count.m_Count.size());
+		size_t total = 0;
+		for (size_t i = 0; i < count.m_Count.size(); i++)
+		{
+			offset[i] = total;
+			total += count.m_Count[i];
+		}
+
+		if (!total)
+			return 0;
+
+		out.resize(total);
+
+		// the same grain, so the chunks are the ones that were counted
+		SWriteJob<T> write;
+		write.m_pStages = &m_Stages;
+		write.m_Grain = count.m_Grain;
+		write.m_pOffset = offset.data();
+		write.m_pOut = out.data();
+
+		m_pPool->ParallelFor(RunChunks<SWriteJob<T>>, &write, nullptr, m_Count, write.m_Grain);
+
+		return total;
+	}
+};
+
+// A stream of the indices [0, count)
+inline TStream<size_t, SIndexSource> Stream(IThreadPool *pool, size_t count)
+{
+	return TStream<size_t, SIndexSource>(pool, count, SIndexSource());
+}
+
+// A stream of the elements of an array
+template <class T> TStream<T, TArraySource<T>> Stream(IThreadPool *pool, const T *data, size_t count)
+{
+	TArraySource<T> source = {data};
+	return TStream<T, TArraySource<T>>(pool, count, source);
+}
+
+};
@@ -0,0 +1,188 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include <Pool.h>
+
+
+// CoDel ("controlled delay") active queue management, after RFC 8289, applied to tasks instead of packets. Every task
+// taken off a queue reports how long it waited; once the waits have stayed above the target for a whole interval,
+// there's a standing backlog, and tasks are dropped at a rate that grows with the square root of the number of drops
+// until the waits come back down. Dropping the old tasks instead of running them is what lets the backlog drain
+class CCoDel
+{
+
+protected:
+
+	typedef pool::IThreadPool::DROP_CALLBACK DROP_CALLBACK;
+	typedef pool::IThreadPool::QUEUE_MANAGEMENT QUEUE_MANAGEMENT;
+
+	std::atomic<bool> m_Enabled;
+
+	std::atomic<uint64_t> m_NumDropped;
+
+	// everything below is guarded by m_Lock
+	std::mutex m_Lock;
+
+	uint64_t m_TargetNS;
+	uint64_t m_IntervalNS;
+
+	DROP_CALLBACK m_Callback;
+	void *m_UserData;
+
+	// when the waits will have been above target for an interval, or 0 if the last one was below it
+	uint64_t m_FirstAboveNS;
+
+	// while dropping, when the next drop is due
+	uint64_t m_DropNextNS;
+
+	// the number of drops in the current dropping state, and in the one before
+	uint32_t m_Count;
+	uint32_t m_LastCount;
+
+	bool m_Dropping;
+
+	// the time of the next drop: drops come interval / sqrt(count) apart
+	uint64_t ControlLaw(uint64_t t) const
+	{
+		return t + (uint64_t)((double)m_IntervalNS / sqrt((double)m_Count));
+	}
+
+public:
+
+	CCoDel()
+	{
+		m_Enabled = false;
+		m_NumDropped = 0;
+
+		m_TargetNS = 5000000;
+		m_IntervalNS = 100000000;
+
+		m_Callback = nullptr;
+		m_UserData = nullptr;
+
+		m_FirstAboveNS = 0;
+		m_DropNextNS = 0;
+		m_Count = 0;
+		m_LastCount = 0;
+		m_Dropping = false;
+	}
+
+	// Turns queue management on with the given config, or off if config is null
+	void Configure(const QUEUE_MANAGEMENT *config)
+	{
+		std::lock_guard<std::mutex> l(m_Lock);
+
+		if (config)
+		{
+			m_TargetNS = (uint64_t)config->target_us * 1000;
+			m_IntervalNS = (uint64_t)std::max<uint32_t>(1, config->interval_us) * 1000;
+			m_Callback = config->drop;
+			m_UserData = config->userdata;
+		}
+
+		m_FirstAboveNS = 0;
+		m_Dropping = false;
+
+		m_Enabled = (config != nullptr);
+	}
+
+	bool IsEnabled() const
+	{
+		return m_Enabled.load(std::memory_order_relaxed);
+	}
+
+	// Called for each task as it comes off a queue, with how long it waited; backlog is false if it was the last one
+	// queued (an empty queue is never a standing backlog) and droppable is false if it mustn't be dropped regardless
+	// Returns true if the task should be dropped
+	bool OnDequeue(uint64_t now, uint64_t sojourn, bool backlog, bool droppable)
+	{
+		std::lock_guard<std::mutex> l(m_Lock);
+
+		bool ok_to_drop = false;
+
+		if ((sojourn < m_TargetNS) || !backlog)
+			m_FirstAboveNS = 0;
+		else if (!m_FirstAboveNS)
+			m_FirstAboveNS = now + m_IntervalNS;
+		else if (now >= m_FirstAboveNS)
+			ok_to_drop = true;
+
+		if (m_Dropping)
+		{
+			if (!ok_to_drop)
+			{
+				m_Dropping = false;
+				return false;
+			}
+
+			if (!droppable || (now < m_DropNextNS))
+				return false;
+
+			m_Count++;
+			m_DropNextNS = ControlLaw(m_DropNextNS);
+		}
+		else
+		{
+			if (!ok_to_drop || !droppable)
+				return false;
+
+			m_Dropping = true;
+
+			// if we were dropping not long ago, pick up close to the rate that was needed then
+			uint32_t delta = m_Count - m_LastCount;
+			m_Count = ((delta > 1) && ((now - m_DropNextNS) < (16 * m_IntervalNS))) ? delta : 1;
+			m_LastCount = m_Count;
+
+			m_DropNextNS = ControlLaw(now);
+		}
+
+		m_NumDropped.fetch_add(1, std::memory_order_relaxed);
+
+		return true;
+	}
+
+	void GetCallback(DROP_CALLBACK &func, void *&userdata)
+	{
+		std::lock_guard<std::mutex> l(m_Lock);
+
+		func = m_Callback;
+		userdata = m_UserData;
+	}
+
+	uint64_t GetNumDropped() const
+	{
+		return m_NumDropped.load(std::memory_order_relaxed);
+	}
+};
@@ -0,0 +1,310 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+
+#include <Pool.h>
+
+
+// Completions go into a bounded ring, like Vyukov's bounded queue: a producer claims a cell by advancing the
+// tail with a CAS, fills it in and publishes it by bumping the cell's sequence number, so posting never takes
+// a lock. The consumer reads cells in order, without atomics on the head. If the ring is full, completions
+// spill into a locked overflow list rather than making the producer wait.
+//
+// Wakeups are coalesced: the consumer raises a flag before it sleeps, and only the producer that clears the flag
+// signals. Everything posted while the consumer is awake (or on its way) is picked up by the same Dequeue call.
+// With SetCoalescing, a consumer that wakes to fewer than a batch of completions goes back to sleep for a moment,
+// and is only woken again when the batch is complete (or the moment is up).
+class CCompletionPort : public pool::ICompletionPort
+{
+
+protected:
+
+	struct SCell
+	{
+		std::atomic<size_t> m_Seq;
+		COMPLETION m_Completion;
+	};
+
+	std::vector<SCell> m_Ring;
+	size_t m_Mask;
+
+	// the next cell producers will claim
+	std::atomic<size_t> m_Tail;
+
+	// the next cell the consumer will read; guarded by m_mutexConsumer
+	size_t m_Head;
+
+	std::mutex m_mutexConsumer;
+
+	std::deque<COMPLETION> m_Overflow;
+	std::mutex m_mutexOverflow;
+
+	// completions posted, but not yet dequeued
+	std::atomic<size_t> m_Pending;
+
+	// set by the consumer before it sleeps; cleared by the producer that wakes it, which is the first one to see
+	// at least m_WakeAt completions pending
+	std::atomic<bool> m_Waiting;
+	std::atomic<size_t> m_WakeAt;
+
+	// see SetCoalescing
+	std::atomic<size_t> m_Batch;
+	std::atomic<uint32_t> m_MaxDelayUS;
+
+	std::mutex m_mutexWait;
+	std::condition_variable m_cvWait;
+
+	std::atomic<uint64_t> m_Wakes;
+
+	std::atomic<LONG> m_RefCount;
+
+	bool PushRing(const COMPLETION &c)
+	{
+		size_t pos = m_Tail.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			SCell &cell = m_Ring[pos & m_Mask];
+			size_t seq = cell.m_Seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+			if (!dif)
+			{
+				if (m_Tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				{
+					cell.m_Completion = c;
+					cell.m_Seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (dif < 0)
+			{
+				// full
+				return false;
+			}
+			else
+			{
+				pos = m_Tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Takes up to max_count completions without waiting; call with m_mutexConsumer held
+	size_t TakeLocked(COMPLETION *completions, size_t max_count)
+	{
+		size_t n = 0;
+
+		while (n < max_count)
+		{
+			SCell &cell = m_Ring[m_Head & m_Mask];
+			if (cell.m_Seq.load(std::memory_order_acquire) != (m_Head + 1))
+				break;
+
+			completions[n++] = cell.m_Completion;
+			cell.m_Seq.store(m_Head + m_Mask + 1, std::memory_order_release);
+			m_Head++;
+		}
+
+		if ((n < max_count) && (m_Pending.load() > n))
+		{
+			std::lock_guard<std::mutex> l(m_mutexOverflow);
+
+			while ((n < max_count) && !m_Overflow.empty())
+			{
+				completions[n++] = m_Overflow.front();
+				m_Overflow.pop_front();
+			}
+		}
+
+		if (n)
+			m_Pending.fetch_sub(n);
+
+		return n;
+	}
+
+public:
+
+	// capacity is rounded up to a power of 2
+	CCompletionPort(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size <<= 1;
+
+		m_Ring = std::vector<SCell>(size);
+		m_Mask = size - 1;
+
+		for (size_t i = 0; i < size; i++)
+			m_Ring[i].m_Seq = i;
+
+		m_Tail = 0;
+		m_Head = 0;
+		m_Pending = 0;
+		m_Waiting = false;
+		m_WakeAt = 1;
+		m_Batch = 1;
+		m_MaxDelayUS = 0;
+		m_Wakes = 0;
+		m_RefCount = 1;
+	}
+
+	virtual ~CCompletionPort()
+	{
+	}
+
+	// tasks hold a reference to their port until they complete
+	void OnTaskAdded(size_t count)
+	{
+		m_RefCount.fetch_add((LONG)count);
+	}
+
+	void OnTaskDone(void *param0, void *param1, size_t task_number)
+	{
+		Post(param0, param1, task_number);
+		Release();
+	}
+
+	virtual void Post(void *param0, void *param1, size_t task_number)
+	{
+		COMPLETION c;
+		c.param0 = param0;
+		c.param1 = param1;
+		c.task_number = task_number;
+
+		// counted before it's published, so the count never dips below what's in the ring; this pairs with the
+		// consumer raising m_Waiting before it checks m_Pending: one of the two sees the other
+		size_t pending = m_Pending.fetch_add(1) + 1;
+
+		if (!PushRing(c))
+		{
+			std::lock_guard<std::mutex> l(m_mutexOverflow);
+			m_Overflow.push_back(c);
+		}
+
+		if (m_Waiting.load() && (pending >= m_WakeAt.load()) && m_Waiting.exchange(false))
+		{
+			m_Wakes.fetch_add(1, std::memory_order_relaxed);
+
+			std::lock_guard<std::mutex> l(m_mutexWait);
+			m_cvWait.notify_one();
+		}
+	}
+
+	virtual size_t Dequeue(COMPLETION *completions, size_t max_count, uint32_t milliseconds)
+	{
+		if (!completions || !max_count)
+			return 0;
+
+		std::lock_guard<std::mutex> lc(m_mutexConsumer);
+
+		size_t n = TakeLocked(completions, max_count);
+		if (n || !milliseconds)
+			return n;
+
+		std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> l(m_mutexWait);
+
+				m_WakeAt = 1;
+				m_Waiting = true;
+
+				if (!m_Pending.load())
+				{
+					if (milliseconds == INFINITE)
+						m_cvWait.wait(l, [this]() { return !m_Waiting.load(); });
+					else
+						m_cvWait.wait_until(l, until, [this]() { return !m_Waiting.load(); });
+				}
+
+				// the first completion is often followed by more; let them pile up into a batch
+				size_t batch = std::min<size_t>(m_Batch.load(), max_count);
+				uint32_t delay = m_MaxDelayUS.load();
+				size_t pending = m_Pending.load();
+
+				if (delay && pending && (pending < batch))
+				{
+					m_WakeAt = batch;
+					m_Waiting = true;
+
+					std::chrono::steady_clock::time_point linger = std::min(until, std::chrono::steady_clock::now() + std::chrono::microseconds(delay));
+					m_cvWait.wait_until(l, linger, [this, batch]() { return !m_Waiting.load() || (m_Pending.load() >= batch); });
+				}
+
+				m_Waiting = false;
+			}
+
+			// a completion may be posted but not yet published; it's about to be, so don't go back to sleep on it
+			n = TakeLocked(completions, max_count);
+			if (n || ((milliseconds != INFINITE) && (std::chrono::steady_clock::now() >= until)))
+				return n;
+
+			if (m_Pending.load())
+				std::this_thread::yield();
+		}
+	}
+
+	virtual void SetCoalescing(size_t batch, uint32_t max_delay_us)
+	{
+		m_Batch = std::max<size_t>(1, batch);
+		m_MaxDelayUS = max_delay_us;
+	}
+
+	virtual size_t GetPendingCount()
+	{
+		return m_Pending.load();
+	}
+
+	virtual uint64_t GetWakeCount()
+	{
+		return m_Wakes.load();
+	}
+
+	virtual void AddRef()
+	{
+		m_RefCount.fetch_add(1);
+	}
+
+	virtual void Release()
+	{
+		if (m_RefCount.fetch_sub(1) == 1)
+			delete this;
+	}
+};
@@ -0,0 +1,297 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+
+// A unit of work whose start is held back until the work it depends on has finished. Derived classes
+// implement Launch, which is called exactly once, when the last predecessor finishes
+class CDependencyNode
+{
+	friend class CDependencyTracker;
+
+protected:
+
+	std::atomic<long> m_RefCount;
+
+	// the number of unfinished predecessors, plus one held by the submitter until registration is done
+	std::atomic<size_t> m_Waiting;
+
+	std::mutex m_mutexSuccessors;
+	std::vector<CDependencyNode *> m_Successors;
+	bool m_Finished;
+
+	// the regions this node was registered with, so they can be cleaned up when it finishes
+	struct SAccess
+	{
+		const void *m_Region;
+		bool m_Write;
+	};
+
+	std::vector<SAccess> m_Access;
+
+	virtual void Launch() = 0;
+
+	// Called when this node is made to wait for pred, with pred's successor list locked
+	virtual void OnPredecessorAdded(CDependencyNode *pred)
+	{
+	}
+
+	// Makes this node wait for pred, unless pred has already finished
+	void AddPredecessor(CDependencyNode *pred)
+	{
+		if (pred == this)
+			return;
+
+		std::lock_guard<std::mutex> l(pred->m_mutexSuccessors);
+
+		if (pred->m_Finished)
+			return;
+
+		m_Waiting.fetch_add(1);
+		AddRef();
+		pred->m_Successors.push_back(this);
+
+		OnPredecessorAdded(pred);
+	}
+
+	// Called when a predecessor (or the submitter) is done with us
+	void Satisfy()
+	{
+		if (m_Waiting.fetch_sub(1) == 1)
+			Launch();
+	}
+
+public:
+
+	CDependencyNode()
+	{
+		m_RefCount = 1;
+		m_Waiting = 1;
+		m_Finished = false;
+	}
+
+	virtual ~CDependencyNode()
+	{
+	}
+
+	void AddRef()
+	{
+		m_RefCount.fetch_add(1);
+	}
+
+	void Release()
+	{
+		if (m_RefCount.fetch_sub(1) == 1)
+			delete this;
+	}
+
+	bool IsFinished()
+	{
+		std::lock_guard<std::mutex> l(m_mutexSuccessors);
+		return m_Finished;
+	}
+};
+
+
+// Infers read-after-write, write-after-read and write-after-write dependencies between nodes from the
+// regions (any pointer-sized key) they declare, in the order they are registered. Regions hash into
+// independently locked buckets, so submissions that touch unrelated data don't contend with each other
+class CDependencyTracker
+{
+
+protected:
+
+	struct SRegionState
+	{
+		SRegionState()
+		{
+			m_pLastWriter = nullptr;
+		}
+
+		CDependencyNode *m_pLastWriter;
+
+		// readers since the last write
+		std::vector<CDependencyNode *> m_Readers;
+	};
+
+	typedef std::unordered_map<const void *, SRegionState> TRegionMap;
+
+	struct SBucket
+	{
+		std::mutex m_Lock;
+		TRegionMap m_Regions;
+	};
+
+	static const size_t NUM_BUCKETS = 64;
+
+	SBucket m_Bucket[NUM_BUCKETS];
+
+	static size_t GetBucketIndex(const void *region)
+	{
+		uintptr_t h = (uintptr_t)region;
+		h ^= (h >> 17) ^ (h >> 7);
+		h *= (uintptr_t)0x9E3779B97F4A7C15ull;
+		return (size_t)(h >> ((sizeof(uintptr_t) * 8) - 6)) & (NUM_BUCKETS - 1);
+	}
+
+public:
+
+	// Registers node's accesses and ties it to the nodes it must wait for, then launches it right away if it
+	// doesn't have to wait for anything. All of the buckets involved are locked together (in index order,
+	// so concurrent registrations can't deadlock), which makes each registration atomic with respect to
+	// the others and so keeps the dependency graph acyclic
+	void Register(CDependencyNode *node, const void *const *reads, size_t num_reads, const void *const *writes, size_t num_writes)
+	{
+		// a region that is both read and written only needs to be treated as written
+		for (size_t i = 0; i < num_writes; i++)
+		{
+			CDependencyNode::SAccess a = { writes[i], true };
+			node->m_Access.push_back(a);
+		}
+
+		for (size_t i = 0; i < num_reads; i++)
+		{
+			if (std::find(writes, writes + num_writes, reads[i]) != (writes + num_writes))
+				continue;
+
+			CDependencyNode::SAccess a = { reads[i], false };
+			node->m_Access.push_back(a);
+		}
+
+		std::sort(node->m_Access.begin(), node->m_Access.end(), [](const CDependencyNode::SAccess &a, const CDependencyNode::SAccess &b)
+		{
+			return (a.m_Region < b.m_Region) || ((a.m_Region == b.m_Region) && (a.m_Write > b.m_Write));
+		});
+
+		node->m_Access.erase(std::unique(node->m_Access.begin(), node->m_Access.end(), [](const CDependencyNode::SAccess &a, const CDependencyNode::SAccess &b)
+		{
+			return (a.m_Region == b.m_Region);
+		}), node->m_Access.end());
+
+		std::vector<size_t> buckets;
+		buckets.reserve(node->m_Access.size());
+		for (const auto &a : node->m_Access)
+			buckets.push_back(GetBucketIndex(a.m_Region));
+
+		std::sort(buckets.begin(), buckets.end());
+		buckets.erase(std::unique(buckets.begin(), buckets.end()), buckets.end());
+
+		for (size_t b : buckets)
+			m_Bucket[b].m_Lock.lock();
+
+		for (const auto &a : node->m_Access)
+		{
+			SRegionState &rs = m_Bucket[GetBucketIndex(a.m_Region)].m_Regions[a.m_Region];
+
+			// everyone waits for the last writer
+			if (rs.m_pLastWriter)
+				node->AddPredecessor(rs.m_pLastWriter);
+
+			if (!a.m_Write)
+			{
+				node->AddRef();
+				rs.m_Readers.push_back(node);
+				continue;
+			}
+
+			// writers also wait for the readers since that write, and then replace them all
+			for (CDependencyNode *reader : rs.m_Readers)
+			{
+				node->AddPredecessor(reader);
+				reader->Release();
+			}
+			rs.m_Readers.clear();
+
+			if (rs.m_pLastWriter)
+				rs.m_pLastWriter->Release();
+
+			node->AddRef();
+			rs.m_pLastWriter = node;
+		}
+
+		for (auto it = buckets.rbegin(); it != buckets.rend(); it++)
+			m_Bucket[*it].m_Lock.unlock();
+
+		// drop the submitter's hold; if there was nothing to wait for, this launches the node
+		node->Satisfy();
+	}
+
+	// Marks node finished, releases the nodes that were waiting on it and removes it from the region table
+	void Retire(CDependencyNode *node)
+	{
+		std::vector<CDependencyNode *> successors;
+
+		{
+			std::lock_guard<std::mutex> l(node->m_mutexSuccessors);
+
+			node->m_Finished = true;
+			successors.swap(node->m_Successors);
+		}
+
+		for (const auto &a : node->m_Access)
+		{
+			SBucket &bucket = m_Bucket[GetBucketIndex(a.m_Region)];
+			std::lock_guard<std::mutex> l(bucket.m_Lock);
+
+			TRegionMap::iterator it = bucket.m_Regions.find(a.m_Region);
+			if (it == bucket.m_Regions.end())
+				continue;
+
+			SRegionState &rs = it->second;
+
+			if (rs.m_pLastWriter == node)
+			{
+				rs.m_pLastWriter = nullptr;
+				node->Release();
+			}
+
+			std::vector<CDependencyNode *>::iterator r = std::find(rs.m_Readers.begin(), rs.m_Readers.end(), node);
+			if (r != rs.m_Readers.end())
+			{
+				rs.m_Readers.erase(r);
+				node->Release();
+			}
+
+			if (!rs.m_pLastWriter && rs.m_Readers.empty())
+				bucket.m_Regions.erase(it);
+		}
+
+		for (CDependencyNode *succ : successors)
+		{
+			succ->Satisfy();
+			succ->Release();
+		}
+	}
+};
@@ -0,0 +1,181 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#include <Pool.h>
+
+
+// Injects random delays into the scheduler, for testing how a workload's tail latency holds up when threads are
+// preempted, wake-ups are late or tasks run much longer than expected. When disabled, each injection point costs
+// one atomic load
+class CFaultInjector
+{
+
+public:
+
+	typedef enum
+	{
+		FP_ENQUEUE = 0,		// before tasks are queued, on the submitting thread
+		FP_WAKE,			// when a worker is woken up to run tasks
+		FP_DEQUEUE,			// before a worker takes a task off the queue
+		FP_RUN,				// after a worker has taken a task, before running it (this is also where workers stall)
+
+		FP_NUMPOINTS
+	} FAULT_POINT;
+
+protected:
+
+	typedef pool::IThreadPool::FAULT_INJECTION TConfig;
+
+	std::atomic<const TConfig *> m_pConfig;
+
+	// threads may still be reading a config after it's been replaced, so they're all kept until destruction
+	std::vector<TConfig *> m_Configs;
+	std::mutex m_mutexConfigs;
+
+	// splitmix64 state, shared by all of the pool's threads and restarted from the seed by each new config
+	std::atomic<uint64_t> m_RandomState;
+
+	// Returns a random number in [0, 1)
+	double Random()
+	{
+		uint64_t z = m_RandomState.fetch_add(0x9E3779B97F4A7C15ull, std::memory_order_relaxed) + 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		z ^= z >> 31;
+
+		return (double)(z >> 11) / (double)(1ull << 53);
+	}
+
+	static void Delay(uint64_t us)
+	{
+		if (us)
+			std::this_thread::sleep_for(std::chrono::microseconds(us));
+	}
+
+public:
+
+	CFaultInjector()
+	{
+		m_pConfig = nullptr;
+		m_RandomState = 0;
+	}
+
+	~CFaultInjector()
+	{
+		for (TConfig *c : m_Configs)
+			delete c;
+	}
+
+	inline bool IsEnabled()
+	{
+		return (m_pConfig.load(std::memory_order_relaxed) != nullptr);
+	}
+
+	// A null config turns injection off
+	void SetConfig(const TConfig *config)
+	{
+		if (!config)
+		{
+			m_pConfig = nullptr;
+			return;
+		}
+
+		TConfig *c = new TConfig(*config);
+
+		std::lock_guard<std::mutex> l(m_mutexConfigs);
+
+		m_Configs.push_back(c);
+		m_RandomState = c->seed;
+		m_pConfig = c;
+	}
+
+	inline void Inject(FAULT_POINT point)
+	{
+		const TConfig *c = m_pConfig.load(std::memory_order_acquire);
+		if (!c)
+			return;
+
+		float chance = 0.0f;
+		uint32_t max_us = 0;
+
+		switch (point)
+		{
+			case FP_ENQUEUE:
+				chance = c->enqueue_chance;
+				max_us = c->enqueue_delay_us;
+				break;
+
+			case FP_WAKE:
+				chance = c->wake_chance;
+				max_us = c->wake_delay_us;
+				break;
+
+			case FP_DEQUEUE:
+				chance = c->dequeue_chance;
+				max_us = c->dequeue_delay_us;
+				break;
+
+			case FP_RUN:
+				chance = c->run_chance;
+				max_us = c->run_delay_us;
+
+				if ((c->stall_chance > 0.0f) && (Random() < c->stall_chance))
+					Delay((uint64_t)c->stall_ms * 1000);
+				break;
+
+			default:
+				break;
+		}
+
+		if ((chance > 0.0f) && (Random() < chance))
+			Delay((uint64_t)(Random() * (double)max_us));
+	}
+
+	// Called after a task ran from start_ns to end_ns; might make it take slow_factor times as long, and returns
+	// the time it ended up finishing
+	inline uint64_t Stretch(uint64_t start_ns, uint64_t end_ns)
+	{
+		const TConfig *c = m_pConfig.load(std::memory_order_acquire);
+		if (!c || (c->slow_chance <= 0.0f) || (c->slow_factor <= 1.0f) || (Random() >= c->slow_chance))
+			return end_ns;
+
+		uint64_t extra_ns = (uint64_t)((double)(end_ns - start_ns) * (double)(c->slow_factor - 1.0f));
+		std::this_thread::sleep_for(std::chrono::nanoseconds(extra_ns));
+
+		return end_ns + extra_ns;
+	}
+};
@@ -0,0 +1,225 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <unordered_map>
+#include <algorithm>
+#include <mutex>
+
+
+// Chooses chunk sizes for ParallelFor call sites by measuring, for each call site, how long a single
+// index takes to process and how much scheduling overhead each chunk costs, then picking the smallest
+// grain that keeps overhead / useful work at or below the target ratio
+class CGrainTuner
+{
+
+protected:
+
+	struct SGrainInfo
+	{
+		// smoothed time, in nanoseconds, to process one index
+		double m_ItemNS;
+
+		// smoothed scheduling overhead, in nanoseconds, paid per chunk
+		double m_ChunkOverheadNS;
+
+		// the grain size derived from the two above
+		size_t m_Grain;
+
+		// how many measurements have been folded in
+		size_t m_Samples;
+	};
+
+	typedef std::unordered_map<uint64_t, SGrainInfo> TGrainTable;
+
+	TGrainTable m_Table;
+
+	std::mutex m_mutexTable;
+
+	double m_TargetRatio;
+
+	// weight given to each new measurement
+	static constexpr double EWMA_ALPHA = 0.25;
+
+	// the number of chunks each participant should get at minimum, so that the tail stays balanced
+	static constexpr size_t MIN_CHUNKS_PER_PARTICIPANT = 4;
+
+	static size_t MaxGrain(size_t count, size_t participants)
+	{
+		return std::max<size_t>(1, count / (std::max<size_t>(1, participants) * MIN_CHUNKS_PER_PARTICIPANT));
+	}
+
+	size_t ComputeGrain(const SGrainInfo &gi) const
+	{
+		if ((gi.m_ItemNS <= 0.0) || (m_TargetRatio <= 0.0))
+			return 1;
+
+		double g = gi.m_ChunkOverheadNS / (m_TargetRatio * gi.m_ItemNS);
+
+		return (size_t)std::max<double>(1.0, std::min<double>(g, (double)SIZE_MAX / 2));
+	}
+
+public:
+
+	CGrainTuner()
+	{
+		m_TargetRatio = 0.05;
+	}
+
+	void SetTargetRatio(float ratio)
+	{
+		std::lock_guard<std::mutex> l(m_mutexTable);
+
+		m_TargetRatio = std::max<double>(0.0001, ratio);
+
+		for (auto &it : m_Table)
+			it.second.m_Grain = ComputeGrain(it.second);
+	}
+
+	// Returns the grain size to use for the given call site, clamped so that there is still enough
+	// parallel slack for the number of participants
+	size_t GetGrain(uint64_t callsite, size_t count, size_t participants)
+	{
+		size_t maxgrain = MaxGrain(count, participants);
+
+		std::lock_guard<std::mutex> l(m_mutexTable);
+
+		TGrainTable::const_iterator it = m_Table.find(callsite);
+		if (it == m_Table.end())
+		{
+			// nothing known yet... start small and let the measurements push it up
+			return std::max<size_t>(1, maxgrain / 2);
+		}
+
+		return std::min<size_t>(it->second.m_Grain, maxgrain);
+	}
+
+	// Returns the stored grain size for a call site, or 0 if it has never been measured
+	size_t PeekGrain(uint64_t callsite)
+	{
+		std::lock_guard<std::mutex> l(m_mutexTable);
+
+		TGrainTable::const_iterator it = m_Table.find(callsite);
+		return (it != m_Table.end()) ? it->second.m_Grain : 0;
+	}
+
+	// Folds one ParallelFor's measurements into the call site's table entry
+	//   work_ns is the total time spent inside the range callback
+	//   overhead_ns is the total time participants spent between chunks (claiming, dispatch, timing)
+	void Record(uint64_t callsite, size_t count, size_t chunks, uint64_t work_ns, uint64_t overhead_ns)
+	{
+		if (!count || !chunks)
+			return;
+
+		double item = (double)work_ns / (double)count;
+		double overhead = (double)overhead_ns / (double)chunks;
+
+		std::lock_guard<std::mutex> l(m_mutexTable);
+
+		std::pair<TGrainTable::iterator, bool> ins = m_Table.insert(TGrainTable::value_type(callsite, SGrainInfo()));
+		SGrainInfo &gi = ins.first->second;
+
+		if (ins.second || !gi.m_Samples)
+		{
+			gi.m_ItemNS = item;
+			gi.m_ChunkOverheadNS = overhead;
+			gi.m_Samples = 0;
+		}
+		else
+		{
+			gi.m_ItemNS += (item - gi.m_ItemNS) * EWMA_ALPHA;
+			gi.m_ChunkOverheadNS += (overhead - gi.m_ChunkOverheadNS) * EWMA_ALPHA;
+		}
+
+		gi.m_Samples++;
+		gi.m_Grain = ComputeGrain(gi);
+	}
+
+	// The table is stored as text, one call site per line:
+	//    <callsite> <item ns> <chunk overhead ns> <samples>
+	bool Save(const char *filename)
+	{
+		if (!filename)
+			return false;
+
+		FILE *f = fopen(filename, "w");
+		if (!f)
+			return false;
+
+		std::lock_guard<std::mutex> l(m_mutexTable);
+
+		for (const auto &it : m_Table)
+		{
+			fprintf(f, "%llu %.6g %.6g %llu\n", (unsigned long long)it.first, it.second.m_ItemNS, it.second.m_ChunkOverheadNS,
+				(unsigned long long)it.second.m_Samples);
+		}
+
+		bool ret = !ferror(f);
+		fclose(f);
+
+		return ret;
+	}
+
+	bool Load(const char *filename)
+	{
+		if (!filename)
+			return false;
+
+		FILE *f = fopen(filename, "r");
+		if (!f)
+			return false;
+
+		std::lock_guard<std::mutex> l(m_mutexTable);
+
+		size_t loaded = 0;
+
+		unsigned long long callsite, samples;
+		double item, overhead;
+		while (fscanf(f, "%llu %lf %lf %llu", &callsite, &item, &overhead, &samples) == 4)
+		{
+			// a time of zero (or NaN, or infinity) isn't a measurement
+			if (!isfinite(item) || !isfinite(overhead) || (item <= 0.0) || (overhead <= 0.0))
+				continue;
+
+			SGrainInfo &gi = m_Table[(uint64_t)callsite];
+			gi.m_ItemNS = item;
+			gi.m_ChunkOverheadNS = overhead;
+			gi.m_Samples = (size_t)samples;
+			gi.m_Grain = ComputeGrain(gi);
+
+			loaded++;
+		}
+
+		fclose(f);
+
+		return (loaded > 0);
+	}
+};
@@ -0,0 +1,164 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+
+#include <Pool.h>
+
+
+// Records how long tasks wait between being queued and starting to run, in buckets that are a quarter of a power
+// of two wide (so any value is reported within 25%), cheaply enough to do for every task
+class CLatencyHistogram
+{
+
+protected:
+
+	static const size_t SUB_BITS = 2;
+	static const size_t NUM_BUCKETS = 64 << SUB_BITS;
+
+	std::atomic<uint64_t> m_Bucket[NUM_BUCKETS];
+
+	std::atomic<uint64_t> m_Count;
+	std::atomic<uint64_t> m_SumNS;
+	std::atomic<uint64_t> m_MaxNS;
+
+	std::atomic<bool> m_Enabled;
+
+	static size_t FloorLog2(uint64_t v)
+	{
+		size_t r = 0;
+		for (size_t s = 32; s; s >>= 1)
+		{
+			if (v >> s)
+			{
+				v >>= s;
+				r += s;
+			}
+		}
+
+		return r;
+	}
+
+	static size_t GetBucket(uint64_t ns)
+	{
+		if (ns < (1 << SUB_BITS))
+			return (size_t)ns;
+
+		size_t msb = FloorLog2(ns);
+		size_t sub = (size_t)(ns >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+
+		return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+	}
+
+	// Returns the largest value that falls in the bucket
+	static uint64_t GetBucketLimit(size_t bucket)
+	{
+		if (bucket < (1 << SUB_BITS))
+			return bucket;
+
+		size_t msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+		uint64_t sub = bucket & ((1 << SUB_BITS) - 1);
+		uint64_t width = 1ull << (msb - SUB_BITS);
+
+		return ((((1ull << SUB_BITS) + sub) * width) - 1) + width;
+	}
+
+	double GetPercentile(double q, uint64_t count)
+	{
+		uint64_t target = std::max<uint64_t>(1, (uint64_t)(q * (double)count + 0.5));
+		uint64_t seen = 0;
+
+		for (size_t b = 0; b < NUM_BUCKETS; b++)
+		{
+			seen += m_Bucket[b].load(std::memory_order_relaxed);
+			if (seen >= target)
+				return (double)std::min<uint64_t>(GetBucketLimit(b), m_MaxNS.load()) / 1e9;
+		}
+
+		return (double)m_MaxNS.load() / 1e9;
+	}
+
+public:
+
+	CLatencyHistogram()
+	{
+		m_Enabled = false;
+		Reset();
+	}
+
+	void Reset()
+	{
+		for (auto &b : m_Bucket)
+			b = 0;
+
+		m_Count = 0;
+		m_SumNS = 0;
+		m_MaxNS = 0;
+	}
+
+	// Enabling starts over with an empty histogram
+	void Enable(bool enable)
+	{
+		if (enable)
+			Reset();
+
+		m_Enabled = enable;
+	}
+
+	inline bool IsEnabled()
+	{
+		return m_Enabled.load(std::memory_order_relaxed);
+	}
+
+	inline void Record(uint64_t ns)
+	{
+		m_Bucket[GetBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		m_Count.fetch_add(1, std::memory_order_relaxed);
+		m_SumNS.fetch_add(ns, std::memory_order_relaxed);
+
+		uint64_t m = m_MaxNS.load(std::memory_order_relaxed);
+		while ((ns > m) && !m_MaxNS.compare_exchange_weak(m, ns, std::memory_order_relaxed)) { }
+	}
+
+	void GetStats(pool::IThreadPool::LATENCY_STATS &stats)
+	{
+		uint64_t count = m_Count.load();
+
+		stats.count = count;
+		stats.mean = count ? (((double)m_SumNS.load() / (double)count) / 1e9) : 0.0;
+		stats.max = (double)m_MaxNS.load() / 1e9;
+
+		stats.p50 = count ? GetPercentile(0.5, count) : 0.0;
+		stats.p90 = count ? GetPercentile(0.9, count) : 0.0;
+		stats.p99 = count ? GetPercentile(0.99, count) : 0.0;
+		stats.p999 = count ? GetPercentile(0.999, count) : 0.0;
+	}
+};
@@ -0,0 +1,351 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#include <Pool.h>
+
+
+// Tracks arrivals, completions and busy workers with plain atomic counters, and periodically folds them into
+// exponentially weighted signals. Updates are opportunistic: whichever thread passes a task boundary after the
+// update interval has elapsed does the work, everyone else just bumps counters
+class CLoadMonitor
+{
+
+protected:
+
+	typedef pool::IThreadPool::LOAD_SIGNAL LOAD_SIGNAL;
+	typedef pool::IThreadPool::LOAD_CALLBACK LOAD_CALLBACK;
+	typedef pool::IThreadPool::LOAD_INFO LOAD_INFO;
+
+	std::atomic<size_t> m_Queued;
+	std::atomic<size_t> m_Busy;
+	std::atomic<uint64_t> m_Arrivals;
+	std::atomic<uint64_t> m_Completions;
+
+	// the smoothed signals, published for lock-free reads
+	std::atomic<double> m_Utilization;
+	std::atomic<double> m_ArrivalRate;
+	std::atomic<double> m_CompletionRate;
+
+	// the state of the last update; only touched while holding m_mutexUpdate
+	std::atomic<uint64_t> m_LastUpdateNS;
+	uint64_t m_LastArrivals;
+	uint64_t m_LastCompletions;
+
+	double m_TimeConstantNS;
+
+	size_t m_NumThreads;
+
+	struct SSubscription
+	{
+		uint32_t m_ID;
+		LOAD_SIGNAL m_Signal;
+		double m_Threshold;
+		LOAD_CALLBACK m_Callback;
+		void *m_UserData;
+
+		// which side of the threshold the signal was on at the last update
+		bool m_Above;
+	};
+
+	std::vector<SSubscription> m_Subscriptions;
+
+	// a threshold crossing, collected under the lock and reported after it's released
+	struct SNotification
+	{
+		LOAD_CALLBACK m_Callback;
+		LOAD_SIGNAL m_Signal;
+		double m_Value;
+		bool m_Above;
+		void *m_UserData;
+	};
+
+	uint32_t m_NextSubscriptionID;
+
+	std::mutex m_mutexUpdate;
+
+	// don't fold the counters in more often than this
+	static const uint64_t UPDATE_INTERVAL_NS = 100000;
+
+	static inline uint64_t GetTimeNS()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	double GetSignal(LOAD_SIGNAL signal)
+	{
+		switch (signal)
+		{
+			case LOAD_SIGNAL::LS_UTILIZATION:
+				return m_Utilization.load(std::memory_order_relaxed);
+
+			case LOAD_SIGNAL::LS_ARRIVALRATE:
+				return m_ArrivalRate.load(std::memory_order_relaxed);
+
+			case LOAD_SIGNAL::LS_COMPLETIONRATE:
+				return m_CompletionRate.load(std::memory_order_relaxed);
+
+			case LOAD_SIGNAL::LS_QUEUEWAIT:
+				return EstimateQueueWait();
+
+			case LOAD_SIGNAL::LS_QUEUELENGTH:
+				return (double)m_Queued.load(std::memory_order_relaxed);
+
+			default:
+				break;
+		}
+
+		return 0.0;
+	}
+
+	// Little's law: the time a new arrival waits is the number ahead of it divided by the rate they're being served
+	double EstimateQueueWait()
+	{
+		double queued = (double)m_Queued.load(std::memory_order_relaxed);
+		if (queued <= 0.0)
+			return 0.0;
+
+		double rate = m_CompletionRate.load(std::memory_order_relaxed);
+		if (rate <= 0.0)
+			return HUGE_VAL;
+
+		return queued / rate;
+	}
+
+	// Folds the counters in; threshold crossings are added to fired, for the caller to report once the lock is released
+	void Update(uint64_t now, std::vector<SNotification> &fired)
+	{
+		uint64_t last = m_LastUpdateNS.load(std::memory_order_relaxed);
+		if (now <= last)
+			return;
+
+		double dt = (double)(now - last);
+
+		// the weight of a new sample for an irregular sampling interval
+		double alpha = 1.0 - exp(-dt / m_TimeConstantNS);
+
+		uint64_t arrivals = m_Arrivals.load(std::memory_order_relaxed);
+		uint64_t completions = m_Completions.load(std::memory_order_relaxed);
+
+		double busy = (double)m_Busy.load(std::memory_order_relaxed) / (double)std::max<size_t>(1, m_NumThreads);
+		double arrival_rate = (double)(arrivals - m_LastArrivals) * 1e9 / dt;
+		double completion_rate = (double)(completions - m_LastCompletions) * 1e9 / dt;
+
+		double u = m_Utilization.load(std::memory_order_relaxed);
+		m_Utilization.store(u + (std::min<double>(busy, 1.0) - u) * alpha, std::memory_order_relaxed);
+
+		double ar = m_ArrivalRate.load(std::memory_order_relaxed);
+		m_ArrivalRate.store(ar + (arrival_rate - ar) * alpha, std::memory_order_relaxed);
+
+		double cr = m_CompletionRate.load(std::memory_order_relaxed);
+		m_CompletionRate.store(cr + (completion_rate - cr) * alpha, std::memory_order_relaxed);
+
+		m_LastArrivals = arrivals;
+		m_LastCompletions = completions;
+		m_LastUpdateNS.store(now, std::memory_order_relaxed);
+
+		for (auto &sub : m_Subscriptions)
+		{
+			double v = GetSignal(sub.m_Signal);
+
+			bool above = (v > sub.m_Threshold);
+			if (above != sub.m_Above)
+			{
+				sub.m_Above = above;
+				fired.push_back({ sub.m_Callback, sub.m_Signal, v, above, sub.m_UserData });
+			}
+		}
+	}
+
+public:
+
+	CLoadMonitor()
+	{
+		m_Queued = 0;
+		m_Busy = 0;
+		m_Arrivals = 0;
+		m_Completions = 0;
+
+		m_Utilization = 0.0;
+		m_ArrivalRate = 0.0;
+		m_CompletionRate = 0.0;
+
+		m_LastUpdateNS = GetTimeNS();
+		m_LastArrivals = 0;
+		m_LastCompletions = 0;
+
+		m_TimeConstantNS = 100e6;
+
+		m_NumThreads = 0;
+		m_NextSubscriptionID = 1;
+	}
+
+	void SetNumThreads(size_t num_threads)
+	{
+		m_NumThreads = num_threads;
+	}
+
+	void SetTimeConstant(uint32_t milliseconds)
+	{
+		std::lock_guard<std::mutex> l(m_mutexUpdate);
+
+		m_TimeConstantNS = std::max<double>(1.0, (double)milliseconds) * 1e6;
+	}
+
+	// tasks were added to the queue; arrival is false for tasks that are being re-queued
+	inline void OnQueued(size_t count, bool arrival = true)
+	{
+		m_Queued.fetch_add(count, std::memory_order_relaxed);
+
+		if (arrival)
+		{
+			m_Arrivals.fetch_add(count, std::memory_order_relaxed);
+			Tick();
+		}
+	}
+
+	// tasks were removed from the queue without being run
+	inline void OnPurged(size_t count)
+	{
+		m_Queued.fetch_sub(count, std::memory_order_relaxed);
+	}
+
+	// a task was taken off the queue and is about to run
+	// count is the number of tasks the thread took off the queue to run together
+	inline void OnStarted(size_t count = 1)
+	{
+		m_Queued.fetch_sub(count, std::memory_order_relaxed);
+		m_Busy.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// tasks out of a take that's still running others completed without running (they were cancelled, say)
+	inline void OnCompleted(size_t count)
+	{
+		m_Completions.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	// a task finished running
+	// completed is the number of tasks that completed, which is 0 if the task was re-queued
+	inline void OnFinished(size_t completed = 1)
+	{
+		if (completed)
+			m_Completions.fetch_add(completed, std::memory_order_relaxed);
+
+		// sample before leaving the busy count, since this worker was busy for the interval being measured
+		Tick();
+
+		m_Busy.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Folds the counters into the signals if the update interval has passed and nobody else is doing it
+	inline void Tick()
+	{
+		uint64_t now = GetTimeNS();
+		if ((now - m_LastUpdateNS.load(std::memory_order_relaxed)) < UPDATE_INTERVAL_NS)
+			return;
+
+		std::vector<SNotification> fired;
+
+		{
+			std::unique_lock<std::mutex> l(m_mutexUpdate, std::try_to_lock);
+			if (!l.owns_lock())
+				return;
+
+			Update(now, fired);
+		}
+
+		// callbacks are free to subscribe, unsubscribe or queue more work
+		for (const auto &n : fired)
+			n.m_Callback(n.m_Signal, n.m_Value, n.m_Above, n.m_UserData);
+	}
+
+	size_t GetQueuedCount()
+	{
+		return m_Queued.load(std::memory_order_relaxed);
+	}
+
+	size_t GetBusyCount()
+	{
+		return m_Busy.load(std::memory_order_relaxed);
+	}
+
+	void GetInfo(LOAD_INFO &info)
+	{
+		Tick();
+
+		info.utilization = m_Utilization.load(std::memory_order_relaxed);
+		info.arrival_rate = m_ArrivalRate.load(std::memory_order_relaxed);
+		info.completion_rate = m_CompletionRate.load(std::memory_order_relaxed);
+		info.queue_wait = EstimateQueueWait();
+		info.queue_length = m_Queued.load(std::memory_order_relaxed);
+		info.busy_threads = m_Busy.load(std::memory_order_relaxed);
+	}
+
+	uint32_t Subscribe(LOAD_SIGNAL signal, double threshold, LOAD_CALLBACK callback, void *userdata)
+	{
+		if (!callback)
+			return 0;
+
+		std::lock_guard<std::mutex> l(m_mutexUpdate);
+
+		SSubscription sub;
+		sub.m_ID = m_NextSubscriptionID++;
+		sub.m_Signal = signal;
+		sub.m_Threshold = threshold;
+		sub.m_Callback = callback;
+		sub.m_UserData = userdata;
+		sub.m_Above = (GetSignal(signal) > threshold);
+
+		m_Subscriptions.push_back(sub);
+
+		return sub.m_ID;
+	}
+
+	bool Unsubscribe(uint32_t id)
+	{
+		std::lock_guard<std::mutex> l(m_mutexUpdate);
+
+		for (auto it = m_Subscriptions.begin(); it != m_Subscriptions.end(); it++)
+		{
+			if (it->m_ID == id)
+			{
+				m_Subscriptions.erase(it);
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
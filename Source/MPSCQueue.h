@@ -0,0 +1,109 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+
+// An intrusive multi-producer queue where the consumer takes everything at once. T must have a member
+// std::atomic<T *> m_pNext that the queue owns while the node is queued.
+//
+// Like Vyukov's MPSC queue, a producer publishes a node with one atomic exchange and links it to its
+// predecessor afterwards, so pushes never retry. The consumer detaches the whole backlog with one atomic
+// exchange; the detached chain runs newest to oldest, and a node whose link hasn't been written yet is
+// marked with a sentinel that the consumer waits out (the producer is between two instructions).
+// Because each drain gets a disjoint chain, concurrent drains are safe too.
+template <typename T> class TMPSCQueue
+{
+
+protected:
+
+	// the most recently pushed node
+	std::atomic<T *> m_pTop;
+
+	static T *Unlinked()
+	{
+		return (T *)(uintptr_t)1;
+	}
+
+public:
+
+	TMPSCQueue()
+	{
+		m_pTop = nullptr;
+	}
+
+	bool Empty() const
+	{
+		return (m_pTop.load(std::memory_order_relaxed) == nullptr);
+	}
+
+	// Pushes a chain of nodes that the caller has already linked together, oldest first: every node's m_pNext
+	// must point to the node pushed before it, except for oldest's, which is filled in here
+	void PushChain(T *oldest, T *newest)
+	{
+		oldest->m_pNext.store(Unlinked(), std::memory_order_relaxed);
+
+		T *prev = m_pTop.exchange(newest, std::memory_order_acq_rel);
+
+		oldest->m_pNext.store(prev, std::memory_order_release);
+	}
+
+	void Push(T *node)
+	{
+		PushChain(node, node);
+	}
+
+	// Detaches everything that has been pushed and returns the oldest node, with the chain relinked so that
+	// m_pNext runs from oldest to newest (nullptr terminated). count receives the number of nodes
+	T *Drain(size_t &count)
+	{
+		count = 0;
+
+		T *node = m_pTop.exchange(nullptr, std::memory_order_acquire);
+
+		// reverse the chain into FIFO order as we walk it
+		T *fifo = nullptr;
+		while (node)
+		{
+			T *next;
+			while ((next = node->m_pNext.load(std::memory_order_acquire)) == Unlinked())
+				std::this_thread::yield();
+
+			node->m_pNext.store(fifo, std::memory_order_relaxed);
+			fifo = node;
+			node = next;
+
+			count++;
+		}
+
+		return fifo;
+	}
+};
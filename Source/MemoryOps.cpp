@@ -0,0 +1,349 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#if defined(_WIN32)
+
+#include <windows.h>
+
+#elif defined(__linux__)
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#endif
+
+#include <memory.h>
+#include <algorithm>
+#include <atomic>
+
+#include "MemoryOps.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+
+#define POOL_X86
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#include <emmintrin.h>
+#include <nmmintrin.h>
+
+// MSVC allows any intrinsic anywhere, but gcc and clang need to be told which functions may use SSE4.2
+#if defined(__GNUC__)
+#define POOL_TARGET_SSE42 __attribute__((target("sse4.2")))
+#else
+#define POOL_TARGET_SSE42
+#endif
+
+#endif
+
+
+void StreamingCopy(void *dst, const void *src, size_t size)
+{
+#if defined(POOL_X86)
+	uint8_t *d = (uint8_t *)dst;
+	const uint8_t *s = (const uint8_t *)src;
+
+	// streaming stores need a 16-byte aligned destination, so copy up to the boundary normally
+	size_t head = std::min<size_t>((16 - ((uintptr_t)d & 15)) & 15, size);
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	size -= head;
+
+	while (size >= 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + 0));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+		_mm_stream_si128((__m128i *)(d + 0), a);
+		_mm_stream_si128((__m128i *)(d + 16), b);
+		_mm_stream_si128((__m128i *)(d + 32), c);
+		_mm_stream_si128((__m128i *)(d + 48), e);
+
+		d += 64;
+		s += 64;
+		size -= 64;
+	}
+
+	while (size >= 16)
+	{
+		_mm_stream_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+
+		d += 16;
+		s += 16;
+		size -= 16;
+	}
+
+	memcpy(d, s, size);
+#else
+	memcpy(dst, src, size);
+#endif
+}
+
+
+void MemoryFence()
+{
+#if defined(POOL_X86)
+	_mm_sfence();
+#else
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+#endif
+}
+
+
+void PrefetchRange(const void *addr, size_t size)
+{
+	const char *p = (const char *)((uintptr_t)addr & ~(uintptr_t)63);
+	const char *end = (const char *)addr + size;
+
+	for (; p < end; p += 64)
+	{
+#if defined(POOL_X86)
+		_mm_prefetch(p, _MM_HINT_T1);
+#elif defined(__GNUC__)
+		__builtin_prefetch(p, 0, 2);
+#endif
+	}
+}
+
+
+// the reflected Castagnoli polynomial
+#define CRC32C_POLY		0x82F63B78
+
+static const uint32_t *GetCRC32CTable()
+{
+	struct STable
+	{
+		uint32_t m_Entry[256];
+
+		STable()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (uint32_t k = 0; k < 8; k++)
+					c = (c & 1) ? ((c >> 1) ^ CRC32C_POLY) : (c >> 1);
+
+				m_Entry[i] = c;
+			}
+		}
+	};
+
+	static STable table;
+	return table.m_Entry;
+}
+
+static uint32_t CRC32C_SW(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const uint32_t *table = GetCRC32CTable();
+
+	crc = ~crc;
+	while (size--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+#if defined(POOL_X86)
+
+static bool CPUHasSSE42()
+{
+	int info[4] = { 0 };
+
+#if defined(_MSC_VER)
+	__cpuid(info, 1);
+#else
+	__get_cpuid(1, (unsigned int *)&info[0], (unsigned int *)&info[1], (unsigned int *)&info[2], (unsigned int *)&info[3]);
+#endif
+
+	return (info[2] & (1 << 20)) != 0;
+}
+
+POOL_TARGET_SSE42 static uint32_t CRC32C_HW(uint32_t crc, const uint8_t *p, size_t size)
+{
+	crc = ~crc;
+
+	while (size && ((uintptr_t)p & 7))
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+		size--;
+	}
+
+#if defined(_M_X64) || defined(__x86_64__)
+	uint64_t crc64 = crc;
+	while (size >= 8)
+	{
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+		p += 8;
+		size -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+
+	while (size >= 4)
+	{
+		crc = _mm_crc32_u32(crc, *(const uint32_t *)p);
+		p += 4;
+		size -= 4;
+	}
+
+	while (size--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return ~crc;
+}
+
+#endif
+
+uint32_t ComputeCRC32C(uint32_t crc, const void *data, size_t size)
+{
+#if defined(POOL_X86)
+	static const bool hw = CPUHasSSE42();
+	if (hw)
+		return CRC32C_HW(crc, (const uint8_t *)data, size);
+#endif
+
+	return CRC32C_SW(crc, (const uint8_t *)data, size);
+}
+
+
+// CRC combination works by applying the operator "append len2 zero bytes" to crc1 in the GF(2) polynomial
+// space, built by repeated squaring of the one-zero-bit operator (the same approach zlib uses)
+static uint32_t GF2MatrixTimes(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+	while (vec)
+	{
+		if (vec & 1)
+			sum ^= *mat;
+
+		vec >>= 1;
+		mat++;
+	}
+
+	return sum;
+}
+
+static void GF2MatrixSquare(uint32_t *square, const uint32_t *mat)
+{
+	for (uint32_t n = 0; n < 32; n++)
+		square[n] = GF2MatrixTimes(mat, mat[n]);
+}
+
+uint32_t CombineCRC32C(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	if (!len2)
+		return crc1;
+
+	uint32_t even[32], odd[32];
+
+	// the operator for one zero bit
+	odd[0] = CRC32C_POLY;
+	uint32_t row = 1;
+	for (uint32_t n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	// two zero bits, then four
+	GF2MatrixSquare(even, odd);
+	GF2MatrixSquare(odd, even);
+
+	// apply len2 zero bytes to crc1, one bit of len2 at a time
+	do
+	{
+		GF2MatrixSquare(even, odd);
+		if (len2 & 1)
+			crc1 = GF2MatrixTimes(even, crc1);
+		len2 >>= 1;
+
+		if (!len2)
+			break;
+
+		GF2MatrixSquare(odd, even);
+		if (len2 & 1)
+			crc1 = GF2MatrixTimes(odd, crc1);
+		len2 >>= 1;
+	}
+	while (len2);
+
+	return crc1 ^ crc2;
+}
+
+
+static size_t QueryMemoryPageSize()
+{
+	size_t page_size = 0;
+
+#if defined(_WIN32)
+	SYSTEM_INFO sysinfo;
+	GetSystemInfo(&sysinfo);
+	page_size = sysinfo.dwPageSize;
+#elif defined(__linux__)
+	page_size = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+
+	return page_size ? page_size : 4096;
+}
+
+size_t GetMemoryPageSize()
+{
+	// initialized once, even when the first calls race
+	static const size_t page_size = QueryMemoryPageSize();
+
+	return page_size;
+}
+
+
+uint32_t GetCurrentNumaNode()
+{
+#if defined(_WIN32)
+	PROCESSOR_NUMBER pn;
+	GetCurrentProcessorNumberEx(&pn);
+
+	USHORT node = 0;
+	if (!GetNumaProcessorNodeEx(&pn, &node))
+		return 0;
+
+	return node;
+#elif defined(__linux__)
+	unsigned int cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+		return 0;
+
+	return node;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,59 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// Chunk-level kernels used by the parallel memory operations; each of these processes one contiguous
+// piece of a buffer on the calling thread
+
+// Copies size bytes using non-temporal stores where the destination allows it, so that a large copy
+// doesn't evict the working set of other tasks from the cache. Call MemoryFence once all chunks are done
+void StreamingCopy(void *dst, const void *src, size_t size);
+
+// Makes non-temporal stores issued by StreamingCopy visible to other threads
+void MemoryFence();
+
+// Asks the CPU to start pulling size bytes at addr into the cache (L2, ideally) without waiting for them;
+// it's only a hint, so bad addresses are harmless
+void PrefetchRange(const void *addr, size_t size);
+
+// Computes the CRC-32C (Castagnoli) of data, continuing from crc (0 to begin). Uses the SSE4.2 crc32
+// instruction when the CPU supports it and a table otherwise
+uint32_t ComputeCRC32C(uint32_t crc, const void *data, size_t size);
+
+// Given crc1 = CRC32C(A) and crc2 = CRC32C(B), returns CRC32C(A followed by B) where len2 is the length of B
+uint32_t CombineCRC32C(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+// Returns the page size used to align the chunks of the parallel memory operations
+size_t GetMemoryPageSize();
+
+// Returns the NUMA node of the processor the calling thread is currently running on
+uint32_t GetCurrentNumaNode();
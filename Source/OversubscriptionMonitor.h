@@ -0,0 +1,385 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+#if defined(__linux__)
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+#endif
+
+
+// Watches for other processes taking CPU time away from the workers. Each worker periodically samples its own
+// involuntary context switches and the time it spent runnable but waiting for a CPU (its run delay); when a
+// sizable fraction of the time the workers want to run goes to waiting, there are more runnable threads than
+// CPUs, and parking a worker or two cuts down on convoys and preemption in critical sections. The counters
+// only exist on Linux. On Windows, only the time the workers ran is measured, from their cycle counters (the run
+// delay and switches stay zero, so all the workers stay active); elsewhere nothing is sampled
+class COversubscriptionMonitor
+{
+
+protected:
+
+	// the latest totals for one worker, written only by that worker
+	struct alignas(64) SWorkerCounters
+	{
+		SWorkerCounters()
+		{
+			m_InvoluntarySwitches = 0;
+			m_RunNS = 0;
+			m_DelayNS = 0;
+			m_LastSampleNS = 0;
+			m_SchedStat = -1;
+		}
+
+		std::atomic<uint64_t> m_InvoluntarySwitches;
+		std::atomic<uint64_t> m_RunNS;
+		std::atomic<uint64_t> m_DelayNS;
+
+		uint64_t m_LastSampleNS;
+
+		// the worker's /proc/self/task/<tid>/schedstat, opened when it starts so that sampling is a single pread
+		int m_SchedStat;
+	};
+
+	std::vector<SWorkerCounters> m_Workers;
+
+	// the sums at the last evaluation; only touched while holding m_mutexUpdate
+	uint64_t m_LastSwitches;
+	uint64_t m_LastRunNS;
+	uint64_t m_LastDelayNS;
+	size_t m_QuietWindows;
+
+	std::atomic<uint64_t> m_LastEvaluateNS;
+
+	// what was measured over the last evaluation window
+	std::atomic<float> m_DelayRatio;
+	std::atomic<double> m_SwitchRate;
+
+	std::atomic<size_t> m_ActiveWorkers;
+	std::atomic<bool> m_Control;
+
+	// on Windows, the thread cycle counters tick at the TSC's rate, which is measured against the clock from here
+	uint64_t m_StartTSC;
+	uint64_t m_StartNS;
+
+	std::mutex m_mutexUpdate;
+
+	// how often a worker reads its counters, and how often they're evaluated
+	static const uint64_t SAMPLE_INTERVAL_NS = 10000000;
+	static const uint64_t EVALUATE_INTERVAL_NS = 100000000;
+
+	// park a worker when more than this fraction of the workers' runnable time is spent waiting for a CPU...
+	static constexpr float DELAY_HIGH = 0.1f;
+
+	// ...and bring one back after this many windows in a row below this
+	static constexpr float DELAY_LOW = 0.02f;
+	static const size_t QUIET_WINDOWS = 5;
+
+	static inline uint64_t GetTimeNS()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static inline uint64_t ReadTSC()
+	{
+#if defined(_WIN32) && (defined(_M_X64) || defined(_M_IX86))
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+	// Reads the calling worker's counters
+	bool ReadThreadCounters(const SWorkerCounters &w, uint64_t &switches, uint64_t &run_ns, uint64_t &delay_ns) const
+	{
+#if defined(__linux__)
+		if (w.m_SchedStat < 0)
+			return false;
+
+		struct rusage ru;
+		if (getrusage(RUSAGE_THREAD, &ru))
+			return false;
+
+		// schedstat holds the time spent on the CPU, the time spent waiting on a run queue (both in ns) and the number of timeslices
+		char buf[96];
+		ssize_t len = pread(w.m_SchedStat, buf, sizeof(buf) - 1, 0);
+		if (len <= 0)
+			return false;
+
+		buf[len] = '\0';
+
+		char *end;
+		unsigned long long run = strtoull(buf, &end, 10);
+		if (end == buf)
+			return false;
+
+		char *p = end;
+		unsigned long long delay = strtoull(p, &end, 10);
+		if (end == p)
+			return false;
+
+		switches = (uint64_t)ru.ru_nivcsw;
+		run_ns = (uint64_t)run;
+		delay_ns = (uint64_t)delay;
+
+		return true;
+#elif defined(_WIN32) && (defined(_M_X64) || defined(_M_IX86))
+		// Windows doesn't keep track of how long a thread waits for a CPU, or how often it's preempted
+		ULONG64 cycles;
+		if (!QueryThreadCycleTime(GetCurrentThread(), &cycles))
+			return false;
+
+		uint64_t tsc = ReadTSC() - m_StartTSC;
+		uint64_t ns = GetTimeNS() - m_StartNS;
+		if (!tsc || !ns)
+			return false;
+
+		switches = 0;
+		run_ns = (uint64_t)((double)cycles * (double)ns / (double)tsc);
+		delay_ns = 0;
+
+		return true;
+#else
+		return false;
+#endif
+	}
+
+public:
+
+	COversubscriptionMonitor()
+	{
+		m_LastSwitches = 0;
+		m_LastRunNS = 0;
+		m_LastDelayNS = 0;
+		m_QuietWindows = 0;
+
+		m_LastEvaluateNS = GetTimeNS();
+
+		m_DelayRatio = 0.0f;
+		m_SwitchRate = 0.0;
+
+		m_ActiveWorkers = 0;
+		m_Control = false;
+
+		m_StartTSC = ReadTSC();
+		m_StartNS = GetTimeNS();
+	}
+
+	~COversubscriptionMonitor()
+	{
+		for (size_t i = 0; i < m_Workers.size(); i++)
+			OnThreadExit(i);
+	}
+
+	// Returns true if the run delay can be measured, so that oversubscription can be detected
+	static bool IsSupported()
+	{
+#if defined(__linux__)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Call before any of the workers start
+	void SetNumThreads(size_t threads)
+	{
+		m_Workers = std::vector<SWorkerCounters>(threads);
+		m_ActiveWorkers = threads;
+	}
+
+	// Called by worker index, on its own thread, when it starts
+	void OnThreadStart(size_t index)
+	{
+		if (index >= m_Workers.size())
+			return;
+
+#if defined(__linux__)
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/self/task/%ld/schedstat", (long)syscall(SYS_gettid));
+
+		m_Workers[index].m_SchedStat = open(path, O_RDONLY | O_CLOEXEC);
+#endif
+	}
+
+	// Called by worker index when it's done
+	void OnThreadExit(size_t index)
+	{
+		if (index >= m_Workers.size())
+			return;
+
+#if defined(__linux__)
+		if (m_Workers[index].m_SchedStat >= 0)
+			close(m_Workers[index].m_SchedStat);
+#endif
+
+		m_Workers[index].m_SchedStat = -1;
+	}
+
+	// Workers with an index at or above this should stay parked
+	size_t GetActiveWorkers() const
+	{
+		return m_ActiveWorkers.load(std::memory_order_relaxed);
+	}
+
+	void EnableControl(bool enable)
+	{
+		std::lock_guard<std::mutex> l(m_mutexUpdate);
+
+		m_Control = enable;
+		m_QuietWindows = 0;
+
+		if (!enable)
+			m_ActiveWorkers = m_Workers.size();
+	}
+
+	// Called by worker index, on its own thread, between tasks; reads its counters if it's been long enough
+	void Sample(size_t index)
+	{
+		if (index >= m_Workers.size())
+			return;
+
+		SWorkerCounters &w = m_Workers[index];
+
+		uint64_t now = GetTimeNS();
+		if ((now - w.m_LastSampleNS) < SAMPLE_INTERVAL_NS)
+			return;
+
+		w.m_LastSampleNS = now;
+
+		uint64_t switches, run, delay;
+		if (!ReadThreadCounters(w, switches, run, delay))
+			return;
+
+		w.m_InvoluntarySwitches.store(switches, std::memory_order_relaxed);
+		w.m_RunNS.store(run, std::memory_order_relaxed);
+		w.m_DelayNS.store(delay, std::memory_order_relaxed);
+	}
+
+	// Folds the workers' counters into the window's measurements, if it's been long enough, and adjusts the number
+	// of active workers if control is enabled
+	void Evaluate()
+	{
+		uint64_t now = GetTimeNS();
+		if ((now - m_LastEvaluateNS.load(std::memory_order_relaxed)) < EVALUATE_INTERVAL_NS)
+			return;
+
+		std::unique_lock<std::mutex> l(m_mutexUpdate, std::try_to_lock);
+		if (!l.owns_lock())
+			return;
+
+		uint64_t last = m_LastEvaluateNS.load(std::memory_order_relaxed);
+		if ((now - last) < EVALUATE_INTERVAL_NS)
+			return;
+
+		m_LastEvaluateNS.store(now, std::memory_order_relaxed);
+
+		uint64_t switches = 0, run = 0, delay = 0;
+		for (const auto &w : m_Workers)
+		{
+			switches += w.m_InvoluntarySwitches.load(std::memory_order_relaxed);
+			run += w.m_RunNS.load(std::memory_order_relaxed);
+			delay += w.m_DelayNS.load(std::memory_order_relaxed);
+		}
+
+		uint64_t drun = run - m_LastRunNS;
+		uint64_t ddelay = delay - m_LastDelayNS;
+
+		float ratio = (drun + ddelay) ? ((float)ddelay / (float)(drun + ddelay)) : 0.0f;
+
+		m_DelayRatio.store(ratio, std::memory_order_relaxed);
+		m_SwitchRate.store((double)(switches - m_LastSwitches) * 1e9 / (double)(now - last), std::memory_order_relaxed);
+
+		m_LastSwitches = switches;
+		m_LastRunNS = run;
+		m_LastDelayNS = delay;
+
+		if (!m_Control.load())
+			return;
+
+		// shrink right away, but grow back slowly, so that a brief lull doesn't let the convoys back in
+		size_t active = m_ActiveWorkers.load();
+
+		if (ratio > DELAY_HIGH)
+		{
+			m_QuietWindows = 0;
+
+			if (active > 1)
+				m_ActiveWorkers = active - 1;
+		}
+		else if ((ratio < DELAY_LOW) && (++m_QuietWindows >= QUIET_WINDOWS))
+		{
+			m_QuietWindows = 0;
+
+			if (active < m_Workers.size())
+				m_ActiveWorkers = active + 1;
+		}
+	}
+
+	// Sums up the totals of worker index, or of all of them if index is out of range
+	void GetTotals(size_t index, uint64_t &switches, uint64_t &run_ns, uint64_t &delay_ns) const
+	{
+		switches = run_ns = delay_ns = 0;
+
+		for (size_t i = 0; i < m_Workers.size(); i++)
+		{
+			if ((index < m_Workers.size()) && (i != index))
+				continue;
+
+			switches += m_Workers[i].m_InvoluntarySwitches.load(std::memory_order_relaxed);
+			run_ns += m_Workers[i].m_RunNS.load(std::memory_order_relaxed);
+			delay_ns += m_Workers[i].m_DelayNS.load(std::memory_order_relaxed);
+		}
+	}
+
+	float GetDelayRatio() const
+	{
+		return m_DelayRatio.load(std::memory_order_relaxed);
+	}
+
+	double GetSwitchRate() const
+	{
+		return m_SwitchRate.load(std::memory_order_relaxed);
+	}
+};
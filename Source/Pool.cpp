@@ -46,286 +46,3700 @@
 #include <malloc.h>
 #include <memory.h>
 #include <queue>
+#include <deque>
 #include <vector>
 #include <algorithm>
+#include <map>
+#include <unordered_map>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 #include <Pool.h>
 
+#include "GrainTuner.h"
+#include "MemoryOps.h"
+#include "LoadMonitor.h"
+#include "MPSCQueue.h"
+#include "CompletionPort.h"
+#include "PressureMonitor.h"
+#include "DependencyTracker.h"
+#include "FaultInjector.h"
+#include "LatencyHistogram.h"
+#include "QueueStrategy.h"
+#include "OversubscriptionMonitor.h"
+#include "CoDel.h"
+
 using namespace pool;
 
-class CThreadPool : public IThreadPool
-{
+class CThreadPool;
+
+// Counts the priority boosts lent to a set of tasks, at each priority; the effective boost is the highest
+// priority that anybody is still boosting at, so boosts can be withdrawn in any order
+class CPriorityBoost
+{
+
+protected:
+
+	std::atomic<uint32_t> m_Count[IThreadPool::TP_NUMPRIORITIES];
+
+public:
+
+	CPriorityBoost()
+	{
+		for (auto &c : m_Count)
+			c = 0;
+	}
+
+	IThreadPool::TASK_PRIORITY Get() const
+	{
+		for (int p = IThreadPool::TP_NUMPRIORITIES - 1; p > IThreadPool::TP_LOW; p--)
+		{
+			if (m_Count[p].load())
+				return (IThreadPool::TASK_PRIORITY)p;
+		}
+
+		return IThreadPool::TP_LOW;
+	}
+
+	// Returns true if the effective boost went up
+	bool Raise(IThreadPool::TASK_PRIORITY priority)
+	{
+		bool up = (priority > Get());
+		m_Count[priority].fetch_add(1);
+		return up;
+	}
+
+	// Returns true if the effective boost went down
+	bool Lower(IThreadPool::TASK_PRIORITY priority)
+	{
+		m_Count[priority].fetch_sub(1);
+		return (priority > Get());
+	}
+};
+
+class CTaskGroup : public ITaskGroup
+{
+
+protected:
+
+	std::atomic<LONG> m_RefCount;
+
+	// the number of tasks in the group that are queued or running
+	std::atomic<size_t> m_Pending;
+
+	std::mutex m_mutexWait;
+	std::condition_variable m_cvWait;
+
+	// the pool that runs this group's tasks, so that waiting threads can help
+	CThreadPool *m_pPool;
+
+	// raised by waiters, so that the group's tasks run at least at their priority
+	CPriorityBoost m_Boost;
+
+	// the lowest priority any of the group's tasks was submitted at; waiters that aren't above it don't boost
+	std::atomic<int> m_LowestPriority;
+
+	// when the group's tasks ran, for GetMakespan
+	std::atomic<uint64_t> m_FirstStartNS;
+	std::atomic<uint64_t> m_LastEndNS;
+	std::atomic<uint64_t> m_WorkNS;
+	std::atomic<uint64_t> m_LongestNS;
+
+public:
+
+	CTaskGroup(CThreadPool *ppool)
+	{
+		m_RefCount = 1;
+		m_Pending = 0;
+		m_pPool = ppool;
+		m_LowestPriority = IThreadPool::TP_NUMPRIORITIES;
+
+		m_FirstStartNS = UINT64_MAX;
+		m_LastEndNS = 0;
+		m_WorkNS = 0;
+		m_LongestNS = 0;
+	}
+
+	virtual ~CTaskGroup()
+	{
+	}
+
+	// tasks hold a reference to their groups until they complete
+	void OnTaskAdded(size_t count, IThreadPool::TASK_PRIORITY priority)
+	{
+		int p = m_LowestPriority.load();
+		while ((priority < p) && !m_LowestPriority.compare_exchange_weak(p, priority)) { }
+
+		m_Pending.fetch_add(count);
+		m_RefCount.fetch_add((LONG)count);
+	}
+
+	void OnTaskDone()
+	{
+		if (m_Pending.fetch_sub(1) == 1)
+		{
+			std::lock_guard<std::mutex> l(m_mutexWait);
+			m_cvWait.notify_all();
+		}
+
+		Release();
+	}
+
+	LONG GetRefCount()
+	{
+		return m_RefCount.load();
+	}
+
+	// Called each time one of the group's tasks has run
+	void OnTaskRun(uint64_t start_ns, uint64_t end_ns)
+	{
+		uint64_t t = m_FirstStartNS.load();
+		while ((start_ns < t) && !m_FirstStartNS.compare_exchange_weak(t, start_ns)) { }
+
+		t = m_LastEndNS.load();
+		while ((end_ns > t) && !m_LastEndNS.compare_exchange_weak(t, end_ns)) { }
+
+		uint64_t d = end_ns - start_ns;
+		m_WorkNS.fetch_add(d);
+
+		t = m_LongestNS.load();
+		while ((d > t) && !m_LongestNS.compare_exchange_weak(t, d)) { }
+	}
+
+	virtual void GetMakespan(MAKESPAN_INFO &info);
+
+	const CPriorityBoost &GetBoost() const
+	{
+		return m_Boost;
+	}
+
+	virtual bool Wait(uint32_t milliseconds);
+
+	virtual bool IsComplete()
+	{
+		return (m_Pending.load() == 0);
+	}
+
+	virtual size_t GetPendingCount()
+	{
+		return m_Pending.load();
+	}
+
+	virtual void AddRef()
+	{
+		m_RefCount.fetch_add(1);
+	}
+
+	virtual void Release()
+	{
+		if (m_RefCount.fetch_sub(1) == 1)
+			delete this;
+	}
+};
+
+class CTaskScope : public ITaskScope
+{
+
+protected:
+
+	std::atomic<LONG> m_RefCount;
+
+	// counts the scope's tasks and the tasks of every scope nested in it
+	CTaskGroup *m_pGroup;
+
+	// cancellation is checked by walking up the tree, so cancelling a scope is a single store
+	CTaskScope *m_pParent;
+	std::atomic<bool> m_Cancelled;
+
+	CThreadPool *m_pPool;
+
+public:
+
+	CTaskScope(CThreadPool *ppool, CTaskScope *parent)
+	{
+		m_RefCount = 1;
+		m_pGroup = new CTaskGroup(ppool);
+		m_pParent = parent;
+		m_Cancelled = false;
+		m_pPool = ppool;
+
+		if (m_pParent)
+			m_pParent->AddRef();
+	}
+
+	virtual ~CTaskScope()
+	{
+		m_pGroup->Release();
+
+		if (m_pParent)
+			m_pParent->Release();
+	}
+
+	CThreadPool *GetPool() const
+	{
+		return m_pPool;
+	}
+
+	// tasks hold a reference to their scope, and are counted by it and every scope it's nested in, until they complete
+	void OnTaskAdded(size_t count, IThreadPool::TASK_PRIORITY priority)
+	{
+		for (CTaskScope *s = this; s; s = s->m_pParent)
+			s->m_pGroup->OnTaskAdded(count, priority);
+
+		m_RefCount.fetch_add((LONG)count);
+	}
+
+	void OnTaskDone()
+	{
+		for (CTaskScope *s = this; s; s = s->m_pParent)
+			s->m_pGroup->OnTaskDone();
+
+		Release();
+	}
+
+	// Returns p, raised by any boosts lent to the scope or the scopes it's nested in by their waiters
+	IThreadPool::TASK_PRIORITY GetBoostedPriority(IThreadPool::TASK_PRIORITY p) const
+	{
+		for (const CTaskScope *s = this; s; s = s->m_pParent)
+			p = std::max(p, s->m_pGroup->GetBoost().Get());
+
+		return p;
+	}
+
+	// Returns true if group counts the scope's tasks, i.e. it belongs to the scope or one it's nested in
+	bool IsCountedBy(const CTaskGroup *group) const
+	{
+		for (const CTaskScope *s = this; s; s = s->m_pParent)
+		{
+			if (s->m_pGroup == group)
+				return true;
+		}
+
+		return false;
+	}
+
+	virtual bool Spawn(IThreadPool::TASK_CALLBACK func, void *param0, void *param1, size_t numtimes);
+
+	virtual void Cancel()
+	{
+		m_Cancelled.store(true, std::memory_order_relaxed);
+	}
+
+	virtual bool IsCancelled()
+	{
+		for (const CTaskScope *s = this; s; s = s->m_pParent)
+		{
+			if (s->m_Cancelled.load(std::memory_order_relaxed))
+				return true;
+		}
+
+		return false;
+	}
+
+	virtual bool Wait(uint32_t milliseconds)
+	{
+		return m_pGroup->Wait(milliseconds);
+	}
+
+	virtual size_t GetPendingCount()
+	{
+		return m_pGroup->GetPendingCount();
+	}
+
+	virtual void Leave()
+	{
+		Wait(INFINITE);
+		Release();
+	}
+
+	virtual void AddRef()
+	{
+		m_RefCount.fetch_add(1);
+	}
+
+	virtual void Release()
+	{
+		if (m_RefCount.fetch_sub(1) == 1)
+			delete this;
+	}
+};
+
+class CThreadPool : public IThreadPool
+{
+
+	friend class CTaskGroup;
+
+protected:
+
+	struct SDependentTask;
+
+	// The prefetch hints from a RunTaskEx call
+	struct SPrefetchHints
+	{
+		size_t m_Count;
+		PREFETCH_HINT m_Hint[MAX_PREFETCH_HINTS];
+	};
+
+	// ...shared by all of the call's tasks and freed when the last of them is done
+	struct SSharedPrefetchHints : public SPrefetchHints
+	{
+		std::atomic<size_t> m_Refs;
+	};
+
+	// only the start of a long range is prefetched, so one task can't flush the whole cache for the next
+	static constexpr size_t MAX_PREFETCH_BYTES = 64 << 10;
+
+	__declspec(align(32)) struct STaskInfo
+	{
+		STaskInfo(TASK_CALLBACK task, void *param0, void *param1, size_t task_number, volatile LONG *pactionref) :
+			m_pActionRef(pactionref), m_Task(task)
+		{
+			m_Param[0] = param0;
+			m_Param[1] = param1;
+			m_TaskNumber = task_number;
+
+			m_Epoch = 0;
+			m_pGroup = nullptr;
+			m_pEpochGroup = nullptr;
+			m_pDependentTask = nullptr;
+
+			m_Priority = TP_NORMAL;
+			m_QueuedPriority = TP_NORMAL;
+
+			m_QueuedNS = 0;
+
+			m_pPrefetch = nullptr;
+
+			m_TargetWorker = NO_TARGET_WORKER;
+
+			m_pCompletionPort = nullptr;
+
+			m_pScope = nullptr;
+
+			m_PressureSensitive = false;
+
+			m_pCleanup = nullptr;
+
+			if (m_pActionRef)
+			{
+				InterlockedIncrement(m_pActionRef);
+			}
+		}
+
+		// This is the number of active tasks, used for blocking
+		volatile LONG *m_pActionRef;
+
+		// The function that the thread should be running
+		TASK_CALLBACK m_Task;
+
+		// The parameter given to the thread function
+		void *m_Param[2];
+		size_t m_TaskNumber;
+
+		// The epoch the task was tagged with, or 0
+		uint64_t m_Epoch;
+
+		// The user's group and the epoch's group, notified when the task completes
+		CTaskGroup *m_pGroup;
+		CTaskGroup *m_pEpochGroup;
+
+		// For tasks submitted with read / write sets, the dependency node that was holding them back
+		SDependentTask *m_pDependentTask;
+
+		// The priority the task was submitted at, and the priority of the queue it's currently in
+		TASK_PRIORITY m_Priority;
+		TASK_PRIORITY m_QueuedPriority;
+
+		// When the task was queued, if latency is being tracked
+		uint64_t m_QueuedNS;
+
+		// The memory the task is going to read, if that was given
+		SSharedPrefetchHints *m_pPrefetch;
+
+		// The only worker that may run the task, or NO_TARGET_WORKER
+		size_t m_TargetWorker;
+
+		// Where the task posts its completion
+		CCompletionPort *m_pCompletionPort;
+
+		// The scope the task belongs to
+		CTaskScope *m_pScope;
+
+		// Whether the task is held back while the host is under pressure
+		bool m_PressureSensitive;
+
+		// For the pool's own helper tasks, called with the second parameter once the task is done, whether it ran or not
+		void (*m_pCleanup)(void *param1);
+	};
+
+	static const size_t NO_TARGET_WORKER = (size_t)-1;
+
+	// Lets the task's groups know when it ran
+	static void RecordTaskRun(const STaskInfo &task, uint64_t start_ns, uint64_t end_ns)
+	{
+		if (task.m_pGroup)
+			task.m_pGroup->OnTaskRun(start_ns, end_ns);
+
+		if (task.m_pEpochGroup)
+			task.m_pEpochGroup->OnTaskRun(start_ns, end_ns);
+	}
+
+	// Returns the task's priority, raised by any boosts lent to its groups or its dependency node
+	static TASK_PRIORITY GetTaskPriority(const STaskInfo &task)
+	{
+		TASK_PRIORITY p = task.m_Priority;
+
+		if (task.m_pGroup)
+			p = std::max(p, task.m_pGroup->GetBoost().Get());
+
+		if (task.m_pEpochGroup)
+			p = std::max(p, task.m_pEpochGroup->GetBoost().Get());
+
+		if (task.m_pScope)
+			p = task.m_pScope->GetBoostedPriority(p);
+
+		if (task.m_pDependentTask)
+			p = std::max(p, task.m_pDependentTask->m_Boost.Get());
+
+		return p;
+	}
+
+	// Returns true if group's boost counts toward the task's priority (any group, if it's null)
+	static bool IsBoostedBy(const STaskInfo &task, const CTaskGroup *group)
+	{
+		if (!group)
+			return true;
+
+		return (task.m_pGroup == group) || (task.m_pEpochGroup == group) || (task.m_pScope && task.m_pScope->IsCountedBy(group));
+	}
+
+	// Signals everyone waiting on a task that it's done (or will never run)
+	static void FinishTask(STaskInfo &task)
+	{
+		// the port is posted to before anything else is signalled, so whoever sees the task's group, epoch or scope
+		// complete can count on finding its completion on the port
+		if (task.m_pCompletionPort)
+			task.m_pCompletionPort->OnTaskDone(task.m_Param[0], task.m_Param[1], task.m_TaskNumber);
+
+		if (task.m_pActionRef)
+			InterlockedDecrement(task.m_pActionRef);
+
+		if (task.m_pGroup)
+			task.m_pGroup->OnTaskDone();
+
+		if (task.m_pEpochGroup)
+			task.m_pEpochGroup->OnTaskDone();
+
+		if (task.m_pDependentTask)
+			task.m_pDependentTask->OnTaskDone();
+
+		if (task.m_pPrefetch && (task.m_pPrefetch->m_Refs.fetch_sub(1) == 1))
+			delete task.m_pPrefetch;
+
+		if (task.m_pScope)
+			task.m_pScope->OnTaskDone();
+
+		if (task.m_pCleanup)
+			task.m_pCleanup(task.m_Param[1]);
+	}
+
+	typedef std::deque<STaskInfo> TTaskQueue;
+
+	// untagged tasks at each priority (and tagged tasks, when not at normal priority)
+	TTaskQueue m_TaskQueue[TP_NUMPRIORITIES];
+
+	std::mutex m_mutexTaskList;
+
+	// how each priority's queue hands out its tasks; guarded by m_mutexTaskList
+	struct SQueuePolicyState
+	{
+		QUEUE_POLICY m_Policy;
+
+		// whether the newest task is taken first right now
+		bool m_Lifo;
+
+		// when the queue went over the threshold, or 0 if it's at or under it
+		uint64_t m_AboveSinceNS;
+
+		uint64_t m_Switches;
+		uint64_t m_LifoTasks;
+	};
+
+	SQueuePolicyState m_QueuePolicy[TP_NUMPRIORITIES];
+
+	// Returns true if priority p's queue should hand out its newest task next, switching as its policy dictates;
+	// call with m_mutexTaskList held
+	bool UpdateQueueOrderLocked(TASK_PRIORITY p)
+	{
+		SQueuePolicyState &qp = m_QueuePolicy[p];
+
+		bool lifo = (qp.m_Policy.order == QO_LIFO);
+
+		if (qp.m_Policy.order == QO_ADAPTIVE)
+		{
+			lifo = qp.m_Lifo;
+
+			if (m_TaskQueue[p].size() > qp.m_Policy.threshold)
+			{
+				uint64_t now = GetTimeNS();
+
+				if (!qp.m_AboveSinceNS)
+					qp.m_AboveSinceNS = now;
+				else if ((now - qp.m_AboveSinceNS) >= ((uint64_t)qp.m_Policy.delay_ms * 1000000))
+					lifo = true;
+			}
+			else
+			{
+				qp.m_AboveSinceNS = 0;
+				lifo = false;
+			}
+		}
+
+		if (lifo != qp.m_Lifo)
+		{
+			qp.m_Lifo = lifo;
+			qp.m_Switches++;
+		}
+
+		return lifo;
+	}
+
+	// the number of tasks queued at each priority, so ShouldYield can check without taking the lock
+	std::atomic<size_t> m_NumQueued[TP_NUMPRIORITIES];
+
+	// the number of times a boost promoted queued tasks, ie. resolved a priority inversion
+	std::atomic<uint64_t> m_NumInversions;
+
+	// set when a continuation boosted its predecessors and the queues need to be rebalanced
+	std::atomic<bool> m_RebalancePending;
+
+	// While dispatch is distributed, untagged tasks at normal priority go to per-worker queues instead of
+	// m_TaskQueue. A worker's own queue comes first, and when it's empty, it steals from the others
+	struct alignas(64) SWorkerQueue
+	{
+		SWorkerQueue()
+		{
+			m_Count = 0;
+		}
+
+		TTaskQueue m_Queue;
+
+		// the size of m_Queue, so that empty queues can be skipped without locking them
+		std::atomic<size_t> m_Count;
+
+		std::mutex m_Lock;
+	};
+
+	std::vector<SWorkerQueue> m_WorkerQueues;
+
+	// the number of tasks waiting in the per-worker queues
+	std::atomic<size_t> m_NumLocal;
+
+	// whether dispatch is distributed right now; only changed with m_mutexTaskList held
+	std::atomic<bool> m_Distributed;
+
+	std::atomic<QUEUE_STRATEGY> m_QueueStrategy;
+
+	// where tasks submitted from outside the pool start being spread across the per-worker queues
+	std::atomic<size_t> m_NextWorkerQueue;
+
+	CQueueStrategyMonitor m_QueueMonitor;
+
+	// Locks m_mutexTaskList, letting the queue strategy monitor know if somebody else had it
+	std::unique_lock<std::mutex> LockTaskList()
+	{
+		std::unique_lock<std::mutex> l(m_mutexTaskList, std::try_to_lock);
+
+		bool contended = !l.owns_lock();
+		if (contended)
+			l.lock();
+
+		m_QueueMonitor.OnLock(contended);
+
+		return l;
+	}
+
+	// Tasks tagged with an epoch wait in per-epoch queues, and the oldest epoch's tasks are always handed
+	// out first. An epoch stays in the map while it has tasks or someone holds its group
+	struct SEpochInfo
+	{
+		TTaskQueue m_Queue;
+		CTaskGroup *m_pGroup;
+	};
+
+	typedef std::map<uint64_t, SEpochInfo> TEpochMap;
+
+	TEpochMap m_Epochs;
+
+	// how many epochs past the oldest incomplete one may be submitted to before submission blocks; 0 for no limit
+	std::atomic<size_t> m_PipelineDepth;
+
+	// Returns the epoch's info, creating it if necessary; call with m_mutexTaskList held
+	SEpochInfo &GetEpochLocked(uint64_t epoch)
+	{
+		TEpochMap::iterator it = m_Epochs.find(epoch);
+		if (it == m_Epochs.end())
+		{
+			SEpochInfo &ei = m_Epochs[epoch];
+			ei.m_pGroup = new CTaskGroup(this);
+			return ei;
+		}
+
+		return it->second;
+	}
+
+	// Drops finished epochs that nobody is holding on to; call with m_mutexTaskList held
+	void PruneEpochsLocked()
+	{
+		TEpochMap::iterator it = m_Epochs.begin();
+		while (it != m_Epochs.end())
+		{
+			SEpochInfo &ei = it->second;
+			if (!ei.m_Queue.empty() || !ei.m_pGroup->IsComplete() || (ei.m_pGroup->GetRefCount() > 1))
+			{
+				it++;
+				continue;
+			}
+
+			ei.m_pGroup->Release();
+			it = m_Epochs.erase(it);
+		}
+	}
+
+	// Returns the (referenced) group of the oldest epoch that hasn't completed, if submitting to epoch has to
+	// wait for it because of the pipeline depth; call with m_mutexTaskList held
+	CTaskGroup *GetThrottlingEpochLocked(uint64_t epoch)
+	{
+		size_t depth = m_PipelineDepth.load();
+		if (!epoch || !depth)
+			return nullptr;
+
+		PruneEpochsLocked();
+
+		for (auto &it : m_Epochs)
+		{
+			if (it.second.m_pGroup->IsComplete())
+				continue;
+
+			if (epoch < it.first + depth)
+				return nullptr;
+
+			it.second.m_pGroup->AddRef();
+			return it.second.m_pGroup;
+		}
+
+		return nullptr;
+	}
+
+	// Puts a task in the right queue (at the front, if it's resuming after a yield); call with m_mutexTaskList held
+	// Tasks are served high priority first, then epochs (oldest first), then normal and finally low priority
+	void EnqueueLocked(const STaskInfo &task, bool front = false)
+	{
+		TASK_PRIORITY p = GetTaskPriority(task);
+
+		TTaskQueue &q = ((p == TP_NORMAL) && task.m_Epoch) ? GetEpochLocked(task.m_Epoch).m_Queue : m_TaskQueue[p];
+
+		// a queue that's handing out its newest tasks first serves the back next
+		if (front && (&q == &m_TaskQueue[p]) && m_QueuePolicy[p].m_Lifo)
+			front = false;
+
+		if (front)
+		{
+			q.push_front(task);
+			q.front().m_QueuedPriority = p;
+		}
+		else
+		{
+			q.push_back(task);
+			q.back().m_QueuedPriority = p;
+		}
+
+		m_NumQueued[p].fetch_add(1, std::memory_order_relaxed);
+
+		// an adaptive queue needs to know how long it's been backed up
+		SQueuePolicyState &qp = m_QueuePolicy[p];
+		if ((qp.m_Policy.order == QO_ADAPTIVE) && !qp.m_AboveSinceNS && (&q == &m_TaskQueue[p]) && (q.size() > qp.m_Policy.threshold))
+			qp.m_AboveSinceNS = GetTimeNS();
+	}
+
+	// Takes the task at the front of q; call with m_mutexTaskList held
+	STaskInfo &DequeueLocked(TTaskQueue &q, std::vector<STaskInfo> &dst)
+	{
+		dst.push_back(q.front());
+		q.pop_front();
+
+		m_NumQueued[dst.back().m_QueuedPriority].fetch_sub(1, std::memory_order_relaxed);
+
+		return dst.back();
+	}
+
+	// Moves every queued task into dst, in the order they would be served; call with m_mutexTaskList held
+	void TakeAllLocked(std::vector<STaskInfo> &dst)
+	{
+		auto take = [&](TTaskQueue &q)
+		{
+			while (!q.empty())
+				DequeueLocked(q, dst);
+		};
+
+		take(m_TaskQueue[TP_HIGH]);
+
+		for (auto &it : m_Epochs)
+			take(it.second.m_Queue);
+
+		take(m_TaskQueue[TP_NORMAL]);
+		take(m_TaskQueue[TP_LOW]);
+	}
+
+	// Moves every task waiting in the per-worker queues into dst, one queue after another; call with m_mutexTaskList held
+	void TakeWorkerQueuesLocked(std::vector<STaskInfo> &dst)
+	{
+		if (!m_NumLocal.load())
+			return;
+
+		for (auto &wq : m_WorkerQueues)
+		{
+			std::lock_guard<std::mutex> l(wq.m_Lock);
+
+			dst.insert(dst.end(), wq.m_Queue.begin(), wq.m_Queue.end());
+
+			m_NumLocal.fetch_sub(wq.m_Queue.size());
+			wq.m_Queue.clear();
+			wq.m_Count = 0;
+		}
+	}
+
+	// Switches dispatch between the shared queue and the per-worker queues; when switching back to the shared
+	// queue, whatever is waiting in the per-worker queues goes to the end of it
+	void SetDistributed(bool distributed)
+	{
+		if (!m_hThreads.size())
+			return;
+
+		size_t moved = 0;
+
+		{
+			std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+			if (m_Distributed.load() == distributed)
+				return;
+
+			// submitters check this with the per-worker queue's lock held, so once the queues have been emptied
+			// below, nothing more goes into them
+			m_Distributed.store(distributed);
+
+			std::vector<STaskInfo> tasks;
+			TakeWorkerQueuesLocked(tasks);
+
+			for (auto &t : tasks)
+				EnqueueLocked(t);
+
+			moved = tasks.size();
+		}
+
+		m_QueueMonitor.OnSwitched();
+
+		// a worker may have looked in the shared queue just before the tasks were moved there
+		if (moved && m_hSemaphores[TS_RUN])
+			ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)m_hThreads.size(), nullptr);
+	}
+
+	// Lets the queue strategy monitor re-evaluate, and in adaptive mode, switches dispatch if it says so
+	void UpdateQueueStrategy()
+	{
+		bool distributed = m_Distributed.load(std::memory_order_relaxed);
+
+		if (!m_QueueMonitor.Evaluate(distributed) || (m_QueueStrategy.load() != QS_ADAPTIVE))
+			return;
+
+		if (distributed != m_Distributed.load())
+			SetDistributed(distributed);
+	}
+
+	// Removes the tasks in q whose priority group has changed (through group's boost, or any boost if it's null),
+	// appending them to dst in order; the rest stay where they are. Returns how many were removed
+	size_t PullRebalancedLocked(TTaskQueue &q, const CTaskGroup *group, std::vector<STaskInfo> &dst)
+	{
+		size_t n = 0;
+
+		for (size_t i = 0; i < q.size(); i++)
+		{
+			if (IsBoostedBy(q[i], group) && (GetTaskPriority(q[i]) != q[i].m_QueuedPriority))
+			{
+				dst.push_back(q[i]);
+				continue;
+			}
+
+			if (n != i)
+				q[n] = q[i];
+			n++;
+		}
+
+		size_t removed = q.size() - n;
+		q.erase(q.begin() + n, q.end());
+
+		return removed;
+	}
+
+	// Moves queued tasks whose priority has been boosted (or had a boost withdrawn) by group, or by anyone if
+	// it's null, to the right queues; everything else is left in place
+	void RebalanceQueues(const CTaskGroup *group = nullptr)
+	{
+		// without threads, Flush orders each batch by priority when it picks it up
+		if (!m_hThreads.size())
+			return;
+
+		size_t promoted = 0, moved = 0;
+
+		{
+			std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+			std::vector<STaskInfo> tasks;
+
+			auto pull = [&](TTaskQueue &q)
+			{
+				size_t first = tasks.size();
+				PullRebalancedLocked(q, group, tasks);
+
+				for (size_t i = first; i < tasks.size(); i++)
+					m_NumQueued[tasks[i].m_QueuedPriority].fetch_sub(1, std::memory_order_relaxed);
+			};
+
+			// in the order they would be served, so tasks that end up in the same queue keep their order
+			pull(m_TaskQueue[TP_HIGH]);
+
+			for (auto &it : m_Epochs)
+				pull(it.second.m_Queue);
+
+			pull(m_TaskQueue[TP_NORMAL]);
+			pull(m_TaskQueue[TP_LOW]);
+
+			// the per-worker queues only hold normal priority tasks, so boosted ones move to the shared queue
+			if (m_NumLocal.load())
+			{
+				for (auto &wq : m_WorkerQueues)
+				{
+					if (!wq.m_Count.load())
+						continue;
+
+					std::lock_guard<std::mutex> lq(wq.m_Lock);
+
+					size_t removed = PullRebalancedLocked(wq.m_Queue, group, tasks);
+
+					m_NumLocal.fetch_sub(removed);
+					wq.m_Count = wq.m_Queue.size();
+					moved += removed;
+				}
+			}
+
+			for (auto &t : tasks)
+			{
+				if (GetTaskPriority(t) > t.m_QueuedPriority)
+					promoted++;
+
+				EnqueueLocked(t);
+			}
+		}
+
+		if (promoted)
+			m_NumInversions.fetch_add(1);
+
+		// a worker may have looked in the shared queue just before the tasks were moved there
+		if (moved && m_hSemaphores[TS_RUN])
+			ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)m_hThreads.size(), nullptr);
+	}
+
+	// Pools with no threads are fed by many producers and drained by Flush, so instead of m_TaskQueue they
+	// use a lock-free inbox where submitting costs one atomic exchange per RunTask call
+	struct STaskNode
+	{
+		STaskNode(const STaskInfo &info) : m_Info(info) { }
+
+		STaskInfo m_Info;
+
+		std::atomic<STaskNode *> m_pNext;
+	};
+
+	typedef TMPSCQueue<STaskNode> TTaskInbox;
+
+	TTaskInbox m_Inbox;
+
+	// Drains the inbox into dst in submission order, returning the number of tasks moved
+	size_t DrainInbox(std::vector<STaskInfo> *dst)
+	{
+		size_t count;
+		STaskNode *node = m_Inbox.Drain(count);
+
+		if (dst)
+			dst->reserve(dst->size() + count);
+
+		while (node)
+		{
+			STaskNode *next = node->m_pNext.load(std::memory_order_relaxed);
+
+			if (dst)
+				dst->push_back(node->m_Info);
+
+			delete node;
+			node = next;
+		}
+
+		return count;
+	}
+
+	// Returns a copy of proto with the given task number; blockwait is incremented, as for any new task
+	static STaskInfo MakeTask(const STaskInfo &proto, size_t task_number, volatile LONG *blockwait, uint64_t queued)
+	{
+		STaskInfo task(proto.m_Task, proto.m_Param[0], proto.m_Param[1], task_number, blockwait);
+		task.m_Epoch = proto.m_Epoch;
+		task.m_pGroup = proto.m_pGroup;
+		task.m_pEpochGroup = proto.m_pEpochGroup;
+		task.m_pDependentTask = proto.m_pDependentTask;
+		task.m_Priority = proto.m_Priority;
+		task.m_QueuedNS = queued;
+		task.m_pPrefetch = proto.m_pPrefetch;
+		task.m_pCompletionPort = proto.m_pCompletionPort;
+		task.m_pScope = proto.m_pScope;
+		task.m_PressureSensitive = proto.m_PressureSensitive;
+		task.m_pCleanup = proto.m_pCleanup;
+
+		return task;
+	}
+
+	// Puts count copies of proto, numbered from first, at the end of a per-worker queue; returns the number
+	// queued, which is 0 if dispatch has switched back to the shared queue
+	size_t PushToWorkerQueue(size_t index, const STaskInfo &proto, size_t first, size_t count, const size_t *order, uint64_t queued, volatile LONG *blockwait)
+	{
+		SWorkerQueue &wq = m_WorkerQueues[index];
+
+		std::lock_guard<std::mutex> l(wq.m_Lock);
+
+		if (!m_Distributed.load())
+			return 0;
+
+		for (size_t i = first, last = first + count; i < last; i++)
+		{
+			wq.m_Queue.push_back(MakeTask(proto, order ? order[i] : i, blockwait, queued));
+			wq.m_Queue.back().m_QueuedPriority = TP_NORMAL;
+		}
+
+		m_NumLocal.fetch_add(count);
+		wq.m_Count.fetch_add(count);
+
+		return count;
+	}
+
+	// Puts a task that's being re-queued back in the calling worker's queue (at the front, if it's resuming after
+	// a yield), returning false if it belongs in the shared queue
+	bool RequeueToWorkerQueue(STaskInfo &task, bool front)
+	{
+		if (!m_Distributed.load() || task.m_Epoch || (GetTaskPriority(task) != TP_NORMAL))
+			return false;
+
+		size_t index = GetCurrentThreadSlot();
+		if (index >= m_WorkerQueues.size())
+			index = m_NextWorkerQueue.fetch_add(1, std::memory_order_relaxed) % m_WorkerQueues.size();
+
+		SWorkerQueue &wq = m_WorkerQueues[index];
+
+		std::lock_guard<std::mutex> l(wq.m_Lock);
+
+		if (!m_Distributed.load())
+			return false;
+
+		task.m_QueuedPriority = TP_NORMAL;
+
+		if (front)
+			wq.m_Queue.push_front(task);
+		else
+			wq.m_Queue.push_back(task);
+
+		m_NumLocal.fetch_add(1);
+		wq.m_Count.fetch_add(1);
+
+		return true;
+	}
+
+	// Puts numtimes copies of proto in the queue (or the inbox, without threads) and wakes the workers
+	// If given, order lists the task numbers in the order they should be queued
+	void SubmitTasks(const STaskInfo &proto, size_t numtimes, volatile LONG *blockwait, const size_t *order = nullptr)
+	{
+		m_Faults.Inject(CFaultInjector::FP_ENQUEUE);
+
+		uint64_t queued = (m_Latency.IsEnabled() || m_CoDel.IsEnabled()) ? GetTimeNS() : 0;
+
+		if (!m_hThreads.size())
+		{
+			// link the tasks up and publish them all with one exchange
+			STaskNode *oldest = new STaskNode(proto);
+			oldest->m_Info.m_TaskNumber = order ? order[0] : 0;
+			oldest->m_Info.m_QueuedNS = queued;
+			STaskNode *newest = oldest;
+
+			for (size_t i = 1; i < numtimes; i++)
+			{
+				STaskNode *node = new STaskNode(proto);
+				node->m_Info.m_TaskNumber = order ? order[i] : i;
+				node->m_Info.m_QueuedNS = queued;
+				node->m_pNext.store(newest, std::memory_order_relaxed);
+				newest = node;
+			}
+
+			m_Inbox.PushChain(oldest, newest);
+			m_Load.OnQueued(numtimes);
+
+			return;
+		}
+
+		// counted first, so that a worker can't start one of them before it's known to be queued
+		m_Load.OnQueued(numtimes);
+
+		size_t first = 0;
+
+		// while dispatch is distributed, untagged normal priority tasks go to the submitting worker's own queue,
+		// or get spread evenly across all of them when submitted from outside the pool
+		if (m_Distributed.load() && !proto.m_Epoch && (GetTaskPriority(proto) == TP_NORMAL))
+		{
+			size_t count = m_WorkerQueues.size();
+			size_t slot = GetCurrentThreadSlot();
+
+			if (slot < count)
+			{
+				first = PushToWorkerQueue(slot, proto, 0, numtimes, order, queued, blockwait);
+			}
+			else
+			{
+				size_t per = (numtimes + count - 1) / count;
+				size_t start = m_NextWorkerQueue.fetch_add(1, std::memory_order_relaxed);
+
+				for (size_t i = 0; (i < count) && (first < numtimes); i++)
+				{
+					size_t n = std::min<size_t>(per, numtimes - first);
+					size_t pushed = PushToWorkerQueue((start + i) % count, proto, first, n, order, queued, blockwait);
+
+					first += pushed;
+					if (pushed < n)
+						break;
+				}
+			}
+		}
+
+		// everything else (or whatever's left, if dispatch just switched back) goes to the shared queue
+		if (first < numtimes)
+		{
+			std::unique_lock<std::mutex> l = LockTaskList();
+
+			for (size_t i = first; i < numtimes; i++)
+				EnqueueLocked(MakeTask(proto, order ? order[i] : i, blockwait, queued));
+		}
+
+		// tell the threads to run tasks
+		if (m_hSemaphores[TS_RUN])
+			ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)m_hThreads.size(), nullptr);
+	}
+
+	// A RunTaskEx call that declared read / write sets; all numtimes tasks are held back until the tasks they
+	// depend on have finished, then queued together, and the ones that depend on them are released once
+	// all of them have finished
+	struct SDependentTask : public CDependencyNode
+	{
+		SDependentTask(CThreadPool *pool, const STaskInfo &proto, size_t numtimes) : m_pPool(pool), m_Proto(proto)
+		{
+			m_Proto.m_pDependentTask = this;
+			m_NumTimes = numtimes;
+			m_Remaining = numtimes;
+		}
+
+		CThreadPool *m_pPool;
+
+		STaskInfo m_Proto;
+		size_t m_NumTimes;
+
+		// the order to queue the tasks in, if they were given costs
+		std::vector<size_t> m_Order;
+
+		// tasks not yet finished
+		std::atomic<size_t> m_Remaining;
+
+		// raised by higher priority tasks that depend on this one
+		CPriorityBoost m_Boost;
+
+		// continuations lend the tasks they depend on their priority, for as long as those have left to run
+		virtual void OnPredecessorAdded(CDependencyNode *pred)
+		{
+			SDependentTask *p = (SDependentTask *)pred;
+
+			if ((m_Proto.m_Priority > p->m_Proto.m_Priority) && p->m_Boost.Raise(m_Proto.m_Priority))
+				m_pPool->m_RebalancePending = true;
+		}
+
+		virtual void Launch()
+		{
+			// the reference the node was created with is now held by the tasks, until the last one finishes
+			m_pPool->SubmitTasks(m_Proto, m_NumTimes, nullptr, m_Order.empty() ? nullptr : m_Order.data());
+			m_pPool->m_NumDeferred.fetch_sub(m_NumTimes);
+		}
+
+		void OnTaskDone()
+		{
+			if (m_Remaining.fetch_sub(1) != 1)
+				return;
+
+			m_pPool->m_Dependencies.Retire(this);
+			Release();
+		}
+	};
+
+	CDependencyTracker m_Dependencies;
+
+	// the number of tasks still waiting on their dependencies, which aren't in any queue yet
+	std::atomic<size_t> m_NumDeferred;
+
+	// Flush moves everything in the queue into a batch that any number of flushing threads can then claim
+	// tasks from with a single atomic increment, so they don't contend on the queue lock while draining
+	struct SDrainBatch
+	{
+		std::vector<STaskInfo> m_Tasks;
+
+		// the next task that hasn't been claimed
+		std::atomic<size_t> m_Next;
+
+		// the number of tasks that have finished (or were purged)
+		std::atomic<size_t> m_Done;
+
+		std::atomic<LONG> m_RefCount;
+
+		// a reference to the prefetch hints of the batch's tasks, so that a flushing thread can read the hints of
+		// the task after its own even if somebody else has already claimed and finished that one
+		std::vector<SSharedPrefetchHints *> m_Hints;
+
+		~SDrainBatch()
+		{
+			for (auto h : m_Hints)
+			{
+				if (h->m_Refs.fetch_sub(1) == 1)
+					delete h;
+			}
+		}
+
+		void AddRef()
+		{
+			m_RefCount.fetch_add(1);
+		}
+
+		void Release()
+		{
+			if (m_RefCount.fetch_sub(1) == 1)
+				delete this;
+		}
+	};
+
+	// the batch currently being drained; the pool holds a reference to it. Guarded by m_mutexTaskList
+	SDrainBatch *m_pDrainBatch;
+
+	// Returns a referenced batch that still has unclaimed tasks, starting a new one from the queue if needed,
+	// or nullptr if there is nothing left to flush
+	SDrainBatch *AcquireDrainBatch()
+	{
+		std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+		if (!m_pDrainBatch || (m_pDrainBatch->m_Next.load() >= m_pDrainBatch->m_Tasks.size()))
+		{
+			SDrainBatch *batch = new SDrainBatch;
+			TakeAllLocked(batch->m_Tasks);
+
+			// the whole backlog comes out of the inbox in one exchange
+			DrainInbox(&batch->m_Tasks);
+
+			// boosts can change while sorting, so settle on each task's priority first
+			for (auto &t : batch->m_Tasks)
+				t.m_QueuedPriority = GetTaskPriority(t);
+
+			// highest priority first, then oldest epoch first, untagged tasks last, otherwise in submission order
+			std::stable_sort(batch->m_Tasks.begin(), batch->m_Tasks.end(), [](const STaskInfo &a, const STaskInfo &b)
+			{
+				if (a.m_QueuedPriority != b.m_QueuedPriority)
+					return (a.m_QueuedPriority > b.m_QueuedPriority);
+
+				return (a.m_Epoch ? a.m_Epoch : UINT64_MAX) < (b.m_Epoch ? b.m_Epoch : UINT64_MAX);
+			});
+
+			if (batch->m_Tasks.empty())
+			{
+				delete batch;
+				return nullptr;
+			}
+
+			for (auto &t : batch->m_Tasks)
+			{
+				if (t.m_pPrefetch && (batch->m_Hints.empty() || (batch->m_Hints.back() != t.m_pPrefetch)))
+				{
+					t.m_pPrefetch->m_Refs.fetch_add(1);
+					batch->m_Hints.push_back(t.m_pPrefetch);
+				}
+			}
+
+			batch->m_Next = 0;
+			batch->m_Done = 0;
+			batch->m_RefCount = 1;
+
+			if (m_pDrainBatch)
+				m_pDrainBatch->Release();
+
+			m_pDrainBatch = batch;
+		}
+
+		m_pDrainBatch->AddRef();
+
+		return m_pDrainBatch;
+	}
+
+	struct SBatchHandler
+	{
+		BATCH_CALLBACK m_Handler;
+		size_t m_MaxBatch;
+	};
+
+	typedef std::unordered_map<TASK_CALLBACK, SBatchHandler> TBatchHandlerMap;
+
+	TBatchHandlerMap m_BatchHandlers;
+
+	std::mutex m_mutexBatchHandlers;
+
+	// so that looking for a handler costs nothing when none are registered
+	std::atomic<size_t> m_NumBatchHandlers;
+
+	bool GetBatchHandler(TASK_CALLBACK func, SBatchHandler &bh)
+	{
+		if (!m_NumBatchHandlers.load(std::memory_order_relaxed))
+			return false;
+
+		std::lock_guard<std::mutex> l(m_mutexBatchHandlers);
+
+		TBatchHandlerMap::const_iterator it = m_BatchHandlers.find(func);
+		if (it == m_BatchHandlers.end())
+			return false;
+
+		bh = it->second;
+		return true;
+	}
+
+	// Takes the task at the front of q (or the back, if back is set)... and if its callback has a batch handler, the
+	// tasks with the same callback that are right behind it, too (in which case handler is set). If next is given,
+	// it gets the prefetch hints of the task that's up next; call with q's lock held
+	void TakeFromQueueLocked(TTaskQueue &q, std::vector<STaskInfo> &tasks, BATCH_CALLBACK &handler, SPrefetchHints *next, bool back = false)
+	{
+		auto take = [&]()
+		{
+			if (back)
+			{
+				tasks.push_back(q.back());
+				q.pop_back();
+			}
+			else
+			{
+				tasks.push_back(q.front());
+				q.pop_front();
+			}
+		};
+
+		auto peek = [&]() -> const STaskInfo &
+		{
+			return back ? q.back() : q.front();
+		};
+
+		take();
+
+		SBatchHandler bh;
+		if (GetBatchHandler(tasks.front().m_Task, bh))
+		{
+			handler = bh.m_Handler;
+
+			while (!q.empty() && (tasks.size() < bh.m_MaxBatch) && (peek().m_Task == tasks.front().m_Task))
+				take();
+		}
+
+		// the hints are copied while the lock keeps their task from finishing
+		if (next && !q.empty() && peek().m_pPrefetch)
+			*next = *peek().m_pPrefetch;
+	}
+
+	// Takes the next tasks from the per-worker queues: the calling worker's own first, then the others'
+	bool TakeFromWorkerQueues(std::vector<STaskInfo> &tasks, BATCH_CALLBACK &handler, SPrefetchHints *next)
+	{
+		size_t count = m_WorkerQueues.size();
+		size_t slot = GetCurrentThreadSlot();
+		size_t start = (slot < count) ? slot : 0;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t index = (start + i) % count;
+
+			SWorkerQueue &wq = m_WorkerQueues[index];
+			if (!wq.m_Count.load(std::memory_order_relaxed))
+				continue;
+
+			std::lock_guard<std::mutex> l(wq.m_Lock);
+
+			if (wq.m_Queue.empty())
+				continue;
+
+			TakeFromQueueLocked(wq.m_Queue, tasks, handler, next);
+
+			m_NumLocal.fetch_sub(tasks.size());
+			wq.m_Count.fetch_sub(tasks.size());
+
+			m_QueueMonitor.OnTake(index != slot);
+
+			return true;
+		}
+
+		return false;
+	}
+
+	// Takes the next tasks from the shared queue, skipping low priority tasks unless low is set
+	bool TakeFromSharedQueue(std::vector<STaskInfo> &tasks, BATCH_CALLBACK &handler, SPrefetchHints *next, bool low)
+	{
+		// don't bother with the lock if there's obviously nothing to take
+		if (!m_NumQueued[TP_HIGH].load(std::memory_order_relaxed) && !m_NumQueued[TP_NORMAL].load(std::memory_order_relaxed) &&
+			(!low || !m_NumQueued[TP_LOW].load(std::memory_order_relaxed)))
+			return false;
+
+		// lock the queue
+		std::unique_lock<std::mutex> l = LockTaskList();
+
+		TTaskQueue *q = nullptr;
+
+		if (!m_TaskQueue[TP_HIGH].empty())
+		{
+			q = &m_TaskQueue[TP_HIGH];
+		}
+		else
+		{
+			// the oldest epoch with work goes next
+			for (auto &it : m_Epochs)
+			{
+				if (!it.second.m_Queue.empty())
+				{
+					q = &it.second.m_Queue;
+					break;
+				}
+			}
+		}
+
+		if (!q)
+		{
+			if (!m_TaskQueue[TP_NORMAL].empty())
+				q = &m_TaskQueue[TP_NORMAL];
+			else if (low && !m_TaskQueue[TP_LOW].empty())
+				q = &m_TaskQueue[TP_LOW];
+			else
+				return false;
+		}
+
+		// epochs are always FIFO, the priority queues go by their policy
+		bool back = false;
+		for (int p = TP_LOW; p < TP_NUMPRIORITIES; p++)
+		{
+			if (q == &m_TaskQueue[p])
+				back = UpdateQueueOrderLocked((TASK_PRIORITY)p);
+		}
+
+		TakeFromQueueLocked(*q, tasks, handler, next, back);
+
+		for (const auto &t : tasks)
+		{
+			m_NumQueued[t.m_QueuedPriority].fetch_sub(1, std::memory_order_relaxed);
+
+			if (back)
+				m_QueuePolicy[t.m_QueuedPriority].m_LifoTasks++;
+		}
+
+		return true;
+	}
+
+	// Takes the next task off the queue... and if its callback has a batch handler, the tasks with the same callback
+	// that are right behind it, too (in which case handler is set, otherwise it's null)
+	// If next is given, it gets the prefetch hints of the task that's now at the front of that queue
+	bool GetNextTasks(std::vector<STaskInfo> &tasks, BATCH_CALLBACK &handler, SPrefetchHints *next = nullptr)
+	{
+		tasks.clear();
+		handler = nullptr;
+
+		if (next)
+			next->m_Count = 0;
+
+		m_Faults.Inject(CFaultInjector::FP_DEQUEUE);
+
+		// tasks aimed at this worker come before anything else
+		if (TakeFromMailbox(tasks))
+		{
+			m_Load.OnStarted(tasks.size());
+			return true;
+		}
+
+		do
+		{
+			// the shared queue comes first, since anything at normal priority in there was queued before dispatch was
+			// distributed... except its low priority tasks, which wait until the per-worker queues are empty
+			bool local = (m_NumLocal.load(std::memory_order_relaxed) > 0);
+
+			if (!TakeFromSharedQueue(tasks, handler, next, !local) &&
+				!(local && TakeFromWorkerQueues(tasks, handler, next)) &&
+				!(local && TakeFromSharedQueue(tasks, handler, next, true)))
+				return false;
+		}
+		while (m_CoDel.IsEnabled() && !ShedTasks(tasks, handler, next));
+
+		m_Load.OnStarted(tasks.size());
+
+		UpdateQueueStrategy();
+
+		return true;
+	}
+
+	CFaultInjector m_Faults;
+
+	CLatencyHistogram m_Latency;
+
+	CCoDel m_CoDel;
+
+	// Drops the tasks that queue management says waited too long, letting the drop callback know and completing them
+	// without running them; returns false if that left nothing to run (and everything reset, ready to take more)
+	bool ShedTasks(std::vector<STaskInfo> &tasks, BATCH_CALLBACK &handler, SPrefetchHints *next)
+	{
+		uint64_t now = GetTimeNS();
+
+		// this still counts the tasks that were just taken
+		size_t queued = m_Load.GetQueuedCount();
+
+		std::vector<STaskInfo> dropped;
+
+		size_t kept = 0;
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			STaskInfo &t = tasks[i];
+
+			uint64_t sojourn = (t.m_QueuedNS && (now > t.m_QueuedNS)) ? (now - t.m_QueuedNS) : 0;
+
+			// the pool's own helpers (for ParallelFor and ParallelDo) hold a reference to their job, and are never the
+			// user's to drop
+			bool helper = ((t.m_Task == _ParallelForHelper) || (t.m_Task == _ParallelDoHelper));
+
+			if (!helper && m_CoDel.OnDequeue(now, sojourn, (queued > (i + 1)), (t.m_QueuedPriority < TP_HIGH)))
+				dropped.push_back(t);
+			else
+				tasks[kept++] = t;
+		}
+
+		if (dropped.empty())
+			return true;
+
+		tasks.erase(tasks.begin() + kept, tasks.end());
+
+		m_Load.OnPurged(dropped.size());
+
+		DROP_CALLBACK func;
+		void *userdata;
+		m_CoDel.GetCallback(func, userdata);
+
+		for (auto &t : dropped)
+		{
+			if (func)
+				func(t.m_Task, t.m_Param[0], t.m_Param[1], t.m_TaskNumber, (t.m_QueuedNS && (now > t.m_QueuedNS)) ? ((double)(now - t.m_QueuedNS) / 1e9) : 0.0, userdata);
+
+			FinishTask(t);
+		}
+
+		if (!tasks.empty())
+			return true;
+
+		handler = nullptr;
+
+		if (next)
+			next->m_Count = 0;
+
+		return false;
+	}
+
+	// Called when a thread is about to run a task; records how long it waited and injects faults
+	// Returns the time it started, if anybody needs to know, or 0
+	uint64_t OnTaskStarting(const STaskInfo &task)
+	{
+		m_Faults.Inject(CFaultInjector::FP_RUN);
+
+		uint64_t now = 0;
+
+		if (task.m_QueuedNS && m_Latency.IsEnabled())
+		{
+			now = GetTimeNS();
+			m_Latency.Record((now > task.m_QueuedNS) ? (now - task.m_QueuedNS) : 0);
+		}
+
+		if (task.m_pGroup || task.m_pEpochGroup || m_Faults.IsEnabled())
+			return now ? now : GetTimeNS();
+
+		return 0;
+	}
+
+	// Called after a task that started at start (from OnTaskStarting) has run
+	void OnTaskRan(const STaskInfo &task, uint64_t start)
+	{
+		if (!start)
+			return;
+
+		uint64_t end = m_Faults.Stretch(start, GetTimeNS());
+
+		RecordTaskRun(task, start, end);
+	}
+
+	// Returns true if the task's scope has been cancelled
+	static bool IsTaskCancelled(const STaskInfo &task)
+	{
+		return (task.m_pScope && task.m_pScope->IsCancelled());
+	}
+
+	// Runs tasks that were taken off the queue, either one at a time or all together with a batch handler
+	void ExecuteTasks(std::vector<STaskInfo> &tasks, BATCH_CALLBACK handler)
+	{
+		// tasks from cancelled scopes complete without running
+		size_t kept = 0;
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			if (!IsTaskCancelled(tasks[i]))
+				tasks[kept++] = tasks[i];
+			else
+				FinishTask(tasks[i]);
+		}
+
+		if (kept < tasks.size())
+		{
+			// the take is only over (and its thread no longer busy) if none of it is left to run
+			if (kept)
+				m_Load.OnCompleted(tasks.size() - kept);
+			else
+				m_Load.OnFinished(tasks.size());
+
+			tasks.erase(tasks.begin() + kept, tasks.end());
+
+			if (tasks.empty())
+				return;
+		}
+
+		// if the whole take was held back, the thread is done with it
+		size_t sensitive = 0;
+		if (m_Pressure.IsEnabled() && !AdmitSensitiveTasks(tasks, sensitive))
+		{
+			m_Load.OnFinished(0);
+			return;
+		}
+
+		if (handler)
+			ExecuteBatch(tasks.data(), tasks.size(), handler);
+		else
+			ExecuteTask(tasks.front());
+
+		if (sensitive)
+			ReleaseSensitiveSlots(sensitive);
+	}
+
+	CPressureMonitor m_Pressure;
+
+	// the pressure-sensitive tasks running now, and the ones being held back
+	std::atomic<size_t> m_SensitiveRunning;
+	TTaskQueue m_PressureDeferred;
+	std::atomic<size_t> m_NumPressureDeferred;
+	std::atomic<uint64_t> m_NumThrottled;
+	std::mutex m_mutexPressure;
+
+	// Claims a slot for each of the pressure-sensitive tasks, holding back the ones that don't get one; sensitive
+	// is set to the number of slots claimed. Returns false if there's nothing left to run
+	bool AdmitSensitiveTasks(std::vector<STaskInfo> &tasks, size_t &sensitive)
+	{
+		size_t kept = 0;
+		for (size_t i = 0; i < tasks.size(); i++)
+		{
+			if (!tasks[i].m_PressureSensitive)
+			{
+				tasks[kept++] = tasks[i];
+				continue;
+			}
+
+			size_t running = m_SensitiveRunning.load();
+			bool admit;
+			do
+			{
+				admit = (!m_Pressure.IsUnderPressure() || (running < m_Pressure.GetMaxSensitive()));
+			}
+			while (admit && !m_SensitiveRunning.compare_exchange_weak(running, running + 1));
+
+			if (admit)
+			{
+				tasks[kept++] = tasks[i];
+				sensitive++;
+			}
+			else
+			{
+				DeferSensitiveTask(tasks[i]);
+			}
+		}
+
+		if (kept == tasks.size())
+			return true;
+
+		tasks.erase(tasks.begin() + kept, tasks.end());
+
+		return !tasks.empty();
+	}
+
+	// Holds a task back until a slot frees up or the pressure is over; it still counts as queued
+	void DeferSensitiveTask(const STaskInfo &task)
+	{
+		m_Load.OnQueued(1, false);
+
+		{
+			std::lock_guard<std::mutex> l(m_mutexPressure);
+
+			m_PressureDeferred.push_back(task);
+			m_NumPressureDeferred.fetch_add(1);
+			m_NumThrottled.fetch_add(1);
+		}
+
+		// if the pressure ended while this was on its way in, the relief may have missed it
+		if (!m_Pressure.IsUnderPressure())
+			ResumeDeferredTasks(SIZE_MAX);
+	}
+
+	void ReleaseSensitiveSlots(size_t count)
+	{
+		m_SensitiveRunning.fetch_sub(count);
+
+		if (m_NumPressureDeferred.load())
+			ResumeDeferredTasks(count);
+	}
+
+	// Puts up to count of the held back tasks back in the queue, oldest first
+	void ResumeDeferredTasks(size_t count)
+	{
+		std::vector<STaskInfo> resumed;
+
+		{
+			std::lock_guard<std::mutex> l(m_mutexPressure);
+
+			while (count-- && !m_PressureDeferred.empty())
+			{
+				resumed.push_back(m_PressureDeferred.front());
+				m_PressureDeferred.pop_front();
+			}
+
+			m_NumPressureDeferred.fetch_sub(resumed.size());
+		}
+
+		if (resumed.empty())
+			return;
+
+		{
+			std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+			for (auto &t : resumed)
+				EnqueueLocked(t);
+		}
+
+		if (m_hSemaphores[TS_RUN])
+			ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)std::min<size_t>(resumed.size(), m_hThreads.size()), NULL);
+	}
+
+	static void OnPressureRelief(void *userdata)
+	{
+		((CThreadPool *)userdata)->ResumeDeferredTasks(SIZE_MAX);
+	}
+
+	// Runs tasks that share a batch handler with a single call, then finishes them all
+	void ExecuteBatch(STaskInfo *tasks, size_t count, BATCH_CALLBACK handler)
+	{
+		// the handler gets the tasks' parameters as a structure of arrays
+		std::vector<void *> param0(count), param1(count);
+		std::vector<size_t> task_number(count);
+
+		TASK_PRIORITY priority = TP_LOW;
+		uint64_t start = 0;
+
+		// anything the handler submits joins the tasks' scope, if they're all in the same one
+		CTaskScope *scope = tasks[0].m_pScope;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			param0[i] = tasks[i].m_Param[0];
+			param1[i] = tasks[i].m_Param[1];
+			task_number[i] = tasks[i].m_TaskNumber;
+
+			priority = std::max(priority, tasks[i].m_QueuedPriority);
+			start = std::max(start, OnTaskStarting(tasks[i]));
+
+			if (tasks[i].m_pScope != scope)
+				scope = nullptr;
+		}
+
+		TASK_PRIORITY prev_priority = s_CurrentPriority;
+		s_CurrentPriority = priority;
+
+		CTaskScope *prev_scope = s_pCurrentScope;
+		s_pCurrentScope = scope;
+
+		handler(param0.data(), param1.data(), task_number.data(), count);
+
+		// each task is credited with an equal slice of the call
+		if (start)
+		{
+			uint64_t d = m_Faults.Stretch(start, GetTimeNS()) - start;
+			for (size_t i = 0; i < count; i++)
+				RecordTaskRun(tasks[i], start + ((d * i) / count), start + ((d * (i + 1)) / count));
+		}
+
+		s_CurrentPriority = prev_priority;
+		s_pCurrentScope = prev_scope;
+
+		m_Load.OnFinished(count);
+
+		for (size_t i = 0; i < count; i++)
+			FinishTask(tasks[i]);
+	}
+
+	// Runs a task that was taken off the queue, then re-queues or finishes it
+	void ExecuteTask(STaskInfo &task)
+	{
+		TASK_RETURN ret;
+
+		// anything the task waits on inherits its priority
+		TASK_PRIORITY prev_priority = s_CurrentPriority;
+		s_CurrentPriority = GetTaskPriority(task);
+
+		// anything the task submits joins its scope
+		CTaskScope *prev_scope = s_pCurrentScope;
+		s_pCurrentScope = task.m_pScope;
+
+		uint64_t start = OnTaskStarting(task);
+
+		// run the task as long as it keeps telling us to re-run
+		do
+		{
+			ret = task.m_Task(task.m_Param[0], task.m_Param[1], task.m_TaskNumber);
+		}
+		while ((ret == TASK_RETURN::TR_RERUN) && !IsTaskCancelled(task));
+
+		OnTaskRan(task, start);
+
+		s_CurrentPriority = prev_priority;
+		s_pCurrentScope = prev_scope;
+
+		bool requeue = ((ret == TASK_RETURN::TR_REQUEUE) || (ret == TASK_RETURN::TR_YIELD)) && !IsTaskCancelled(task);
+
+		m_Load.OnFinished(!requeue);
+
+		// if we need to re-queue it, do that now... tasks that yielded go back to the front, so they only wait for
+		// the more urgent work they made room for
+		if (requeue)
+		{
+			task.m_QueuedNS = (m_Latency.IsEnabled() || m_CoDel.IsEnabled()) ? GetTimeNS() : 0;
+
+			m_Load.OnQueued(1, false);
+
+			if (task.m_TargetWorker != NO_TARGET_WORKER)
+			{
+				PostToWorker(task, (ret == TASK_RETURN::TR_YIELD));
+			}
+			else if (!RequeueToWorkerQueue(task, (ret == TASK_RETURN::TR_YIELD)))
+			{
+				std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+				EnqueueLocked(task, (ret == TASK_RETURN::TR_YIELD));
+			}
+
+			if (m_hSemaphores[TS_RUN])
+				ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)m_hThreads.size(), NULL);
+		}
+		// otherwise, indicate that the action has completed
+		else
+		{
+			FinishTask(task);
+		}
+	}
+
+	// Returns true if the calling thread should run tasks while it waits on this pool, rather than sleep:
+	// it's one of our workers (who would otherwise be stuck) or there are no workers at all
+	bool ShouldHelpWhileWaiting()
+	{
+		return (!m_hThreads.size() || (s_pCurrentPool == this));
+	}
+
+	// Runs queued work on the calling thread, returning false if there wasn't any
+	bool HelpRunTasks()
+	{
+		if (!m_hThreads.size())
+			return (FlushTasks() > 0);
+
+		std::vector<STaskInfo> tasks;
+		BATCH_CALLBACK handler;
+		SPrefetchHints next;
+		if (!GetNextTasks(tasks, handler, &next))
+			return false;
+
+		PrefetchTask(next);
+
+		ExecuteTasks(tasks, handler);
+
+		return true;
+	}
+
+	// Starts pulling in what a task will need, so it arrives while the one before it runs
+	static void PrefetchTask(const SPrefetchHints &hints)
+	{
+		for (size_t i = 0; i < hints.m_Count; i++)
+			PrefetchRange(hints.m_Hint[i].address, std::min<size_t>(hints.m_Hint[i].length, MAX_PREFETCH_BYTES));
+	}
+
+	COversubscriptionMonitor m_CpuMonitor;
+
+	// how often a parked worker checks whether it's been brought back
+	static const DWORD PARK_POLL_MS = 10;
+
+	// Reads the calling worker's scheduling counters, if it's time, and lets the monitor adjust the number of active workers
+	void SampleScheduling(size_t index)
+	{
+		m_CpuMonitor.Sample(index);
+		m_CpuMonitor.Evaluate();
+	}
+
+	// Puts a task in its target worker's mailbox (at the front, if it's resuming after a yield); the caller wakes the workers
+	void PostToWorker(const STaskInfo &task, bool front = false)
+	{
+		SThreadInfo &ti = m_ThreadInfo[task.m_TargetWorker];
+
+		std::lock_guard<std::mutex> l(ti.m_mutexMailbox);
+
+		if (front)
+			ti.m_Mailbox.push_front(task);
+		else
+			ti.m_Mailbox.push_back(task);
+
+		ti.m_MailboxCount.fetch_add(1);
+	}
+
+	// Takes the next task from the calling worker's mailbox, if there is one
+	bool TakeFromMailbox(std::vector<STaskInfo> &tasks)
+	{
+		size_t slot = GetCurrentThreadSlot();
+		if (slot >= m_ThreadInfo.size())
+			return false;
+
+		SThreadInfo &ti = m_ThreadInfo[slot];
+		if (!ti.m_MailboxCount.load(std::memory_order_relaxed))
+			return false;
+
+		std::lock_guard<std::mutex> l(ti.m_mutexMailbox);
+
+		if (ti.m_Mailbox.empty())
+			return false;
+
+		tasks.push_back(ti.m_Mailbox.front());
+		ti.m_Mailbox.pop_front();
+
+		ti.m_MailboxCount.fetch_sub(1);
+
+		return true;
+	}
+
+	// Queues a task for each of the workers in [first, last), numbered by worker, and returns the group that tracks them
+	ITaskGroup *RunOnWorkers(size_t first, size_t last, TASK_CALLBACK func, void *param0, void *param1)
+	{
+		if (!func || (first >= last) || (last > m_hThreads.size()))
+			return nullptr;
+
+		CTaskGroup *group = new CTaskGroup(this);
+		group->OnTaskAdded(last - first, TP_HIGH);
+
+		uint64_t queued = (m_Latency.IsEnabled() || m_CoDel.IsEnabled()) ? GetTimeNS() : 0;
+
+		m_Load.OnQueued(last - first);
+
+		for (size_t i = first; i < last; i++)
+		{
+			STaskInfo task(func, param0, param1, i, nullptr);
+			task.m_pGroup = group;
+			task.m_Priority = TP_HIGH;
+			task.m_QueuedPriority = TP_HIGH;
+			task.m_QueuedNS = queued;
+			task.m_TargetWorker = i;
+
+			PostToWorker(task);
+		}
+
+		if (m_hSemaphores[TS_RUN])
+			ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)m_hThreads.size(), nullptr);
+
+		return group;
+	}
+
+	THREAD_CALLBACK m_OnThreadStart;
+	THREAD_CALLBACK m_OnThreadExit;
+	void *m_pThreadHookData;
+
+	void WorkerThreadProc(size_t index)
+	{
+		s_pCurrentPool = this;
+		s_CurrentThreadIndex = index;
+
+		m_ThreadInfo[index].m_NumaNode = GetCurrentNumaNode();
+
+		m_CpuMonitor.OnThreadStart(index);
+
+		if (m_OnThreadStart)
+			m_OnThreadStart(index, m_pThreadHookData);
+
+		bool parked = false;
+
+		while (true)
+		{
+			// while the host is oversubscribed, workers past the active count stay out of the way... except for
+			// the tasks that were aimed at them
+			if (index >= m_CpuMonitor.GetActiveWorkers())
+			{
+				std::vector<STaskInfo> mail;
+				while (TakeFromMailbox(mail))
+				{
+					m_Load.OnStarted(1);
+					ExecuteTask(mail.front());
+					mail.clear();
+				}
+
+				if (WaitForSingleObject(m_hSemaphores[TS_QUIT], PARK_POLL_MS) == WAIT_OBJECT_0)
+					break;
+
+				parked = true;
+				continue;
+			}
+
+			// coming back from being parked, there may be work waiting that nobody is going to signal about
+			if (!parked)
+			{
+				// wait until told to run or quit
+				DWORD waitret = WaitForMultipleObjects(TS_NUMSEMAPHORES, m_hSemaphores, false, INFINITE) - WAIT_OBJECT_0;
+				if (waitret == TS_QUIT)
+					break;
+
+				m_Faults.Inject(CFaultInjector::FP_WAKE);
+			}
+
+			parked = false;
+
+			std::vector<STaskInfo> tasks;
+			BATCH_CALLBACK handler;
+			SPrefetchHints next;
+			while (index < m_CpuMonitor.GetActiveWorkers())
+			{
+				if (!GetNextTasks(tasks, handler, &next))
+					break;
+
+				PrefetchTask(next);
+
+				ExecuteTasks(tasks, handler);
+
+				SampleScheduling(index);
+
+				Sleep(0);
+			}
+
+			SampleScheduling(index);
+
+			// out of work for now
+			CallIdleHooks(index);
+		}
+
+		if (m_OnThreadExit)
+			m_OnThreadExit(index, m_pThreadHookData);
+
+		m_CpuMonitor.OnThreadExit(index);
+	}
+
+	static void _WorkerThreadProc(CThreadPool *param, size_t index)
+	{
+		CThreadPool *_this = (CThreadPool *)param;
+		_this->WorkerThreadProc(index);
+	}
+
+	// the actual thread handles... keep them separated from SThreadInfo
+	// so we can wait on them.
+	std::vector<std::thread> m_hThreads;
+
+	// per-worker information, indexed the same way as m_hThreads
+	struct SThreadInfo
+	{
+		SThreadInfo()
+		{
+			m_NumaNode = 0;
+			m_MailboxCount = 0;
+		}
+
+		// the NUMA node the worker was running on when it started
+		std::atomic<uint32_t> m_NumaNode;
+
+		// tasks that only this worker may run (see RunOnWorker)
+		TTaskQueue m_Mailbox;
+		std::atomic<size_t> m_MailboxCount;
+		std::mutex m_mutexMailbox;
+	};
+
+	std::vector<SThreadInfo> m_ThreadInfo;
+
+	struct SIdleHook
+	{
+		uint32_t m_ID;
+		IDLE_CALLBACK m_Func;
+		void *m_UserData;
+	};
+
+	std::vector<SIdleHook> m_IdleHooks;
+
+	// held while hooks are called, so that once RemoveIdleHook returns the hook is guaranteed not to be running
+	std::mutex m_mutexIdleHooks;
+
+	std::atomic<size_t> m_NumIdleHooks;
+	uint32_t m_NextIdleHookID;
+
+	void CallIdleHooks(size_t index)
+	{
+		if (!m_NumIdleHooks.load(std::memory_order_relaxed))
+			return;
+
+		std::lock_guard<std::mutex> l(m_mutexIdleHooks);
+
+		for (const auto &h : m_IdleHooks)
+			h.m_Func(index, h.m_UserData);
+	}
+
+	// the pool and worker index of the calling thread, if it is a worker
+	static thread_local CThreadPool *s_pCurrentPool;
+	static thread_local size_t s_CurrentThreadIndex;
+
+	// the priority of the task the calling thread is running; threads outside any pool have nothing better to
+	// do than wait, so they count as high priority
+	static thread_local TASK_PRIORITY s_CurrentPriority;
+
+	// the scope of the task the calling thread is running, if any
+	static thread_local CTaskScope *s_pCurrentScope;
+
+	// how many FlushTasks calls the calling thread is inside of
+	static thread_local size_t s_FlushDepth;
+
+	struct SFlushDepth
+	{
+		SFlushDepth() { s_FlushDepth++; }
+		~SFlushDepth() { s_FlushDepth--; }
+	};
+
+	// Returns the scope of the task the calling thread is running, if it's one of ours
+	CTaskScope *GetCurrentTaskScope()
+	{
+		return (s_pCurrentScope && (s_pCurrentScope->GetPool() == this)) ? s_pCurrentScope : nullptr;
+	}
+
+	// Returns the worker index of the calling thread in this pool, or m_hThreads.size() if it isn't one of ours
+	size_t GetCurrentThreadSlot()
+	{
+		return (s_pCurrentPool == this) ? s_CurrentThreadIndex : m_hThreads.size();
+	}
+
+	enum
+	{
+		TS_QUIT = 0,		// indicates it's time for a thread to shut down
+		TS_RUN,				// indicates that the thread should start running the function given
+
+		TS_NUMSEMAPHORES
+	};
+
+	sem_t m_hSemaphores[TS_NUMSEMAPHORES];
+
+	static inline uint64_t GetTimeNS()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// A range being processed by ParallelFor; the caller and any helper tasks claim chunks from it until
+	// it's exhausted. Helpers may start after the range is done, so the job is reference counted
+	struct SParallelForJob
+	{
+		// With affinity, the chunks are dealt out as contiguous stripes, one per participant slot (each
+		// worker plus the caller), and the stripes are laid out in NUMA node order so that every node
+		// owns one contiguous piece of the range. Participants drain their own stripe first, then
+		// help the stripes of their node, then everyone else's
+		struct SStripe
+		{
+			std::atomic<size_t> m_Next;
+			size_t m_End;
+			uint32_t m_NumaNode;
+		};
+
+		SParallelForJob(size_t numstripes)
+		{
+			m_NumStripes = numstripes;
+			m_pStripe = numstripes ? new SStripe[numstripes] : nullptr;
+		}
+
+		~SParallelForJob()
+		{
+			delete [] m_pStripe;
+		}
+
+		RANGE_CALLBACK m_Func;
+		void *m_Param[2];
+
+		size_t m_Count;
+		size_t m_Grain;
+		size_t m_NumChunks;
+
+		// the next chunk that hasn't been claimed yet, when not using stripes
+		std::atomic<size_t> m_Next;
+
+		size_t m_NumStripes;
+		SStripe *m_pStripe;
+
+		// the number of indices that have been processed
+		std::atomic<size_t> m_Done;
+
+		// signalled when the last index has been processed
+		std::mutex m_mutexDone;
+		std::condition_variable m_cvDone;
+
+		std::atomic<LONG> m_RefCount;
+
+		// measurements for the autotuner
+		std::atomic<uint64_t> m_WorkNS;
+		std::atomic<uint64_t> m_OverheadNS;
+		std::atomic<size_t> m_Chunks;
+
+		static bool ClaimFromStripe(SStripe &stripe, size_t &chunk)
+		{
+			if (stripe.m_Next.load(std::memory_order_relaxed) >= stripe.m_End)
+				return false;
+
+			chunk = stripe.m_Next.fetch_add(1);
+			return (chunk < stripe.m_End);
+		}
+
+		// Claims the next chunk for a participant; stripe is the one it last took work from
+		bool Claim(size_t &stripe, uint32_t node, size_t &chunk)
+		{
+			if (!m_NumStripes)
+			{
+				chunk = m_Next.fetch_add(1);
+				return (chunk < m_NumChunks);
+			}
+
+			if (ClaimFromStripe(m_pStripe[stripe], chunk))
+				return true;
+
+			// look on our own node first, then anywhere
+			for (size_t pass = 0; pass < 2; pass++)
+			{
+				for (size_t i = 0; i < m_NumStripes; i++)
+				{
+					if (!pass && (m_pStripe[i].m_NumaNode != node))
+						continue;
+
+					if (ClaimFromStripe(m_pStripe[i], chunk))
+					{
+						stripe = i;
+						return true;
+					}
+				}
+			}
+
+			return false;
+		}
+
+		void Release()
+		{
+			if (m_RefCount.fetch_sub(1) == 1)
+				delete this;
+		}
+	};
+
+	CGrainTuner m_GrainTuner;
+
+	CLoadMonitor m_Load;
+
+	// Claims and runs chunks of the job until there are none left
+	void ParticipateInParallelFor(SParallelForJob *job)
+	{
+		uint64_t start = GetTimeNS(), work = 0;
+		size_t chunks = 0;
+
+		size_t stripe = std::min<size_t>(GetCurrentThreadSlot(), job->m_NumStripes ? (job->m_NumStripes - 1) : 0);
+		uint32_t node = job->m_NumStripes ? GetCurrentNumaNode() : 0;
+
+		size_t chunk;
+		while (job->Claim(stripe, node, chunk))
+		{
+			size_t b = chunk * job->m_Grain;
+			size_t e = std::min<size_t>(b + job->m_Grain, job->m_Count);
+
+			uint64_t t0 = GetTimeNS();
+			job->m_Func(job->m_Param[0], job->m_Param[1], b, e);
+			work += GetTimeNS() - t0;
+			chunks++;
+
+			if ((job->m_Done.fetch_add(e - b) + (e - b)) == job->m_Count)
+			{
+				std::lock_guard<std::mutex> l(job->m_mutexDone);
+				job->m_cvDone.notify_all();
+			}
+		}
+
+		if (chunks)
+		{
+			uint64_t active = GetTimeNS() - start;
+
+			job->m_WorkNS.fetch_add(work);
+			job->m_OverheadNS.fetch_add((active > work) ? (active - work) : 0);
+			job->m_Chunks.fetch_add(chunks);
+		}
+	}
+
+	static TASK_RETURN __cdecl _ParallelForHelper(void *param0, void *param1, size_t task_number)
+	{
+		CThreadPool *_this = (CThreadPool *)param0;
+		SParallelForJob *job = (SParallelForJob *)param1;
+
+		_this->ParticipateInParallelFor(job);
+
+		return TASK_RETURN::TR_OK;
+	}
+
+	static void _ReleaseParallelForJob(void *param1)
+	{
+		((SParallelForJob *)param1)->Release();
+	}
+
+	// Queues helpers for one of the pool's own parallel jobs; each one holds a reference to the job, which is dropped
+	// by cleanup when the helper finishes - even if it was purged or shed without running
+	void RunHelperTasks(TASK_CALLBACK func, void *job, void (*cleanup)(void *), size_t helpers)
+	{
+		STaskInfo proto(func, this, job, 0, nullptr);
+		proto.m_pCleanup = cleanup;
+
+		SubmitTasks(proto, helpers, nullptr);
+	}
+
+	// Runs the range on the pool with the given grain, returning the job's measurements
+	// If affinity is set, the range is split into node-ordered stripes (see SParallelForJob)
+	void RunParallelFor(RANGE_CALLBACK func, void *param0, void *param1, size_t count, size_t grain, bool affinity = false,
+		uint64_t *work_ns = nullptr, uint64_t *overhead_ns = nullptr, size_t *chunks = nullptr)
+	{
+		if (!func || !count)
+			return;
+
+		grain = std::max<size_t>(1, grain);
+		size_t numchunks = (count + grain - 1) / grain;
+
+		// no point in waking helpers for chunks that don't exist
+		size_t helpers = std::min<size_t>(m_hThreads.size(), numchunks - 1);
+
+		SParallelForJob *job = new SParallelForJob((affinity && helpers) ? (m_hThreads.size() + 1) : 0);
+		job->m_Func = func;
+		job->m_Param[0] = param0;
+		job->m_Param[1] = param1;
+		job->m_Count = count;
+		job->m_Grain = grain;
+		job->m_NumChunks = numchunks;
+		job->m_Next = 0;
+		job->m_Done = 0;
+		job->m_RefCount = (LONG)(helpers + 1);
+		job->m_WorkNS = 0;
+		job->m_OverheadNS = 0;
+		job->m_Chunks = 0;
+
+		if (job->m_NumStripes)
+		{
+			// the last slot belongs to whichever non-worker thread is calling
+			std::vector<size_t> order(job->m_NumStripes);
+			for (size_t i = 0; i < job->m_NumStripes; i++)
+			{
+				order[i] = i;
+				job->m_pStripe[i].m_NumaNode = (i < m_hThreads.size()) ? m_ThreadInfo[i].m_NumaNode.load() : GetCurrentNumaNode();
+			}
+
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+			{
+				return job->m_pStripe[a].m_NumaNode < job->m_pStripe[b].m_NumaNode;
+			});
+
+			size_t first = 0;
+			for (size_t i = 0; i < job->m_NumStripes; i++)
+			{
+				size_t last = (numchunks * (i + 1)) / job->m_NumStripes;
+
+				SParallelForJob::SStripe &stripe = job->m_pStripe[order[i]];
+				stripe.m_Next = first;
+				stripe.m_End = last;
+
+				first = last;
+			}
+		}
+
+		if (helpers)
+			RunHelperTasks(_ParallelForHelper, job, _ReleaseParallelForJob, helpers);
+
+		ParticipateInParallelFor(job);
+
+		// wait for chunks that helpers are still processing; a worker that called this from a task runs other
+		// tasks in the meantime, rather than holding its thread
+		bool help = ShouldHelpWhileWaiting();
+
+		while (job->m_Done.load() < count)
+		{
+			if (help && HelpRunTasks())
+				continue;
+
+			std::unique_lock<std::mutex> l(job->m_mutexDone);
+
+			if (help)
+				job->m_cvDone.wait_for(l, std::chrono::milliseconds(1), [&]() { return (job->m_Done.load() >= count); });
+			else
+				job->m_cvDone.wait(l, [&]() { return (job->m_Done.load() >= count); });
+		}
+
+		if (work_ns)
+			*work_ns = job->m_WorkNS.load();
+		if (overhead_ns)
+			*overhead_ns = job->m_OverheadNS.load();
+		if (chunks)
+			*chunks = job->m_Chunks.load();
+
+		job->Release();
+	}
+
+	// A worklist being processed by ParallelDo. Every participant (each worker plus the caller) has a bag; items a
+	// body pushes go into its own bag, which it works through newest first, and participants with empty bags
+	// steal the oldest half of someone else's. m_Outstanding counts items that have been pushed but not yet
+	// processed, and since a body can only push while its own item is still outstanding, the count reaching
+	// zero means every bag is empty and nobody is working on anything
+	struct SParallelDoJob
+	{
+		__declspec(align(64)) struct SBag
+		{
+			std::mutex m_Lock;
+			std::deque<void *> m_Items;
+		};
+
+		SParallelDoJob(size_t numbags)
+		{
+			m_NumBags = numbags;
+			m_pBag = new SBag[numbags];
+		}
+
+		~SParallelDoJob()
+		{
+			delete [] m_pBag;
+		}
+
+		ITEM_CALLBACK m_Func;
+		void *m_Param[2];
+
+		size_t m_NumBags;
+		SBag *m_pBag;
+
+		std::atomic<size_t> m_Outstanding;
+
+		// the number of items sitting in the bags
+		std::atomic<size_t> m_Available;
+
+		// participants with nothing to take park here until an item is pushed or the last one is done
+		std::mutex m_mutexIdle;
+		std::condition_variable m_cvIdle;
+		std::atomic<size_t> m_NumIdle;
+
+		std::atomic<LONG> m_RefCount;
+
+		void Push(size_t bag, void *item)
+		{
+			m_Outstanding.fetch_add(1);
+
+			{
+				SBag &b = m_pBag[bag];
+				std::lock_guard<std::mutex> l(b.m_Lock);
+				b.m_Items.push_back(item);
+			}
+
+			m_Available.fetch_add(1);
+
+			if (m_NumIdle.load())
+			{
+				std::lock_guard<std::mutex> l(m_mutexIdle);
+				m_cvIdle.notify_one();
+			}
+		}
+
+		// Called when an item has been processed
+		void OnItemDone()
+		{
+			if ((m_Outstanding.fetch_sub(1) == 1) && m_NumIdle.load())
+			{
+				std::lock_guard<std::mutex> l(m_mutexIdle);
+				m_cvIdle.notify_all();
+			}
+		}
+
+		// Waits for an item to take, or for the job to be done
+		void WaitForWork()
+		{
+			std::unique_lock<std::mutex> l(m_mutexIdle);
+
+			m_NumIdle.fetch_add(1);
+			m_cvIdle.wait(l, [this]() { return (m_Available.load() || !m_Outstanding.load()); });
+			m_NumIdle.fetch_sub(1);
+		}
+
+		bool Pop(size_t bag, void *&item)
+		{
+			SBag &b = m_pBag[bag];
+			std::lock_guard<std::mutex> l(b.m_Lock);
+
+			if (b.m_Items.empty())
+				return false;
+
+			item = b.m_Items.back();
+			b.m_Items.pop_back();
+			m_Available.fetch_sub(1);
+			return true;
+		}
+
+		// Moves the oldest half of another bag's items into ours, returning one of them to process
+		bool Steal(size_t bag, void *&item)
+		{
+			std::vector<void *> loot;
+
+			for (size_t i = 1; i < m_NumBags; i++)
+			{
+				SBag &victim = m_pBag[(bag + i) % m_NumBags];
+				std::lock_guard<std::mutex> l(victim.m_Lock);
+
+				size_t n = (victim.m_Items.size() + 1) / 2;
+				if (!n)
+					continue;
+
+				loot.assign(victim.m_Items.begin(), victim.m_Items.begin() + n);
+				victim.m_Items.erase(victim.m_Items.begin(), victim.m_Items.begin() + n);
+				break;
+			}
+
+			if (loot.empty())
+				return false;
+
+			item = loot.front();
+			m_Available.fetch_sub(1);
+
+			if (loot.size() > 1)
+			{
+				SBag &b = m_pBag[bag];
+				std::lock_guard<std::mutex> l(b.m_Lock);
+				b.m_Items.insert(b.m_Items.end(), loot.begin() + 1, loot.end());
+			}
+
+			return true;
+		}
+
+		void Release()
+		{
+			if (m_RefCount.fetch_sub(1) == 1)
+				delete this;
+		}
+	};
+
+	// What a ParallelDo body is given to push new items with; it lives on the participant's stack
+	class CWorkList : public IWorkList
+	{
+	public:
+
+		CWorkList(SParallelDoJob *job, size_t bag) : m_pJob(job), m_Bag(bag) { }
+
+		virtual void Push(void *item)
+		{
+			m_pJob->Push(m_Bag, item);
+		}
+
+	protected:
+
+		SParallelDoJob *m_pJob;
+		size_t m_Bag;
+	};
+
+	// Processes items from the job until the worklist has run dry
+	void ParticipateInParallelDo(SParallelDoJob *job)
+	{
+		size_t bag = std::min<size_t>(GetCurrentThreadSlot(), job->m_NumBags - 1);
+
+		CWorkList worklist(job, bag);
+
+		while (true)
+		{
+			void *item;
+			if (job->Pop(bag, item) || job->Steal(bag, item))
+			{
+				job->m_Func(job->m_Param[0], job->m_Param[1], item, &worklist);
+				job->OnItemDone();
+				continue;
+			}
+
+			// nothing to take; we're done once nobody is still working on an item that might push more
+			if (!job->m_Outstanding.load())
+				break;
+
+			job->WaitForWork();
+		}
+	}
+
+	static TASK_RETURN __cdecl _ParallelDoHelper(void *param0, void *param1, size_t task_number)
+	{
+		CThreadPool *_this = (CThreadPool *)param0;
+		SParallelDoJob *job = (SParallelDoJob *)param1;
+
+		_this->ParticipateInParallelDo(job);
+
+		return TASK_RETURN::TR_OK;
+	}
+
+	static void _ReleaseParallelDoJob(void *param1)
+	{
+		((SParallelDoJob *)param1)->Release();
+	}
+
+	// Buffers smaller than this aren't worth splitting up
+	static const size_t PARALLEL_MEMORY_THRESHOLD = 1 << 20;
+
+	// The preferred size of each chunk of a parallel memory operation
+	static const size_t PARALLEL_MEMORY_CHUNK = 256 << 10;
+
+	// Describes a buffer split up into pages; range indices given to the memory callbacks are page numbers,
+	// so every chunk boundary lands on a page boundary of the first buffer
+	struct SMemoryJob
+	{
+		SMemoryJob(void *dst, const void *src, size_t size)
+		{
+			m_pDst = (uint8_t *)dst;
+			m_pSrc = (const uint8_t *)src;
+			m_Size = size;
+			m_PageSize = GetMemoryPageSize();
+
+			m_Base = (uintptr_t)dst & ~(uintptr_t)(m_PageSize - 1);
+			m_NumPages = (size_t)(((uintptr_t)dst + size - m_Base + m_PageSize - 1) / m_PageSize);
+			m_Grain = std::max<size_t>(1, PARALLEL_MEMORY_CHUNK / m_PageSize);
+		}
+
+		// Returns the byte offsets into the buffers covered by the pages [begin, end)
+		void GetByteRange(size_t begin, size_t end, size_t &offset, size_t &size) const
+		{
+			uintptr_t b = std::max<uintptr_t>((uintptr_t)m_pDst, m_Base + (uintptr_t)begin * m_PageSize);
+			uintptr_t e = std::min<uintptr_t>((uintptr_t)m_pDst + m_Size, m_Base + (uintptr_t)end * m_PageSize);
+
+			offset = (size_t)(b - (uintptr_t)m_pDst);
+			size = (e > b) ? (size_t)(e - b) : 0;
+		}
+
+		size_t GetChunkIndex(size_t begin) const
+		{
+			return begin / m_Grain;
+		}
+
+		size_t GetNumChunks() const
+		{
+			return (m_NumPages + m_Grain - 1) / m_Grain;
+		}
+
+		uint8_t *m_pDst;
+		const uint8_t *m_pSrc;
+		size_t m_Size;
+
+		uintptr_t m_Base;
+		size_t m_PageSize;
+		size_t m_NumPages;
+		size_t m_Grain;
+
+		int m_Value;
+		bool m_NonTemporal;
+
+		// for compares, the first chunk that differs and each chunk's result
+		std::atomic<size_t> m_FirstDiff;
+		std::vector<int> m_Result;
+
+		// for checksums, each chunk's crc and length
+		std::vector<uint32_t> m_CRC;
+		std::vector<size_t> m_Length;
+	};
+
+	static void __cdecl _MemcpyRange(void *param0, void *param1, size_t begin, size_t end)
+	{
+		SMemoryJob *job = (SMemoryJob *)param0;
+
+		size_t ofs, sz;
+		job->GetByteRange(begin, end, ofs, sz);
+
+		if (job->m_NonTemporal)
+		{
+			StreamingCopy(job->m_pDst + ofs, job->m_pSrc + ofs, sz);
+			MemoryFence();
+		}
+		else
+		{
+			memcpy(job->m_pDst + ofs, job->m_pSrc + ofs, sz);
+		}
+	}
+
+	static void __cdecl _MemsetRange(void *param0, void *param1, size_t begin, size_t end)
+	{
+		SMemoryJob *job = (SMemoryJob *)param0;
+
+		size_t ofs, sz;
+		job->GetByteRange(begin, end, ofs, sz);
+
+		memset(job->m_pDst + ofs, job->m_Value, sz);
+	}
+
+	static void __cdecl _MemcmpRange(void *param0, void *param1, size_t begin, size_t end)
+	{
+		SMemoryJob *job = (SMemoryJob *)param0;
+
+		size_t chunk = job->GetChunkIndex(begin);
+
+		// if an earlier chunk already differs, this one can't change the answer
+		if (job->m_FirstDiff.load(std::memory_order_relaxed) < chunk)
+			return;
+
+		size_t ofs, sz;
+		job->GetByteRange(begin, end, ofs, sz);
+
+		int r = memcmp(job->m_pDst + ofs, job->m_pSrc + ofs, sz);
+		if (!r)
+			return;
+
+		job->m_Result[chunk] = r;
+
+		size_t prev = job->m_FirstDiff.load();
+		while ((chunk < prev) && !job->m_FirstDiff.compare_exchange_weak(prev, chunk)) { }
+	}
+
+	static void __cdecl _CRC32CRange(void *param0, void *param1, size_t begin, size_t end)
+	{
+		SMemoryJob *job = (SMemoryJob *)param0;
+
+		size_t ofs, sz;
+		job->GetByteRange(begin, end, ofs, sz);
+
+		size_t chunk = job->GetChunkIndex(begin);
+		job->m_CRC[chunk] = ComputeCRC32C(0, job->m_pDst + ofs, sz);
+		job->m_Length[chunk] = sz;
+	}
+
+public:
+
+	void Initialize(size_t thread_count, THREAD_CALLBACK on_start = nullptr, THREAD_CALLBACK on_exit = nullptr, void *userdata = nullptr)
+	{
+		m_OnThreadStart = on_start;
+		m_OnThreadExit = on_exit;
+		m_pThreadHookData = userdata;
+
+		memset(m_hSemaphores, 0, sizeof(HANDLE) * TS_NUMSEMAPHORES);
+
+		m_Load.SetNumThreads(thread_count);
+		m_CpuMonitor.SetNumThreads(thread_count);
+
+		m_SensitiveRunning = 0;
+		m_NumPressureDeferred = 0;
+		m_NumThrottled = 0;
+
+		m_pDrainBatch = nullptr;
+
+		m_PipelineDepth = 0;
+
+		m_NumDeferred = 0;
+
+		m_NumInversions = 0;
+
+		for (auto &n : m_NumQueued)
+			n = 0;
+
+		m_NumBatchHandlers = 0;
+
+		m_NumIdleHooks = 0;
+		m_NextIdleHookID = 1;
+		m_RebalancePending = false;
+
+		for (auto &qp : m_QueuePolicy)
+		{
+			qp.m_Lifo = false;
+			qp.m_AboveSinceNS = 0;
+			qp.m_Switches = 0;
+			qp.m_LifoTasks = 0;
+		}
+
+		m_NumLocal = 0;
+		m_Distributed = false;
+		m_QueueStrategy = QS_GLOBAL;
+		m_NextWorkerQueue = 0;
+
+		if (thread_count)
+		{
+			m_hThreads.resize(thread_count);
+
+			// create the run and quit semaphore...
+#if defined(_WIN32)
+			m_hSemaphores[TS_QUIT] = CreateSemaphore(NULL, 0, (LONG)m_hThreads.size(), NULL);
+			m_hSemaphores[TS_RUN] = CreateSemaphore(NULL, 0, (LONG)m_hThreads.size(), NULL);
+#elif defined(__linux__)
+			sem_init(&m_hSemaphores[TS_QUIT], 0, m_hThreads.size());
+			sem_init(&m_hSemaphores[TS_QUIT], 0, m_hThreads.size());
+#endif
+
+			m_ThreadInfo = std::vector<SThreadInfo>(thread_count);
+			m_WorkerQueues = std::vector<SWorkerQueue>(thread_count);
+
+			for (size_t i = 0; i < m_hThreads.size(); i++)
+			{
+				m_hThreads[i] = std::thread(_WorkerThreadProc, this, i);
+			}
+		}
+	}
+
+	CThreadPool(size_t threads_per_core, int core_count_adjustment)
+	{
+		// Find out how many cores the system has
+		SYSTEM_INFO sysinfo;
+		GetSystemInfo(&sysinfo);
+
+		// Calculate the number of threads we need and allocate thread handles
+		Initialize(threads_per_core * (size_t)std::max<int>(1, (sysinfo.dwNumberOfProcessors + core_count_adjustment)));
+	}
+
+	CThreadPool(size_t thread_count)
+	{
+		Initialize(thread_count);
+	}
+
+	CThreadPool(size_t thread_count, THREAD_CALLBACK on_start, THREAD_CALLBACK on_exit, void *userdata)
+	{
+		Initialize(thread_count, on_start, on_exit, userdata);
+	}
+
+	virtual ~CThreadPool()
+	{
+		// stop watching first, so the monitor's thread doesn't call back into a pool that's going away
+		m_Pressure.Configure(nullptr, nullptr, nullptr);
+
+		if (m_hThreads.size())
+		{
+			PurgeAllPendingTasks();
+
+#if defined(_WIN32)
+			ReleaseSemaphore(m_hSemaphores[TS_QUIT], (LONG)m_hThreads.size(), NULL);
+#elif defined(__linux__)
+#endif
+
+			for (size_t i = 0; i < m_hThreads.size(); i++)
+			{
+				m_hThreads[i].join();
+			}
+
+#if defined(_WIN32)
+			CloseHandle(m_hSemaphores[TS_QUIT]);
+			CloseHandle(m_hSemaphores[TS_RUN]);
+#elif defined(__linux__)
+			sem_destroy(&m_hSemaphores[TS_QUIT]);
+			sem_destroy(&m_hSemaphores[TS_RUN]);
+#endif
+		}
+
+		memset(m_hSemaphores, 0, sizeof(HANDLE) * TS_NUMSEMAPHORES);
+
+		PurgeAllPendingTasks();
+
+		if (m_pDrainBatch)
+		{
+			m_pDrainBatch->Release();
+			m_pDrainBatch = nullptr;
+		}
+
+		for (auto &it : m_Epochs)
+			it.second.m_pGroup->Release();
+
+		m_Epochs.clear();
+	}
+
+	virtual void Release()
+	{
+		delete this;
+	}
+
+	// the number of worker threads in the pool
+	virtual size_t GetNumThreads()
+	{
+		return (UINT)m_hThreads.size();
+	}
+
+	virtual bool RunTask(TASK_CALLBACK func, void *param0 = nullptr, void *param1 = nullptr, size_t numtimes = 1, bool block = false)
+	{
+		return RunTaskEx(TASK_ATTRIBUTES(), func, param0, param1, numtimes, block);
+	}
+
+	virtual bool RunTaskEx(const TASK_ATTRIBUTES &attributes, TASK_CALLBACK func, void *param0 = nullptr, void *param1 = nullptr, size_t numtimes = 1, bool block = false)
+	{
+		if (!func || !numtimes)
+			return false;
+
+		// tasks spawned by a scope's tasks stay in the scope, and nothing new starts in a cancelled one
+		CTaskScope *scope = attributes.scope ? (CTaskScope *)attributes.scope : GetCurrentTaskScope();
+		if (scope && scope->IsCancelled())
+			return false;
+
+		// if blocking is desired, blockwait will be incremented by each STaskInfo
+		volatile LONG blockwait = 0;
+
+		// hold off while the epoch is too far ahead of the oldest one still in flight
+		while (attributes.epoch && m_PipelineDepth.load())
+		{
+			CTaskGroup *oldest;
+			{
+				std::lock_guard<std::mutex> l(m_mutexTaskList);
+				oldest = GetThrottlingEpochLocked(attributes.epoch);
+			}
+
+			if (!oldest)
+				break;
+
+			oldest->Wait(INFINITE);
+			oldest->Release();
+		}
+
+		STaskInfo proto(func, param0, param1, 0, nullptr);
+		proto.m_Epoch = attributes.epoch;
+		proto.m_pGroup = (CTaskGroup *)attributes.group;
+		proto.m_Priority = ((attributes.priority >= TP_LOW) && (attributes.priority < TP_NUMPRIORITIES)) ? attributes.priority : TP_NORMAL;
+
+		// every one of the tasks holds a reference to the hints, released in FinishTask
+		if (attributes.prefetch && attributes.num_prefetch)
+		{
+			proto.m_pPrefetch = new SSharedPrefetchHints();
+			proto.m_pPrefetch->m_Refs = numtimes;
+			proto.m_pPrefetch->m_Count = std::min<size_t>(attributes.num_prefetch, MAX_PREFETCH_HINTS);
+			memcpy(proto.m_pPrefetch->m_Hint, attributes.prefetch, proto.m_pPrefetch->m_Count * sizeof(PREFETCH_HINT));
+		}
+
+		if (proto.m_pGroup)
+			proto.m_pGroup->OnTaskAdded(numtimes, proto.m_Priority);
+
+		proto.m_pCompletionPort = (CCompletionPort *)attributes.completion_port;
+		if (proto.m_pCompletionPort)
+			proto.m_pCompletionPort->OnTaskAdded(numtimes);
+
+		proto.m_pScope = scope;
+		if (proto.m_pScope)
+			proto.m_pScope->OnTaskAdded(numtimes, proto.m_Priority);
+
+		proto.m_PressureSensitive = attributes.pressure_sensitive;
+
+		if (proto.m_Epoch)
+		{
+			std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+			proto.m_pEpochGroup = GetEpochLocked(proto.m_Epoch).m_pGroup;
+			proto.m_pEpochGroup->OnTaskAdded(numtimes, proto.m_Priority);
+		}
+
+		// with costs, the longest tasks are queued first (LPT); since idle threads always take the next task,
+		// the big ones get started early and the small ones fill in the gaps at the end
+		std::vector<size_t> order;
+		if (attributes.cost && (numtimes > 1))
+		{
+			std::vector<double> cost(numtimes);
+			order.resize(numtimes);
+
+			for (size_t i = 0; i < numtimes; i++)
+			{
+				order[i] = i;
+				cost[i] = attributes.cost(param0, param1, i);
+			}
+
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b)
+			{
+				return cost[a] > cost[b];
+			});
+		}
+
+		if (attributes.num_reads || attributes.num_writes)
+		{
+			SDependentTask *dt = new SDependentTask(this, proto, numtimes);
+			dt->m_Order.swap(order);
+
+			m_NumDeferred.fetch_add(numtimes);
+
+			// this may launch the tasks right away, so it's the last thing that touches dt (unless we block)
+			if (block && m_hThreads.size())
+				dt->AddRef();
+
+			m_Dependencies.Register(dt, attributes.reads, attributes.num_reads, attributes.writes, attributes.num_writes);
+
+			if (m_RebalancePending.exchange(false))
+				RebalanceQueues();
+
+			if (block && m_hThreads.size())
+			{
+				while (!dt->IsFinished())
+				{
+					Sleep(10);
+				}
+
+				dt->Release();
+			}
+
+			return true;
+		}
+
+		// without threads there is nobody to wait for (and the counter would outlive this call), so blocking doesn't apply
+		SubmitTasks(proto, numtimes, (block && m_hThreads.size()) ? &blockwait : nullptr, order.empty() ? nullptr : order.data());
+
+		// if we wanted to block, then wait until all of the tasks have completed (ie., wait until blockwait is 0 again)
+		if (m_hThreads.size() && block)
+		{
+			while (blockwait)
+			{
+				Sleep(10);
+			}
+		}
+
+		return true;
+	}
+
+	virtual void WaitForAllTasks(uint32_t milliseconds)
+	{
+		if (m_hThreads.size())
+		{
+			while (m_Load.GetQueuedCount() || m_NumDeferred.load())
+			{
+				Sleep(0);
+			}
+		}
+		else
+		{
+			Flush();
+		}
+	}
+
+	virtual void PurgeAllPendingTasks()
+	{
+		// purged tasks still have to let their waiters go, which is done outside the lock... and that can
+		// release tasks that were waiting on their dependencies, so keep going until nothing more turns up
+		while (PurgePendingTasks()) { }
+	}
+
+	// Returns the number of tasks that were purged
+	size_t PurgePendingTasks()
+	{
+		std::vector<STaskInfo> purged;
+
+		{
+			std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+			TakeAllLocked(purged);
+			TakeWorkerQueuesLocked(purged);
+
+			for (auto &ti : m_ThreadInfo)
+			{
+				std::lock_guard<std::mutex> lm(ti.m_mutexMailbox);
+
+				purged.insert(purged.end(), ti.m_Mailbox.begin(), ti.m_Mailbox.end());
+				ti.m_Mailbox.clear();
+				ti.m_MailboxCount = 0;
+			}
+
+			DrainInbox(&purged);
+
+			{
+				std::lock_guard<std::mutex> lp(m_mutexPressure);
+
+				purged.insert(purged.end(), m_PressureDeferred.begin(), m_PressureDeferred.end());
+				m_PressureDeferred.clear();
+				m_NumPressureDeferred = 0;
+			}
+
+			// claim whatever flushing threads haven't gotten to yet
+			if (m_pDrainBatch)
+			{
+				size_t count = m_pDrainBatch->m_Tasks.size();
+				size_t next = m_pDrainBatch->m_Next.exchange(count);
+				if (next < count)
+				{
+					purged.insert(purged.end(), m_pDrainBatch->m_Tasks.begin() + next, m_pDrainBatch->m_Tasks.end());
+					m_pDrainBatch->m_Done.fetch_add(count - next);
+				}
+			}
+		}
+
+		m_Load.OnPurged(purged.size());
+
+		for (auto &t : purged)
+			FinishTask(t);
+
+		return purged.size();
+	}
+
+	// Flushed tasks don't come through GetNextTasks, so queue management gets its say here; sheds what it wants to from
+	// the count tasks at first, moving the rest up, and returns how many are left to run
+	size_t ShedFlushedTasks(STaskInfo *first, size_t count)
+	{
+		if (!m_CoDel.IsEnabled())
+			return count;
+
+		std::vector<STaskInfo> tasks(first, first + count);
+		BATCH_CALLBACK handler = nullptr;
+
+		ShedTasks(tasks, handler, nullptr);
+
+		std::copy(tasks.begin(), tasks.end(), first);
+
+		return tasks.size();
+	}
+
+	// Flush may be called from several threads at once; they all claim tasks from the same batch until the
+	// queue is empty. Each returns once every batch it helped with has finished, and tasks that ask to be
+	// re-queued are put back for the next Flush
+	virtual void Flush()
+	{
+		FlushTasks();
+	}
+
+	// Returns the number of tasks that were run
+	size_t FlushTasks()
+	{
+		SFlushDepth depth;
+
+		size_t ran = 0;
+
+		std::vector<STaskInfo> requeue;
+
+		while (SDrainBatch *batch = AcquireDrainBatch())
+		{
+			size_t count = batch->m_Tasks.size();
+
+			while (true)
+			{
+				size_t i = batch->m_Next.fetch_add(1);
+				if (i >= count)
+					break;
+
+				STaskInfo &t = batch->m_Tasks[i];
+
+				if (IsTaskCancelled(t))
+				{
+					m_Load.OnStarted();
+					m_Load.OnFinished();
+
+					FinishTask(t);
+
+					batch->m_Done.fetch_add(1);
+					continue;
+				}
+
+				SBatchHandler bh;
+				if (GetBatchHandler(t.m_Task, bh))
+				{
+					// claim the run of tasks with the same callback right behind this one, unless someone has
+					// already started on it
+					size_t end = i + 1;
+					while ((end < count) && ((end - i) < bh.m_MaxBatch) && (batch->m_Tasks[end].m_Task == t.m_Task) && !IsTaskCancelled(batch->m_Tasks[end]))
+						end++;
+
+					size_t next = i + 1;
+					if ((end > next) && !batch->m_Next.compare_exchange_strong(next, end))
+						end = i + 1;
+
+					if ((end < count) && batch->m_Tasks[end].m_pPrefetch)
+						PrefetchTask(*batch->m_Tasks[end].m_pPrefetch);
+
+					size_t run = ShedFlushedTasks(&t, end - i);
+					if (run)
+					{
+						m_Load.OnStarted(run);
+
+						ExecuteBatch(&t, run, bh.m_Handler);
+					}
+
+					batch->m_Done.fetch_add(end - i);
+					ran += run;
+					continue;
+				}
+
+				if (!ShedFlushedTasks(&t, 1))
+				{
+					batch->m_Done.fetch_add(1);
+					continue;
+				}
+
+				// the batch keeps the next task's hints alive, whoever ends up running it
+				if (((i + 1) < count) && batch->m_Tasks[i + 1].m_pPrefetch)
+					PrefetchTask(*batch->m_Tasks[i + 1].m_pPrefetch);
+
+				m_Load.OnStarted();
+
+				TASK_PRIORITY prev_priority = s_CurrentPriority;
+				s_CurrentPriority = t.m_QueuedPriority;
+
+				CTaskScope *prev_scope = s_pCurrentScope;
+				s_pCurrentScope = t.m_pScope;
+
+				uint64_t start = OnTaskStarting(t);
+
+				TASK_RETURN ret;
+				do
+				{
+					ret = t.m_Task(t.m_Param[0], t.m_Param[1], t.m_TaskNumber);
+				}
+				while ((ret == TASK_RETURN::TR_RERUN) && !IsTaskCancelled(t));
+
+				OnTaskRan(t, start);
+
+				s_CurrentPriority = prev_priority;
+				s_pCurrentScope = prev_scope;
+
+				// a cancelled task is done, whatever it asked for
+				if (IsTaskCancelled(t))
+					ret = TASK_RETURN::TR_OK;
+
+				m_Load.OnFinished((ret != TASK_RETURN::TR_REQUEUE) && (ret != TASK_RETURN::TR_YIELD));
+
+				if (ret == TASK_RETURN::TR_REQUEUE)
+				{
+					requeue.push_back(t);
+				}
+				else if (ret == TASK_RETURN::TR_YIELD)
+				{
+					// unlike re-queued tasks, these are picked up again by this Flush, after whatever is more urgent;
+					// even without threads they go to the front of the shared queue, which the next batch takes ahead
+					// of the inbox
+					t.m_QueuedNS = (m_Latency.IsEnabled() || m_CoDel.IsEnabled()) ? GetTimeNS() : 0;
+
+					{
+						std::lock_guard<std::mutex> l(m_mutexTaskList);
+						EnqueueLocked(t, true);
+					}
+
+					m_Load.OnQueued(1, false);
+				}
+				else
+				{
+					FinishTask(t);
+				}
+
+				batch->m_Done.fetch_add(1);
+				ran++;
+			}
+
+			// let other flushing threads finish the tasks they claimed... unless this is a task helping out while it
+			// waits (on a scope it created, say), since it claimed a task from this very batch itself
+			while ((s_FlushDepth == 1) && (batch->m_Done.load() < count))
+				Sleep(0);
+
+			batch->Release();
+		}
+
+		if (!requeue.empty())
+		{
+			uint64_t queued = (m_Latency.IsEnabled() || m_CoDel.IsEnabled()) ? GetTimeNS() : 0;
+			for (auto &t : requeue)
+				t.m_QueuedNS = queued;
+
+			if (!m_hThreads.size())
+			{
+				for (auto &t : requeue)
+					m_Inbox.Push(new STaskNode(t));
+			}
+			else
+			{
+				std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+				for (auto &t : requeue)
+					EnqueueLocked(t);
+			}
+
+			m_Load.OnQueued(requeue.size(), false);
+		}
+
+		return ran;
+	}
+
+	virtual void ParallelFor(RANGE_CALLBACK func, void *param0, void *param1, size_t count, size_t grain_size = 0)
+	{
+		if (!grain_size)
+		{
+			// by default, give each participant several chunks so the tail stays balanced
+			grain_size = std::max<size_t>(1, count / ((m_hThreads.size() + 1) * 8));
+		}
+
+		RunParallelFor(func, param0, param1, count, grain_size);
+	}
+
+	virtual void ParallelForTuned(uint64_t callsite, RANGE_CALLBACK func, void *param0, void *param1, size_t count)
+	{
+		size_t grain = m_GrainTuner.GetGrain(callsite, count, m_hThreads.size() + 1);
+
+		uint64_t work_ns, overhead_ns;
+		size_t chunks;
+		RunParallelFor(func, param0, param1, count, grain, false, &work_ns, &overhead_ns, &chunks);
+
+		m_GrainTuner.Record(callsite, count, chunks, work_ns, overhead_ns);
+	}
+
+	virtual void SetGrainTuning(float target_overhead_ratio)
+	{
+		m_GrainTuner.SetTargetRatio(target_overhead_ratio);
+	}
+
+	virtual size_t GetTunedGrainSize(uint64_t callsite)
+	{
+		return m_GrainTuner.PeekGrain(callsite);
+	}
+
+	virtual bool SaveGrainTable(const char *filename)
+	{
+		return m_GrainTuner.Save(filename);
+	}
+
+	virtual bool LoadGrainTable(const char *filename)
+	{
+		return m_GrainTuner.Load(filename);
+	}
+
+	virtual void ParallelDo(ITEM_CALLBACK func, void *param0, void *param1, void *const *items, size_t count)
+	{
+		if (!func || !items || !count)
+			return;
+
+		// items are pushed as they are discovered, so every worker is invited to help regardless of count
+		size_t helpers = m_hThreads.size();
 
-protected:
+		SParallelDoJob *job = new SParallelDoJob(helpers + 1);
+		job->m_Func = func;
+		job->m_Param[0] = param0;
+		job->m_Param[1] = param1;
+		job->m_Outstanding = 0;
+		job->m_Available = 0;
+		job->m_NumIdle = 0;
+		job->m_RefCount = (LONG)(helpers + 1);
 
-	__declspec(align(32)) struct STaskInfo
+		// deal the initial items out to the bags in contiguous runs
+		for (size_t i = 0; i < count; i++)
+			job->Push((i * job->m_NumBags) / count, items[i]);
+
+		if (helpers)
+			RunHelperTasks(_ParallelDoHelper, job, _ReleaseParallelDoJob, helpers);
+
+		ParticipateInParallelDo(job);
+
+		job->Release();
+	}
+
+	virtual void ParallelMemcpy(void *dst, const void *src, size_t size, bool nontemporal = false)
 	{
-		STaskInfo(TASK_CALLBACK task, void *param0, void *param1, size_t task_number, volatile LONG *pactionref) :
-			m_pActionRef(pactionref), m_Task(task)
+		if (size < PARALLEL_MEMORY_THRESHOLD)
 		{
-			m_Param[0] = param0;
-			m_Param[1] = param1;
-			m_TaskNumber = task_number;
+			memcpy(dst, src, size);
+			return;
+		}
 
-			if (m_pActionRef)
-			{
-				InterlockedIncrement(m_pActionRef);
-			}
+		SMemoryJob job(dst, src, size);
+		job.m_NonTemporal = nontemporal;
+
+		RunParallelFor(_MemcpyRange, &job, nullptr, job.m_NumPages, job.m_Grain, true);
+	}
+
+	virtual void ParallelMemset(void *dst, int value, size_t size)
+	{
+		if (size < PARALLEL_MEMORY_THRESHOLD)
+		{
+			memset(dst, value, size);
+			return;
 		}
 
-		// This is the number of active tasks, used for blocking
-		volatile LONG *m_pActionRef;
+		SMemoryJob job(dst, nullptr, size);
+		job.m_Value = value;
 
-		// The function that the thread should be running
-		TASK_CALLBACK m_Task;
+		RunParallelFor(_MemsetRange, &job, nullptr, job.m_NumPages, job.m_Grain, true);
+	}
 
-		// The parameter given to the thread function
-		void *m_Param[2];
-		size_t m_TaskNumber;
-	};
+	virtual int ParallelMemcmp(const void *buf1, const void *buf2, size_t size)
+	{
+		if (size < PARALLEL_MEMORY_THRESHOLD)
+			return memcmp(buf1, buf2, size);
 
-	typedef std::queue<STaskInfo> TTaskQueue;
+		SMemoryJob job((void *)buf1, buf2, size);
+		job.m_FirstDiff = SIZE_MAX;
+		job.m_Result.resize(job.GetNumChunks(), 0);
 
-	TTaskQueue m_TaskQueue;
+		RunParallelFor(_MemcmpRange, &job, nullptr, job.m_NumPages, job.m_Grain, true);
 
-	std::mutex m_mutexTaskList;
+		size_t first = job.m_FirstDiff.load();
+		return (first != SIZE_MAX) ? job.m_Result[first] : 0;
+	}
 
-	bool GetNextTask(STaskInfo &task)
+	virtual uint32_t ParallelCRC32C(const void *data, size_t size, uint32_t crc = 0)
 	{
-		// lock the queue
-		std::lock_guard<std::mutex> l(m_mutexTaskList);
+		if (size < PARALLEL_MEMORY_THRESHOLD)
+			return ComputeCRC32C(crc, data, size);
 
-		// return a task if one is available
-		if (!m_TaskQueue.empty())
-		{
-			task = m_TaskQueue.front();
-			m_TaskQueue.pop();
-			return true;
-		}
+		SMemoryJob job((void *)data, nullptr, size);
+		job.m_CRC.resize(job.GetNumChunks(), 0);
+		job.m_Length.resize(job.GetNumChunks(), 0);
 
-		return false;
+		RunParallelFor(_CRC32CRange, &job, nullptr, job.m_NumPages, job.m_Grain, true);
+
+		for (size_t i = 0; i < job.m_CRC.size(); i++)
+			crc = CombineCRC32C(crc, job.m_CRC[i], job.m_Length[i]);
+
+		return crc;
 	}
 
-	void WorkerThreadProc()
+	virtual void GetLoadInfo(LOAD_INFO &info)
 	{
-		while (true)
-		{
-			// wait until told to run or quit
-			DWORD waitret = WaitForMultipleObjects(TS_NUMSEMAPHORES, m_hSemaphores, false, INFINITE) - WAIT_OBJECT_0;
-			if (waitret == TS_QUIT)
-				break;
+		m_Load.GetInfo(info);
+	}
 
-			STaskInfo task(nullptr, nullptr, nullptr, 0, nullptr);
-			while (true)
-			{
-				if (!GetNextTask(task))
-					break;
+	virtual void SetLoadSmoothing(uint32_t milliseconds)
+	{
+		m_Load.SetTimeConstant(milliseconds);
+	}
 
-				TASK_RETURN ret;
+	virtual uint32_t SubscribeLoad(LOAD_SIGNAL signal, double threshold, LOAD_CALLBACK func, void *userdata = nullptr)
+	{
+		return m_Load.Subscribe(signal, threshold, func, userdata);
+	}
 
-				// run the task as long as it keeps telling us to re-run
-				do
-				{
-					ret = task.m_Task(task.m_Param[0], task.m_Param[1], task.m_TaskNumber);
-				}
-				while (ret == TASK_RETURN::TR_RERUN);
+	virtual bool UnsubscribeLoad(uint32_t id)
+	{
+		return m_Load.Unsubscribe(id);
+	}
 
-				// if we need to re-queue it, do that now
-				if (ret == TASK_RETURN::TR_REQUEUE)
-				{
-					m_mutexTaskList.lock();
+	virtual ITaskGroup *CreateTaskGroup()
+	{
+		return new CTaskGroup(this);
+	}
 
-					m_TaskQueue.push(task);
+	virtual ICompletionPort *CreateCompletionPort(size_t capacity)
+	{
+		return new CCompletionPort(capacity);
+	}
 
-					m_mutexTaskList.unlock();
+	virtual ITaskScope *CreateScope(ITaskScope *parent)
+	{
+		return new CTaskScope(this, parent ? (CTaskScope *)parent : GetCurrentTaskScope());
+	}
 
-					if (m_hSemaphores[TS_RUN])
-						ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)m_hThreads.size(), NULL);
-				}
-				// otherwise, indicate that the action has completed
-				else if (task.m_pActionRef)
-				{
-					InterlockedDecrement(task.m_pActionRef);
-				}
+	virtual ITaskScope *GetCurrentScope()
+	{
+		return GetCurrentTaskScope();
+	}
 
-				Sleep(0);
-			}
-		}
+	virtual void SetPipelineDepth(size_t depth)
+	{
+		m_PipelineDepth = depth;
 	}
 
-	static void _WorkerThreadProc(CThreadPool *param)
+	virtual void RegisterBatchHandler(TASK_CALLBACK func, BATCH_CALLBACK handler, size_t max_batch = 64)
 	{
-		CThreadPool *_this = (CThreadPool *)param;
-		_this->WorkerThreadProc();
+		if (!func)
+			return;
+
+		std::lock_guard<std::mutex> l(m_mutexBatchHandlers);
+
+		if (handler)
+		{
+			SBatchHandler &bh = m_BatchHandlers[func];
+			bh.m_Handler = handler;
+			bh.m_MaxBatch = std::max<size_t>(1, max_batch);
+		}
+		else
+		{
+			m_BatchHandlers.erase(func);
+		}
+
+		m_NumBatchHandlers = m_BatchHandlers.size();
 	}
 
-	// the actual thread handles... keep them separated from SThreadInfo
-	// so we can wait on them.
-	std::vector<std::thread> m_hThreads;
+	virtual size_t GetCurrentWorkerIndex()
+	{
+		return GetCurrentThreadSlot();
+	}
 
-	enum
+	virtual uint32_t AddIdleHook(IDLE_CALLBACK func, void *userdata = nullptr)
 	{
-		TS_QUIT = 0,		// indicates it's time for a thread to shut down
-		TS_RUN,				// indicates that the thread should start running the function given
+		if (!func)
+			return 0;
 
-		TS_NUMSEMAPHORES
-	};
+		std::lock_guard<std::mutex> l(m_mutexIdleHooks);
 
-	sem_t m_hSemaphores[TS_NUMSEMAPHORES];
+		SIdleHook h;
+		h.m_ID = m_NextIdleHookID++;
+		h.m_Func = func;
+		h.m_UserData = userdata;
+		m_IdleHooks.push_back(h);
 
-public:
+		m_NumIdleHooks = m_IdleHooks.size();
 
-	void Initialize(size_t thread_count)
+		return h.m_ID;
+	}
+
+	virtual bool RemoveIdleHook(uint32_t id)
 	{
-		memset(m_hSemaphores, 0, sizeof(HANDLE) * TS_NUMSEMAPHORES);
+		std::lock_guard<std::mutex> l(m_mutexIdleHooks);
 
-		if (thread_count)
+		for (auto it = m_IdleHooks.begin(); it != m_IdleHooks.end(); it++)
 		{
-			m_hThreads.resize(thread_count);
+			if (it->m_ID != id)
+				continue;
 
-			// create the run and quit semaphore...
-#if defined(_WIN32)
-			m_hSemaphores[TS_QUIT] = CreateSemaphore(NULL, 0, (LONG)m_hThreads.size(), NULL);
-			m_hSemaphores[TS_RUN] = CreateSemaphore(NULL, 0, (LONG)m_hThreads.size(), NULL);
-#elif defined(__linux__)
-			sem_init(&m_hSemaphores[TS_QUIT], 0, m_hThreads.size());
-			sem_init(&m_hSemaphores[TS_QUIT], 0, m_hThreads.size());
-#endif
+			m_IdleHooks.erase(it);
+			m_NumIdleHooks = m_IdleHooks.size();
 
-			for (size_t i = 0; i < m_hThreads.size(); i++)
-			{
-				m_hThreads[i] = std::thread(_WorkerThreadProc, this);
-			}
+			return true;
 		}
+
+		return false;
 	}
 
-	CThreadPool(size_t threads_per_core, int core_count_adjustment)
+	virtual void SetFaultInjection(const FAULT_INJECTION *config)
 	{
-		// Find out how many cores the system has
-		SYSTEM_INFO sysinfo;
-		GetSystemInfo(&sysinfo);
+		m_Faults.SetConfig(config);
+	}
 
-		// Calculate the number of threads we need and allocate thread handles
-		Initialize(threads_per_core * (size_t)std::max<int>(1, (sysinfo.dwNumberOfProcessors + core_count_adjustment)));
+	virtual void SetLatencyTracking(bool enable)
+	{
+		m_Latency.Enable(enable);
 	}
 
-	CThreadPool(size_t thread_count)
+	virtual void GetLatencyStats(LATENCY_STATS &stats)
 	{
-		Initialize(thread_count);
+		m_Latency.GetStats(stats);
 	}
 
-	virtual ~CThreadPool()
+	virtual bool ShouldYield()
 	{
-		if (m_hThreads.size())
+		// if a worker is free, it'll get to the urgent work without our help
+		if (m_Load.GetBusyCount() < m_CpuMonitor.GetActiveWorkers())
+			return false;
+
+		for (int p = s_CurrentPriority + 1; p < TP_NUMPRIORITIES; p++)
 		{
-			PurgeAllPendingTasks();
+			if (m_NumQueued[p].load(std::memory_order_relaxed))
+				return true;
 
-#if defined(_WIN32)
-			ReleaseSemaphore(m_hSemaphores[TS_QUIT], (LONG)m_hThreads.size(), NULL);
-#elif defined(__linux__)
-#endif
+			if ((p == TP_NORMAL) && m_NumLocal.load(std::memory_order_relaxed))
+				return true;
+		}
 
-			for (size_t i = 0; i < m_hThreads.size(); i++)
-			{
-				m_hThreads[i].join();
-			}
+		return false;
+	}
 
-#if defined(_WIN32)
-			CloseHandle(m_hSemaphores[TS_QUIT]);
-			CloseHandle(m_hSemaphores[TS_RUN]);
-#elif defined(__linux__)
-			sem_destroy(&m_hSemaphores[TS_QUIT]);
-			sem_destroy(&m_hSemaphores[TS_RUN]);
-#endif
-		}
+	virtual ITaskGroup *RunOnWorker(size_t worker_index, TASK_CALLBACK func, void *param0, void *param1)
+	{
+		return RunOnWorkers(worker_index, worker_index + 1, func, param0, param1);
+	}
 
-		memset(m_hSemaphores, 0, sizeof(HANDLE) * TS_NUMSEMAPHORES);
+	virtual ITaskGroup *Broadcast(TASK_CALLBACK func, void *param0, void *param1)
+	{
+		return RunOnWorkers(0, m_hThreads.size(), func, param0, param1);
 	}
 
-	virtual void Release()
+	virtual uint64_t GetInversionCount()
 	{
-		delete this;
+		return m_NumInversions.load();
 	}
 
-	// the number of worker threads in the pool
-	virtual size_t GetNumThreads()
+	virtual void SetQueueStrategy(QUEUE_STRATEGY strategy)
 	{
-		return (UINT)m_hThreads.size();
+		if ((strategy < QS_GLOBAL) || (strategy >= QS_NUMSTRATEGIES))
+			return;
+
+		m_QueueStrategy = strategy;
+
+		if (strategy != QS_ADAPTIVE)
+			SetDistributed(strategy == QS_DISTRIBUTED);
 	}
 
-	virtual bool RunTask(TASK_CALLBACK func, void *param0 = nullptr, void *param1 = nullptr, size_t numtimes = 1, bool block = false)
+	virtual void SetQueuePolicy(TASK_PRIORITY priority, const QUEUE_POLICY &policy)
 	{
-		// if blocking is desired, blockwait will be incremented by each STaskInfo
-		volatile LONG blockwait = 0;
+		if ((priority < TP_LOW) || (priority >= TP_NUMPRIORITIES) || (policy.order < QO_FIFO) || (policy.order >= QO_NUMORDERS))
+			return;
 
-		{
-			std::lock_guard<std::mutex> l(m_mutexTaskList);
+		std::lock_guard<std::mutex> l(m_mutexTaskList);
 
-			for (size_t i = 0; i < numtimes; i++)
-			{
-				m_TaskQueue.push(STaskInfo(func, param0, param1, i, block ? &blockwait : nullptr));
-			}
-		}
+		SQueuePolicyState &qp = m_QueuePolicy[priority];
+		qp.m_Policy = policy;
+		qp.m_AboveSinceNS = 0;
 
-		// tell the threads to run tasks
-		if (m_hSemaphores[TS_RUN])
-			ReleaseSemaphore(m_hSemaphores[TS_RUN], (LONG)m_hThreads.size(), nullptr);
+		UpdateQueueOrderLocked(priority);
+	}
 
-		// if we wanted to block, then wait until all of the tasks have completed (ie., wait until blockwait is 0 again)
-		if (m_hThreads.size() && block)
-		{
-			while (blockwait)
-			{
-				Sleep(10);
-			}
-		}
+	virtual void GetQueuePolicyStats(TASK_PRIORITY priority, QUEUE_POLICY_STATS &stats)
+	{
+		if ((priority < TP_LOW) || (priority >= TP_NUMPRIORITIES))
+			return;
 
-		return true;
+		std::lock_guard<std::mutex> l(m_mutexTaskList);
+
+		const SQueuePolicyState &qp = m_QueuePolicy[priority];
+		stats.lifo = qp.m_Lifo;
+		stats.switches = qp.m_Switches;
+		stats.lifo_tasks = qp.m_LifoTasks;
 	}
 
-	virtual void WaitForAllTasks(uint32_t milliseconds)
+	virtual void SetQueueManagement(const QUEUE_MANAGEMENT *config)
 	{
-		if (m_hThreads.size())
-		{
-			while (!m_TaskQueue.empty())
-			{
-				Sleep(0);
-			}
-		}
-		else
-		{
-			Flush();
-		}
+		m_CoDel.Configure(config);
 	}
 
-	virtual void PurgeAllPendingTasks()
+	virtual uint64_t GetDropCount()
 	{
-		std::lock_guard<std::mutex> l(m_mutexTaskList);
+		return m_CoDel.GetNumDropped();
+	}
+
+	virtual bool GetSchedulingStats(SCHEDULING_STATS &stats, size_t worker_index)
+	{
+		uint64_t run_ns, delay_ns;
+		m_CpuMonitor.GetTotals(worker_index, stats.involuntary_switches, run_ns, delay_ns);
+
+		stats.run_time = (double)run_ns / 1e9;
+		stats.run_delay = (double)delay_ns / 1e9;
+		stats.delay_ratio = m_CpuMonitor.GetDelayRatio();
+		stats.switch_rate = m_CpuMonitor.GetSwitchRate();
+		stats.active_workers = m_CpuMonitor.GetActiveWorkers();
 
-		// clear the queue (there is no .clear() method, so this is the way)
-		m_TaskQueue = { };
+		return COversubscriptionMonitor::IsSupported() && (worker_index <= m_hThreads.size());
 	}
 
-	virtual void Flush()
+	virtual void SetOversubscriptionControl(bool enable)
+	{
+		m_CpuMonitor.EnableControl(enable);
+	}
+
+	virtual bool SetPressureControl(const PRESSURE_CONTROL *control)
+	{
+		return m_Pressure.Configure(control, OnPressureRelief, this);
+	}
+
+	virtual void GetPressureStats(PRESSURE_STATS &stats)
+	{
+		m_Pressure.GetStats(stats);
+
+		stats.deferred = m_NumPressureDeferred.load();
+		stats.throttled = m_NumThrottled.load();
+	}
+
+	virtual void GetQueueStats(QUEUE_STATS &stats)
+	{
+		stats.strategy = m_QueueStrategy.load();
+		stats.distributed = m_Distributed.load();
+		stats.switches = m_QueueMonitor.GetNumSwitches();
+		stats.contention = m_QueueMonitor.GetContention();
+		stats.steal_rate = m_QueueMonitor.GetStealRate();
+	}
+
+	virtual ITaskGroup *GetEpochGroup(uint64_t epoch)
 	{
+		if (!epoch)
+			return nullptr;
+
 		std::lock_guard<std::mutex> l(m_mutexTaskList);
 
-		while (!m_TaskQueue.empty())
-		{
-			STaskInfo &t = m_TaskQueue.front();
-			t.m_Task(t.m_Param[0], t.m_Param[1], t.m_TaskNumber);
+		CTaskGroup *group = GetEpochLocked(epoch).m_pGroup;
+		group->AddRef();
 
-			if (t.m_pActionRef)
-			{
-				InterlockedDecrement(t.m_pActionRef);
-			}
+		return group;
+	}
+};
+
+thread_local CThreadPool *CThreadPool::s_pCurrentPool = nullptr;
+thread_local size_t CThreadPool::s_CurrentThreadIndex = 0;
+thread_local IThreadPool::TASK_PRIORITY CThreadPool::s_CurrentPriority = IThreadPool::TP_NORMAL;
+thread_local CTaskScope *CThreadPool::s_pCurrentScope = nullptr;
+thread_local size_t CThreadPool::s_FlushDepth = 0;
+
+bool CTaskGroup::Wait(uint32_t milliseconds)
+{
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+
+	bool help = m_pPool->ShouldHelpWhileWaiting();
+
+	if (IsComplete())
+		return true;
 
-			m_TaskQueue.pop();
+	// lend the group's tasks our priority while we wait, so that a group submitted at a lower priority
+	// doesn't sit behind other work while something more important is stuck waiting for it; only the group's
+	// own tasks are moved, and nothing at all if we're not above the lowest priority they were submitted at
+	IThreadPool::TASK_PRIORITY priority = CThreadPool::s_CurrentPriority;
+	bool boost = (priority > m_LowestPriority.load());
+	if (boost && m_Boost.Raise(priority))
+		m_pPool->RebalanceQueues(this);
+
+	bool ret = true;
+
+	while (!IsComplete())
+	{
+		if ((milliseconds != INFINITE) && (std::chrono::steady_clock::now() >= deadline))
+		{
+			ret = false;
+			break;
 		}
+
+		// workers that wait would otherwise hold up the very tasks they're waiting for
+		if (help && m_pPool->HelpRunTasks())
+			continue;
+
+		std::unique_lock<std::mutex> l(m_mutexWait);
+
+		if (help)
+			m_cvWait.wait_for(l, std::chrono::milliseconds(1), [this]() { return IsComplete(); });
+		else if (milliseconds == INFINITE)
+			m_cvWait.wait(l, [this]() { return IsComplete(); });
+		else
+			m_cvWait.wait_until(l, deadline, [this]() { return IsComplete(); });
 	}
-};
+
+	// whatever is left (if we gave up) goes back to its own priority
+	if (boost && m_Boost.Lower(priority) && !IsComplete())
+		m_pPool->RebalanceQueues(this);
+
+	return ret;
+}
+
+bool CTaskScope::Spawn(IThreadPool::TASK_CALLBACK func, void *param0, void *param1, size_t numtimes)
+{
+	IThreadPool::TASK_ATTRIBUTES attr;
+	attr.scope = this;
+
+	return m_pPool->RunTaskEx(attr, func, param0, param1, numtimes);
+}
+
+void CTaskGroup::GetMakespan(MAKESPAN_INFO &info)
+{
+	uint64_t first = m_FirstStartNS.load(), last = m_LastEndNS.load();
+
+	info.threads = std::max<size_t>(1, m_pPool->GetNumThreads());
+	info.makespan = (last > first) ? ((double)(last - first) / 1e9) : 0.0;
+	info.total_work = (double)m_WorkNS.load() / 1e9;
+	info.longest_task = (double)m_LongestNS.load() / 1e9;
+
+	// no schedule can beat perfectly even division of the work, nor the longest single task
+	info.lower_bound = std::max<double>(info.total_work / (double)info.threads, info.longest_task);
+}
 
 // Creates a pool with the number of threads based on the cores in the machine, given by:
 //   threads_per_core * max(1, (core_count + core_count_adjustment))
@@ -339,3 +3753,9 @@ IThreadPool *IThreadPool::Create(size_t thread_count)
 {
 	return new CThreadPool(thread_count);
 }
+
+// Creates a pool with the designated number of threads, which call on_start and on_exit as they start and exit
+IThreadPool *IThreadPool::Create(size_t thread_count, THREAD_CALLBACK on_start, THREAD_CALLBACK on_exit, void *userdata)
+{
+	return new CThreadPool(thread_count, on_start, on_exit, userdata);
+}
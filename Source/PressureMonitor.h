@@ -0,0 +1,297 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include <Pool.h>
+
+
+// Watches the kernel's pressure stall information (PSI) for memory, CPU and IO. For each resource with a threshold,
+// a trigger is registered on /proc/pressure/<resource> so that the kernel wakes the monitor's thread as soon as tasks
+// have stalled for more than stall_us in a window_us window; if triggers aren't allowed, the thread polls the 10 second
+// averages instead. Pressure counts as over once every watched resource's 10 second average is below release_percent
+// and no trigger has fired for a whole window. PSI only exists on Linux; elsewhere Configure fails
+class CPressureMonitor
+{
+
+public:
+
+	typedef pool::IThreadPool::PRESSURE_CONTROL PRESSURE_CONTROL;
+	typedef pool::IThreadPool::PRESSURE_STATS PRESSURE_STATS;
+
+	// Called from the monitor's thread when the pressure is over
+	typedef void (*RELIEF_CALLBACK)(void *userdata);
+
+protected:
+
+	static const size_t NUM_RESOURCES = pool::IThreadPool::PR_NUMRESOURCES;
+
+	PRESSURE_CONTROL m_Control;
+
+	std::atomic<bool> m_Enabled;
+	std::atomic<bool> m_UnderPressure;
+	std::atomic<size_t> m_MaxSensitive;
+
+	std::atomic<float> m_Avg10[NUM_RESOURCES];
+	std::atomic<uint64_t> m_Episodes;
+
+	RELIEF_CALLBACK m_pReliefFunc;
+	void *m_pReliefData;
+
+	std::thread m_Thread;
+	std::atomic<bool> m_Quit;
+
+	// serializes Configure calls
+	std::mutex m_mutexConfig;
+
+	// how often the averages are read
+	static const int POLL_MS = 250;
+
+	static inline uint64_t GetTimeNS()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static const char *GetPath(size_t resource)
+	{
+		static const char *path[NUM_RESOURCES] = {"/proc/pressure/memory", "/proc/pressure/cpu", "/proc/pressure/io"};
+		return path[resource];
+	}
+
+	// Reads the "some" 10 second average, as a percentage, or returns false if the resource isn't there
+	static bool ReadAvg10(size_t resource, float &avg10)
+	{
+		FILE *f = fopen(GetPath(resource), "r");
+		if (!f)
+			return false;
+
+		bool ret = (fscanf(f, "some avg10=%f", &avg10) == 1);
+		fclose(f);
+
+		return ret;
+	}
+
+	void ThreadProc()
+	{
+#if defined(__linux__)
+		struct pollfd fds[NUM_RESOURCES];
+		size_t resource[NUM_RESOURCES];
+		nfds_t nfds = 0;
+
+		bool watched[NUM_RESOURCES];
+		float threshold[NUM_RESOURCES];
+		uint64_t last_event[NUM_RESOURCES];
+
+		uint64_t window_ns = (uint64_t)m_Control.window_us * 1000;
+
+		for (size_t r = 0; r < NUM_RESOURCES; r++)
+		{
+			watched[r] = (m_Control.stall_us[r] != 0);
+			threshold[r] = m_Control.window_us ? (100.0f * (float)m_Control.stall_us[r] / (float)m_Control.window_us) : 100.0f;
+			last_event[r] = 0;
+
+			if (!watched[r])
+				continue;
+
+			int fd = open(GetPath(r), O_RDWR | O_NONBLOCK);
+			if (fd < 0)
+				continue;
+
+			// the string written includes its terminator
+			char trigger[64];
+			int len = snprintf(trigger, sizeof(trigger), "some %u %u", m_Control.stall_us[r], m_Control.window_us);
+			if (write(fd, trigger, (size_t)len + 1) < 0)
+			{
+				close(fd);
+				continue;
+			}
+
+			fds[nfds].fd = fd;
+			fds[nfds].events = POLLPRI;
+			resource[nfds] = r;
+			nfds++;
+		}
+
+		while (!m_Quit.load())
+		{
+			int n = poll(fds, nfds, POLL_MS);
+
+			uint64_t now = GetTimeNS();
+			bool pressure = false;
+
+			for (nfds_t i = 0; (n > 0) && (i < nfds); i++)
+			{
+				if (fds[i].revents & POLLPRI)
+					last_event[resource[i]] = now;
+			}
+
+			for (size_t r = 0; r < NUM_RESOURCES; r++)
+			{
+				if (!watched[r])
+					continue;
+
+				float avg10 = 0.0f;
+				if (!ReadAvg10(r, avg10))
+					continue;
+
+				m_Avg10[r].store(avg10);
+
+				// a trigger that fired within the last window counts, as does an average over the threshold (which is
+				// all there is without triggers)... and once under pressure, the average has to come down all the way
+				if ((last_event[r] && ((now - last_event[r]) < window_ns)) || (avg10 >= threshold[r]))
+					pressure = true;
+				else if (m_UnderPressure.load() && (avg10 >= m_Control.release_percent))
+					pressure = true;
+			}
+
+			if (pressure && !m_UnderPressure.load())
+			{
+				m_Episodes.fetch_add(1);
+
+				m_UnderPressure = true;
+			}
+			else if (!pressure && m_UnderPressure.load())
+			{
+				m_UnderPressure = false;
+
+				if (m_pReliefFunc)
+					m_pReliefFunc(m_pReliefData);
+			}
+		}
+
+		for (nfds_t i = 0; i < nfds; i++)
+			close(fds[i].fd);
+#endif
+	}
+
+	void Stop()
+	{
+		if (!m_Thread.joinable())
+			return;
+
+		m_Quit = true;
+		m_Thread.join();
+
+		bool was = m_UnderPressure.exchange(false);
+		m_Enabled = false;
+
+		if (was && m_pReliefFunc)
+			m_pReliefFunc(m_pReliefData);
+	}
+
+public:
+
+	CPressureMonitor()
+	{
+		m_Enabled = false;
+		m_UnderPressure = false;
+		m_MaxSensitive = 0;
+		m_Episodes = 0;
+		m_Quit = false;
+
+		for (size_t r = 0; r < NUM_RESOURCES; r++)
+			m_Avg10[r] = 0.0f;
+
+		m_pReliefFunc = nullptr;
+		m_pReliefData = nullptr;
+	}
+
+	~CPressureMonitor()
+	{
+		Stop();
+	}
+
+	static bool IsSupported()
+	{
+		float avg10;
+		return ReadAvg10(pool::IThreadPool::PR_MEMORY, avg10) || ReadAvg10(pool::IThreadPool::PR_CPU, avg10) || ReadAvg10(pool::IThreadPool::PR_IO, avg10);
+	}
+
+	// Starts watching with the given settings, or stops if control is nullptr; func is called when pressure is over
+	bool Configure(const PRESSURE_CONTROL *control, RELIEF_CALLBACK func, void *userdata)
+	{
+		std::lock_guard<std::mutex> l(m_mutexConfig);
+
+		Stop();
+
+		if (!control)
+			return true;
+
+		if (!IsSupported())
+			return false;
+
+		m_Control = *control;
+		m_MaxSensitive = control->max_sensitive;
+		m_pReliefFunc = func;
+		m_pReliefData = userdata;
+
+		m_Quit = false;
+		m_Enabled = true;
+		m_Thread = std::thread(&CPressureMonitor::ThreadProc, this);
+
+		return true;
+	}
+
+	bool IsEnabled() const
+	{
+		return m_Enabled.load(std::memory_order_relaxed);
+	}
+
+	bool IsUnderPressure() const
+	{
+		return m_UnderPressure.load(std::memory_order_relaxed);
+	}
+
+	size_t GetMaxSensitive() const
+	{
+		return m_MaxSensitive.load(std::memory_order_relaxed);
+	}
+
+	// Fills in everything but the task counts, which the pool keeps
+	void GetStats(PRESSURE_STATS &stats) const
+	{
+		stats.under_pressure = m_UnderPressure.load();
+		stats.episodes = m_Episodes.load();
+
+		for (size_t r = 0; r < NUM_RESOURCES; r++)
+			stats.avg10[r] = m_Avg10[r].load();
+	}
+};
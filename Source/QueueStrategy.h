@@ -0,0 +1,173 @@
+/*
+	Pool, a thread-pooled asynchronous job library
+
+	Copyright © 2009-2022, Keelan Stuart. All rights reserved.
+
+	MIT License
+
+	Permission is hereby granted, free of charge, to any person
+	obtaining a copy of this software and associated documentation
+	files (the "Software"), to deal in the Software without restriction,
+	including without limitation the rights to use, copy, modify, merge,
+	publish, distribute, sublicense, and/or sell copies of the Software,
+	and to permit persons to whom the Software is furnished to do so,
+	subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be
+	included in all copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+	EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+	MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+	IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+	CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+	TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+	SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+
+// Decides whether the pool should dispatch through its one shared queue or through per-worker queues, from
+// how often the shared queue's lock is found taken and how often workers have to steal from each other.
+// A shared queue is best for a few big tasks (strict FIFO, nothing to balance), per-worker queues for floods
+// of small ones (no single lock for everybody to fight over). Like the load monitor, whichever thread passes
+// a task boundary once the window has elapsed does the evaluation; everyone else just bumps counters
+class CQueueStrategyMonitor
+{
+
+protected:
+
+	std::atomic<uint64_t> m_Locks;
+	std::atomic<uint64_t> m_ContendedLocks;
+	std::atomic<uint64_t> m_LocalTakes;
+	std::atomic<uint64_t> m_Steals;
+
+	std::atomic<uint64_t> m_WindowStartNS;
+	std::atomic<uint64_t> m_LastSwitchNS;
+	std::atomic<uint64_t> m_NumSwitches;
+
+	// the ratios measured over the last complete window
+	std::atomic<float> m_Contention;
+	std::atomic<float> m_StealRate;
+
+	std::mutex m_mutexUpdate;
+
+	// how long each measurement window lasts
+	static const uint64_t WINDOW_NS = 10000000;
+
+	// how long to stick with a strategy after switching to it, so that it doesn't flap
+	static const uint64_t MIN_DWELL_NS = 100000000;
+
+	// windows with fewer events than this don't say much, and mean the load is light
+	static const uint64_t MIN_EVENTS = 256;
+
+	// switch to per-worker queues when more than this fraction of the shared lock's acquisitions had to wait...
+	static constexpr float CONTENTION_HIGH = 0.2f;
+
+	// ...and back when more than this fraction of the tasks taken from them were stolen
+	static constexpr float STEAL_HIGH = 0.5f;
+
+	static inline uint64_t GetTimeNS()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+public:
+
+	CQueueStrategyMonitor()
+	{
+		m_Locks = 0;
+		m_ContendedLocks = 0;
+		m_LocalTakes = 0;
+		m_Steals = 0;
+
+		m_WindowStartNS = GetTimeNS();
+		m_LastSwitchNS = 0;
+		m_NumSwitches = 0;
+
+		m_Contention = 0.0f;
+		m_StealRate = 0.0f;
+	}
+
+	// Called each time the shared queue's lock is taken; contended is true if somebody else had it
+	void OnLock(bool contended)
+	{
+		m_Locks.fetch_add(1, std::memory_order_relaxed);
+
+		if (contended)
+			m_ContendedLocks.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Called each time a worker takes tasks from a per-worker queue; stolen is true if it wasn't its own
+	void OnTake(bool stolen)
+	{
+		m_LocalTakes.fetch_add(1, std::memory_order_relaxed);
+
+		if (stolen)
+			m_Steals.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void OnSwitched()
+	{
+		m_LastSwitchNS.store(GetTimeNS(), std::memory_order_relaxed);
+		m_NumSwitches.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Closes the measurement window if it has elapsed; returns true, with the strategy that should be in use
+	// in distributed, if there was a decision to make
+	bool Evaluate(bool &distributed)
+	{
+		uint64_t now = GetTimeNS();
+
+		if ((now - m_WindowStartNS.load(std::memory_order_relaxed)) < WINDOW_NS)
+			return false;
+
+		std::unique_lock<std::mutex> l(m_mutexUpdate, std::try_to_lock);
+		if (!l.owns_lock() || ((now - m_WindowStartNS.load(std::memory_order_relaxed)) < WINDOW_NS))
+			return false;
+
+		m_WindowStartNS.store(now, std::memory_order_relaxed);
+
+		uint64_t locks = m_Locks.exchange(0, std::memory_order_relaxed);
+		uint64_t contended = m_ContendedLocks.exchange(0, std::memory_order_relaxed);
+		uint64_t takes = m_LocalTakes.exchange(0, std::memory_order_relaxed);
+		uint64_t steals = m_Steals.exchange(0, std::memory_order_relaxed);
+
+		float contention = locks ? ((float)contended / (float)locks) : 0.0f;
+		float steal_rate = takes ? ((float)steals / (float)takes) : 0.0f;
+
+		m_Contention.store(contention, std::memory_order_relaxed);
+		m_StealRate.store(steal_rate, std::memory_order_relaxed);
+
+		if ((now - m_LastSwitchNS.load(std::memory_order_relaxed)) < MIN_DWELL_NS)
+			return false;
+
+		if (!distributed)
+			distributed = ((locks >= MIN_EVENTS) && (contention > CONTENTION_HIGH));
+		else
+			distributed = ((takes >= MIN_EVENTS) && (steal_rate <= STEAL_HIGH));
+
+		return true;
+	}
+
+	float GetContention() const
+	{
+		return m_Contention.load(std::memory_order_relaxed);
+	}
+
+	float GetStealRate() const
+	{
+		return m_StealRate.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetNumSwitches() const
+	{
+		return m_NumSwitches.load(std::memory_order_relaxed);
+	}
+};
@@ -0,0 +1,455 @@
+// Regression tests for the parts of the pool that are easy to get wrong: scopes, load accounting, pressure control,
+// yielding, data dependencies and completion ports
+//
+// Usage: PoolTests
+// Prints each check that fails and returns the number of failures, so 0 means everything passed
+// WaitForAllTasks only waits for the queue to empty, so tests that need their tasks finished wait on a group
+
+#include <windows.h>
+#include <Pool.h>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace pool;
+
+static int s_Failures = 0;
+
+#define CHECK(cond)		{ if (!(cond)) { printf("FAILED: %s (%s:%d)\n", #cond, __FILE__, __LINE__); s_Failures++; } }
+
+// Runs tasks until the load monitor has caught up; the busy count drops when a task's bookkeeping is done, which can
+// be just after the task's group or scope completes
+static size_t GetSettledBusyCount(IThreadPool *ppool)
+{
+	IThreadPool::LOAD_INFO li;
+	for (int i = 0; i < 100; i++)
+	{
+		ppool->GetLoadInfo(li);
+		if (!li.busy_threads)
+			break;
+
+		Sleep(10);
+	}
+
+	return li.busy_threads;
+}
+
+
+// Scopes: leaving waits for the whole tree, cancelling reaches nested scopes and stops tasks that would run again
+
+static IThreadPool *s_pScopePool;
+static std::atomic<int> s_ScopeRan;
+static std::atomic<int> s_ScopeReruns;
+
+IThreadPool::TASK_RETURN __cdecl ScopeLeaf(void *param0, void *param1, size_t task_number)
+{
+	s_ScopeRan++;
+	return IThreadPool::TR_OK;
+}
+
+// Spawns three more of itself, depth levels deep, into whatever scope it's running in
+IThreadPool::TASK_RETURN __cdecl ScopeFan(void *param0, void *param1, size_t task_number)
+{
+	s_ScopeRan++;
+
+	intptr_t depth = (intptr_t)param0;
+	if (depth > 0)
+		s_pScopePool->RunTask(ScopeFan, (void *)(depth - 1), nullptr, 3);
+
+	return IThreadPool::TR_OK;
+}
+
+// Opens a scope nested in its own and leaves it
+IThreadPool::TASK_RETURN __cdecl ScopeNested(void *param0, void *param1, size_t task_number)
+{
+	ITaskScope *pscope = s_pScopePool->CreateScope();
+	pscope->Spawn(ScopeLeaf, nullptr, nullptr, 5);
+	pscope->Leave();
+
+	return IThreadPool::TR_OK;
+}
+
+IThreadPool::TASK_RETURN __cdecl ScopeRerun(void *param0, void *param1, size_t task_number)
+{
+	s_ScopeReruns++;
+	Sleep(1);
+
+	return IThreadPool::TR_RERUN;
+}
+
+static void TestScopes(size_t threads)
+{
+	s_pScopePool = IThreadPool::Create(threads);
+	s_ScopeRan = 0;
+	s_ScopeReruns = 0;
+
+	// 1 + 3 + 9 + 27 fans, and 4 nested scopes of 5 leaves each
+	ITaskScope *pscope = s_pScopePool->CreateScope();
+	pscope->Spawn(ScopeFan, (void *)3, nullptr);
+	pscope->Spawn(ScopeNested, nullptr, nullptr, 4);
+	pscope->Leave();
+
+	CHECK(s_ScopeRan == 40 + 20);
+
+	ITaskScope *pparent = s_pScopePool->CreateScope();
+	ITaskScope *pchild = s_pScopePool->CreateScope(pparent);
+
+	pchild->Spawn(ScopeRerun);
+	pparent->Spawn(ScopeLeaf, nullptr, nullptr, 100);
+
+	if (threads)
+		Sleep(20);
+
+	pparent->Cancel();
+
+	CHECK(pchild->IsCancelled());
+	CHECK(!pchild->Spawn(ScopeLeaf));
+	CHECK(pparent->Wait(5000));
+	CHECK(!pparent->GetPendingCount());
+	CHECK(!pchild->GetPendingCount());
+
+	pchild->Leave();
+	pparent->Leave();
+
+	s_pScopePool->WaitForAllTasks(INFINITE);
+
+	CHECK(GetSettledBusyCount(s_pScopePool) == 0);
+
+	s_pScopePool->Release();
+}
+
+
+// Tasks that are cancelled before they run still have to be taken off the busy count
+
+static std::atomic<bool> s_Gate;
+static std::atomic<int> s_GateRan;
+
+IThreadPool::TASK_RETURN __cdecl GateBlocker(void *param0, void *param1, size_t task_number)
+{
+	while (!s_Gate.load())
+		Sleep(1);
+
+	return IThreadPool::TR_OK;
+}
+
+IThreadPool::TASK_RETURN __cdecl GateStep(void *param0, void *param1, size_t task_number)
+{
+	s_GateRan++;
+	return IThreadPool::TR_OK;
+}
+
+static void TestCancelledBusy(size_t threads)
+{
+	IThreadPool *ppool = IThreadPool::Create(threads);
+	s_Gate = false;
+	s_GateRan = 0;
+
+	// with a thread, hold it up so everything below is still queued when the scope is cancelled
+	if (threads)
+	{
+		ppool->RunTask(GateBlocker);
+		Sleep(50);
+	}
+
+	ITaskScope *pscope = ppool->CreateScope();
+	ITaskGroup *pgroup = ppool->CreateTaskGroup();
+
+	IThreadPool::TASK_ATTRIBUTES cancelled;
+	cancelled.scope = pscope;
+
+	IThreadPool::TASK_ATTRIBUTES kept;
+	kept.group = pgroup;
+
+	for (int i = 0; i < 50; i++)
+	{
+		ppool->RunTaskEx(cancelled, GateStep);
+		ppool->RunTaskEx(kept, GateStep);
+	}
+
+	pscope->Cancel();
+	s_Gate = true;
+
+	if (!threads)
+		ppool->Flush();
+
+	CHECK(pgroup->Wait(5000));
+	CHECK(pscope->Wait(5000));
+	CHECK(s_GateRan == 50);
+	CHECK(GetSettledBusyCount(ppool) == 0);
+
+	pgroup->Release();
+	pscope->Leave();
+	ppool->Release();
+}
+
+
+// Pressure-sensitive tasks that are held back still run, and are all let go, once the pressure is over
+
+static std::atomic<int> s_SensitiveRunning;
+static std::atomic<int> s_SensitiveDone;
+
+IThreadPool::TASK_RETURN __cdecl SensitiveTask(void *param0, void *param1, size_t task_number)
+{
+	s_SensitiveRunning++;
+	Sleep(5);
+	s_SensitiveRunning--;
+
+	s_SensitiveDone++;
+
+	return IThreadPool::TR_OK;
+}
+
+static void TestPressureSensitive()
+{
+	IThreadPool *ppool = IThreadPool::Create(4);
+	s_SensitiveRunning = 0;
+	s_SensitiveDone = 0;
+
+	// the lowest thresholds there are, so that whatever else the host is doing is likely to count as pressure
+	IThreadPool::PRESSURE_CONTROL pc;
+	pc.stall_us[IThreadPool::PR_MEMORY] = 1;
+	pc.stall_us[IThreadPool::PR_CPU] = 1;
+	pc.max_sensitive = 1;
+
+	if (!ppool->SetPressureControl(&pc))
+	{
+		printf("pressure stall information isn't available; skipping the pressure-sensitive tasks\n");
+		ppool->Release();
+		return;
+	}
+
+	ITaskGroup *pgroup = ppool->CreateTaskGroup();
+
+	IThreadPool::TASK_ATTRIBUTES attr;
+	attr.group = pgroup;
+	attr.pressure_sensitive = true;
+
+	ppool->RunTaskEx(attr, SensitiveTask, nullptr, nullptr, 40);
+
+	CHECK(pgroup->Wait(INFINITE));
+	pgroup->Release();
+
+	IThreadPool::PRESSURE_STATS stats;
+	ppool->GetPressureStats(stats);
+
+	CHECK(s_SensitiveDone == 40);
+	CHECK(stats.deferred == 0);
+	CHECK(GetSettledBusyCount(ppool) == 0);
+
+	ppool->SetPressureControl(nullptr);
+	ppool->Release();
+}
+
+
+// A task that yields on a pool with no threads runs again in the same Flush, ahead of the tasks it queued
+
+static IThreadPool *s_pYieldPool;
+static std::string s_YieldOrder;
+
+IThreadPool::TASK_RETURN __cdecl YieldAfter(void *param0, void *param1, size_t task_number)
+{
+	s_YieldOrder += "B";
+	return IThreadPool::TR_OK;
+}
+
+IThreadPool::TASK_RETURN __cdecl YieldFirst(void *param0, void *param1, size_t task_number)
+{
+	int &runs = *(int *)param0;
+
+	s_YieldOrder += "A";
+
+	if (runs++)
+		return IThreadPool::TR_OK;
+
+	s_pYieldPool->RunTask(YieldAfter, nullptr, nullptr, 2);
+
+	return IThreadPool::TR_YIELD;
+}
+
+static void TestYieldFlush()
+{
+	s_pYieldPool = IThreadPool::Create(0);
+	s_YieldOrder.clear();
+
+	int runs = 0;
+	s_pYieldPool->RunTask(YieldFirst, &runs);
+	s_pYieldPool->Flush();
+
+	CHECK(s_YieldOrder == "AABB");
+
+	s_pYieldPool->Release();
+}
+
+
+// Tasks that touch the same data run in submission order: reads after the write before them, and a write after
+// the reads before it
+
+static std::mutex s_mutexDepOrder;
+static std::string s_DepOrder;
+static int s_DepValue;
+
+IThreadPool::TASK_RETURN __cdecl DepWrite(void *param0, void *param1, size_t task_number)
+{
+	Sleep(5);
+
+	std::lock_guard<std::mutex> l(s_mutexDepOrder);
+	s_DepValue = (int)(intptr_t)param0;
+	s_DepOrder += "W";
+
+	return IThreadPool::TR_OK;
+}
+
+IThreadPool::TASK_RETURN __cdecl DepRead(void *param0, void *param1, size_t task_number)
+{
+	Sleep(2);
+
+	std::lock_guard<std::mutex> l(s_mutexDepOrder);
+	if (s_DepValue != (int)(intptr_t)param0)
+		s_DepOrder += "!";
+	s_DepOrder += "R";
+
+	return IThreadPool::TR_OK;
+}
+
+static void TestDependencies(size_t threads)
+{
+	IThreadPool *ppool = IThreadPool::Create(threads);
+	ITaskGroup *pgroup = ppool->CreateTaskGroup();
+	s_DepOrder.clear();
+	s_DepValue = 0;
+
+	const void *data[1] = {&s_DepValue};
+
+	IThreadPool::TASK_ATTRIBUTES write;
+	write.group = pgroup;
+	write.writes = data;
+	write.num_writes = 1;
+
+	IThreadPool::TASK_ATTRIBUTES read;
+	read.group = pgroup;
+	read.reads = data;
+	read.num_reads = 1;
+
+	ppool->RunTaskEx(write, DepWrite, (void *)1);
+	ppool->RunTaskEx(read, DepRead, (void *)1, nullptr, 3);
+	ppool->RunTaskEx(write, DepWrite, (void *)2);
+	ppool->RunTaskEx(read, DepRead, (void *)2);
+
+	if (!threads)
+	{
+		// each Flush only runs what was ready when it started
+		for (int i = 0; (i < 10) && (s_DepOrder.size() < 6); i++)
+			ppool->Flush();
+	}
+
+	CHECK(pgroup->Wait(5000));
+	CHECK(s_DepOrder == "WRRRWR");
+
+	pgroup->Release();
+	ppool->Release();
+}
+
+
+// A coalescing completion port delivers every completion, in far fewer wakeups than there are completions
+
+static const size_t PORT_TASKS = 4000;
+
+IThreadPool::TASK_RETURN __cdecl PortTask(void *param0, void *param1, size_t task_number)
+{
+	volatile int x = 0;
+	for (int i = 0; i < 200; i++)
+		x += i;
+
+	return IThreadPool::TR_OK;
+}
+
+static void TestCompletionPort(size_t threads)
+{
+	IThreadPool *ppool = IThreadPool::Create(threads);
+
+	ICompletionPort *pport = ppool->CreateCompletionPort(256);
+	pport->SetCoalescing(64, 2000);
+
+	IThreadPool::TASK_ATTRIBUTES attr;
+	attr.completion_port = pport;
+
+	for (size_t i = 0; i < PORT_TASKS / 100; i++)
+		ppool->RunTaskEx(attr, PortTask, (void *)0x1234, (void *)i, 100);
+
+	if (!threads)
+		ppool->Flush();
+
+	std::vector<int> seen(PORT_TASKS, 0);
+	size_t got = 0, calls = 0, bad = 0;
+
+	ICompletionPort::COMPLETION c[256];
+	while (got < PORT_TASKS)
+	{
+		size_t n = pport->Dequeue(c, 256, 5000);
+		if (!n)
+			break;
+
+		calls++;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			size_t call = (size_t)c[i].param1;
+			if ((c[i].param0 != (void *)0x1234) || (call >= (PORT_TASKS / 100)) || (c[i].task_number >= 100))
+			{
+				bad++;
+				continue;
+			}
+
+			seen[(call * 100) + c[i].task_number]++;
+		}
+
+		got += n;
+	}
+
+	size_t missing = 0;
+	for (int s : seen)
+		missing += (s != 1);
+
+	CHECK(got == PORT_TASKS);
+	CHECK(!bad);
+	CHECK(!missing);
+	CHECK(!pport->GetPendingCount());
+	CHECK(calls < (PORT_TASKS / 8));
+	CHECK(pport->GetWakeCount() <= (calls * 2));
+
+	pport->Release();
+
+	ppool->WaitForAllTasks(INFINITE);
+	ppool->Release();
+}
+
+
+int main(int argc, char **argv)
+{
+	static const size_t THREADS[] = {0, 1, 3};
+
+	for (size_t threads : THREADS)
+	{
+		printf("%zu threads\n", threads);
+
+		TestScopes(threads);
+		TestCancelledBusy(threads);
+		TestDependencies(threads);
+		TestCompletionPort(threads);
+	}
+
+	TestPressureSensitive();
+	TestYieldFlush();
+
+	if (s_Failures)
+		printf("%d checks failed\n", s_Failures);
+	else
+		printf("all checks passed\n");
+
+	return s_Failures;
+}